@@ -6,10 +6,20 @@
 //#include <sdsl/bit_vectors.hpp>
 #include <random>  // Include the <random> header
 #include "mybitarray.hpp"
+#include "functions_memory.hpp"
+#include "sharded_counter.hpp"
+#include <algorithm>
 
 
 #pragma once
 
+__extension__ typedef unsigned __int128 fast_range_product;
+
+// Maps a hash to [0, range) with one multiply and shift, so filter sizes need not be powers of two
+inline uint64_t fast_range(uint64_t hash, uint64_t range){
+    return uint64_t((fast_range_product(hash) * range) >> 64);
+}
+
 // === SIMPLE RESIZING ===
 // Atomic double bloom filter using my atomic bitarray
 class DoubleAtomicDoubleBloomFilterS {
@@ -234,13 +244,14 @@ class DoubleAtomicDoubleBloomFilter {
 private:
     //MyAtomicBitArray * bitArray;
     MyAtomicBitArrayFT * bitArray;
-    std::size_t mask;
+    std::size_t size;
     std::size_t numHashFunctions;
-    std::atomic<std::size_t> new_in_first;
-    std::atomic<std::size_t> new_in_second;
+    ShardedCounter new_in_first;
+    ShardedCounter new_in_second;
     std::vector<std::size_t> seeds;  // Store random seeds
-    std::atomic<std::size_t> failed_insertions_in_first;
+    ShardedCounter failed_insertions_in_first;
     bool resized;
+    bool double_hashing;
 
 public:
     /*
@@ -250,8 +261,9 @@ public:
         //std::cout << "numver of hash functionsis " << numHashFunctions << "\n";
     }
     */
-    DoubleAtomicDoubleBloomFilter(std::size_t size, std::size_t numHashFunctions)
-        : mask(size - 1), numHashFunctions(numHashFunctions), new_in_first(0), new_in_second(0), failed_insertions_in_first(0), resized(false) {
+    // double_hashing = derive all bit positions from one XXH3-128 hash instead of one XXH64 per hash function
+    DoubleAtomicDoubleBloomFilter(std::size_t size, std::size_t numHashFunctions, bool double_hashing = false)
+        : size(size), numHashFunctions(numHashFunctions), resized(false), double_hashing(double_hashing) {
         seeds = generate_seeds_2(numHashFunctions);  // Generate random seeds
         bitArray = new MyAtomicBitArrayFT(2*size);
         //std::cout << "numver of hash functionsis " << numHashFunctions << "\n";
@@ -262,21 +274,31 @@ public:
     }
 
     uint64_t get_failed_insertions_in_first(){
-        return failed_insertions_in_first.load(std::memory_order_acquire);
+        return failed_insertions_in_first.load();
     }
 
     uint64_t get_new_in_first(){
-        return new_in_first.load(std::memory_order_acquire);
+        return new_in_first.load();
     }
 
     uint64_t get_new_in_second(){
-        return new_in_second.load(std::memory_order_acquire);
+        return new_in_second.load();
     }
 
     inline void calculate_hashes(uint64_t value, std::vector<uint64_t> &hash_values){
+        if (double_hashing){
+            // Kirsch-Mitzenmacher: h1 + i*h2, odd h2 gives distinct 64-bit values before range reduction
+            XXH128_hash_t hash = XXH3_128bits_withSeed(&value, sizeof(value), seeds[0]);
+            uint64_t h1 = hash.low64;
+            uint64_t h2 = hash.high64 | 1;
+            for (std::size_t i = 0; i < numHashFunctions; ++i) {
+                hash_values[i] = fast_range(h1 + i*h2, size);
+            }
+            return;
+        }
         for (std::size_t i = 0; i < numHashFunctions; ++i) {
             std::size_t hash = XXH64(&value, sizeof(value), seeds[i]);
-            hash_values[i] = hash & mask;
+            hash_values[i] = fast_range(hash, size);
         }
     }
 
@@ -294,8 +316,8 @@ public:
     }
     */
    
-    void resize(){
-        bitArray->squeeze();
+    void resize(std::size_t n_threads = 1){
+        bitArray->squeeze(n_threads);
         resized = true;
     }
     
@@ -336,6 +358,13 @@ public:
         }
     }
 
+    // True if value is in the second filter. All bits are tested so that their cache misses
+    // overlap, stopping at the first unset bit was slower
+    bool second_contains_value(uint64_t value, std::vector<uint64_t> &hash_values){
+        calculate_hashes(value, hash_values);
+        return second_contains(hash_values) == numHashFunctions;
+    }
+
     bool insert_in_first(std::vector<uint64_t> &hash_values, uint64_t already_set_bits){
         //std::cout << "== Inserting in first\n";
         uint64_t my_set_bits = 0;
@@ -368,7 +397,8 @@ public:
     }
 
     // Needs to be modified to take atomicity into account
-    void insertion_process(uint64_t value, std::vector<uint64_t> &hash_values){
+    // Returns 1 if the value was new, 2 if it was seen once before and 3 if it was already in the second filter
+    uint64_t insertion_process(uint64_t value, std::vector<uint64_t> &hash_values){
         
         // Calculate hashes
         calculate_hashes(value, hash_values); 
@@ -376,7 +406,7 @@ public:
         uint64_t set_second_bits = second_contains(hash_values);
         if (set_second_bits == numHashFunctions){
             //std::cout << "Found in second1\n";
-            return;
+            return 3;
         }
         // Check if exists in first
         uint64_t set_first_bits = first_contains(hash_values);
@@ -386,28 +416,29 @@ public:
             if (insert_in_second(hash_values, set_second_bits)){
                 // If insertion was succesful, increase count
                 //std::cout << "Increase second count1\n";
-                size_t nisu = new_in_second.load(std::memory_order_acquire);
-                while(!new_in_second.compare_exchange_strong(nisu, nisu+1, std::memory_order_acq_rel,std::memory_order_relaxed)){}
+                new_in_second.add();
+                return 2;
             }
+            return 3;
         } else {
             // If not, insert in first
             //std::cout << "inserting in first\n";
             if (insert_in_first(hash_values, set_first_bits)){
                 //std::cout << "-inserted succesfully\n";
                 // If insertion was succesful, increase count
-                size_t nifu = new_in_first.load(std::memory_order_acquire);
-                while(!new_in_first.compare_exchange_strong(nifu, nifu+1, std::memory_order_acq_rel,std::memory_order_relaxed)){}
+                new_in_first.add();
+                return 1;
             // It was inserted by someone else so we need to put it in the second filter
             } else {
-                size_t fails = failed_insertions_in_first.load(std::memory_order_acquire);
-                while(!failed_insertions_in_first.compare_exchange_strong(fails, fails+1, std::memory_order_acq_rel,std::memory_order_relaxed)){}
+                failed_insertions_in_first.add();
                 //std::cout << "-insertion failed\n";
                 if (insert_in_second(hash_values, set_second_bits)){
                     // If insertion was succesful, increase count
                     //std::cout << "Increase second count2\n";
-                    size_t nisu = new_in_second.load(std::memory_order_acquire);
-                    while(!new_in_second.compare_exchange_strong(nisu, nisu+1, std::memory_order_acq_rel,std::memory_order_relaxed)){}
+                    new_in_second.add();
+                    return 2;
                 }
+                return 3;
             }
         }
     }
@@ -451,6 +482,308 @@ private:
     }
 };
 
+// Blocked atomic double bloom filter: every value maps to one 64-byte block (8 words) and sets all of its bits in one word.
+// Words 0-3 of a block hold the first occurrence bits and words 4-7 the second occurrence bits, so an insertion touches one
+// cache line and costs one or two fetch_ors. Same interface as DoubleAtomicDoubleBloomFilter.
+// Needs more bits than the standard filter for the same false positive rate, see mathfunctions::word_blocked_bloom_filter_bits.
+// hash_values[0] is block * 8 + word and hash_values[1] the bit mask of the value.
+class BlockedAtomicDoubleBloomFilter {
+private:
+    std::atomic<uint64_t> * words;
+    std::size_t bytes;
+    std::size_t blocks;
+    std::size_t numHashFunctions;
+    ShardedCounter new_in_first;
+    ShardedCounter new_in_second;
+    ShardedCounter failed_insertions_in_first;
+    bool resized;
+    bool double_hashing;
+
+    static const std::size_t words_per_block = 8;
+    static const std::size_t block_seed = 2411;
+    static const std::size_t bit_seed = 3253;
+
+    // Index of the second occurrence word, blocks only keep their second half after resizing
+    std::size_t second_word(std::vector<uint64_t> &hash_values) const {
+        if (!resized)
+            return hash_values[0] + words_per_block/2;
+        return (hash_values[0] / words_per_block) * (words_per_block/2) + (hash_values[0] % words_per_block);
+    }
+
+public:
+    // size = bits in each of the two filters, rounded up to whole blocks
+    // double_hashing = take the block and bit hashes from one XXH3-128 hash instead of two XXH64 hashes
+    BlockedAtomicDoubleBloomFilter(std::size_t size, std::size_t numHashFunctions, bool double_hashing = false)
+        : numHashFunctions(std::min(numHashFunctions, std::size_t(64))), resized(false), double_hashing(double_hashing) {
+        blocks = std::max(std::size_t(1), (2*size + 64*words_per_block - 1) / (64*words_per_block));
+        bytes = blocks * words_per_block * sizeof(uint64_t);
+        // Zero-filled pages are empty words
+        words = static_cast<std::atomic<uint64_t>*>(memoryfunctions::allocate_table_memory(bytes, false));
+    }
+
+    ~BlockedAtomicDoubleBloomFilter(){
+        memoryfunctions::free_table_memory(words, bytes);
+    }
+
+    uint64_t get_failed_insertions_in_first(){
+        return failed_insertions_in_first.load();
+    }
+
+    uint64_t get_new_in_first(){
+        return new_in_first.load();
+    }
+
+    uint64_t get_new_in_second(){
+        return new_in_second.load();
+    }
+
+    inline void calculate_hashes(uint64_t value, std::vector<uint64_t> &hash_values){
+        if (hash_values.size() < 2)
+            hash_values.resize(2);
+        uint64_t block_hash, bit_hash;
+        if (double_hashing){
+            XXH128_hash_t hash = XXH3_128bits_withSeed(&value, sizeof(value), block_seed);
+            block_hash = hash.low64;
+            bit_hash = hash.high64;
+        } else {
+            block_hash = XXH64(&value, sizeof(value), block_seed);
+            bit_hash = XXH64(&value, sizeof(value), bit_seed);
+        }
+        // Block from the top bits, word of the block from the low bits
+        hash_values[0] = fast_range(block_hash, blocks) * words_per_block + (block_hash & 3);
+        // Distinct bit positions from the top bits of a linear congruential sequence seeded by the bit hash,
+        // so that all masks are equally likely
+        uint64_t mask = 0;
+        std::size_t set_bits = 0;
+        while (set_bits < numHashFunctions){
+            bit_hash = bit_hash * 6364136223846793005ULL + 1442695040888963407ULL;
+            uint64_t bit = uint64_t(1) << (bit_hash >> 58);
+            if ((mask & bit) == 0){
+                mask |= bit;
+                set_bits++;
+            }
+        }
+        hash_values[1] = mask;
+    }
+
+    // Keeps only the second occurrence words, packed to the first half of the array
+    void resize(std::size_t n_threads = 1){
+        memoryfunctions::compact_in_place(blocks, n_threads, [this](uint64_t begin, uint64_t end){
+            for (uint64_t block = begin; block < end; block++){
+                for (std::size_t w = 0; w < words_per_block/2; w++){
+                    uint64_t word = words[block*words_per_block + words_per_block/2 + w].load(std::memory_order_relaxed);
+                    words[block*(words_per_block/2) + w].store(word, std::memory_order_relaxed);
+                }
+            }
+        });
+        memoryfunctions::shrink_table_memory(words, bytes, bytes/2);
+        resized = true;
+    }
+
+    uint64_t first_contains(std::vector<uint64_t> &hash_values){
+        if (resized)
+            return 0;
+        uint64_t mask = hash_values[1];
+        return ((words[hash_values[0]].load(std::memory_order_acquire) & mask) == mask) ? numHashFunctions : 0;
+    }
+
+    uint64_t second_contains(std::vector<uint64_t> &hash_values){
+        uint64_t mask = hash_values[1];
+        return ((words[second_word(hash_values)].load(std::memory_order_acquire) & mask) == mask) ? numHashFunctions : 0;
+    }
+
+    bool second_contains_value(uint64_t value, std::vector<uint64_t> &hash_values){
+        calculate_hashes(value, hash_values);
+        return second_contains(hash_values) == numHashFunctions;
+    }
+
+    // Returns 1 if the value was new, 2 if it was seen once before and 3 if it was already in the second filter
+    uint64_t insertion_process(uint64_t value, std::vector<uint64_t> &hash_values){
+        calculate_hashes(value, hash_values);
+        uint64_t mask = hash_values[1];
+        std::atomic<uint64_t> & first = words[hash_values[0]];
+        std::atomic<uint64_t> & second = words[hash_values[0] + words_per_block/2];
+        // Already in second
+        if ((second.load(std::memory_order_acquire) & mask) == mask)
+            return 3;
+        // Setting the bits tells atomically whether the value was already in first
+        if ((first.fetch_or(mask, std::memory_order_acq_rel) & mask) != mask){
+            new_in_first.add();
+            return 1;
+        }
+        if ((second.fetch_or(mask, std::memory_order_acq_rel) & mask) != mask){
+            new_in_second.add();
+            return 2;
+        }
+        return 3;
+    }
+};
+
+// Blocked counting bloom filter with 4-bit saturating counters. Every value has numHashFunctions counters in
+// one 64-byte block (128 counters), and a value passes once all of its counters have reached the threshold,
+// so only values seen at least threshold times (at most 15) reach the hash table. Same interface as
+// DoubleAtomicDoubleBloomFilter, the "second filter" is the set of values that have passed.
+// hash_values[0] is the block, hash_values[1] the first counter and hash_values[2] the odd counter stride.
+class CountingBlockedBloomFilter {
+private:
+    std::atomic<uint64_t> * words;
+    std::size_t bytes;
+    std::size_t blocks;
+    std::size_t numHashFunctions;
+    uint64_t threshold;
+    ShardedCounter new_in_first;
+    ShardedCounter new_in_second;
+    bool resized;
+    bool double_hashing;
+
+    static const std::size_t words_per_block = 8;
+    static const std::size_t counters_per_word = 16;
+    static const std::size_t counters_per_block = words_per_block * counters_per_word;
+    static const std::size_t block_seed = 2411;
+    static const std::size_t counter_seed = 3253;
+
+    inline std::size_t counter_position(std::vector<uint64_t> &hash_values, std::size_t i) const {
+        return (hash_values[1] + i*hash_values[2]) % counters_per_block;
+    }
+
+public:
+    static const uint64_t max_threshold = 15;
+
+    // size = counters, rounded up to whole blocks, threshold = occurrences needed to pass
+    CountingBlockedBloomFilter(std::size_t size, std::size_t numHashFunctions, bool double_hashing = false, uint64_t threshold = 2)
+        : numHashFunctions(std::min(numHashFunctions, counters_per_block)), threshold(std::max(uint64_t(1), std::min(threshold, max_threshold))),
+          resized(false), double_hashing(double_hashing) {
+        blocks = std::max(std::size_t(1), (size + counters_per_block - 1) / counters_per_block);
+        bytes = blocks * words_per_block * sizeof(uint64_t);
+        // Zero-filled pages are zero counters
+        words = static_cast<std::atomic<uint64_t>*>(memoryfunctions::allocate_table_memory(bytes, false));
+    }
+
+    ~CountingBlockedBloomFilter(){
+        memoryfunctions::free_table_memory(words, bytes);
+    }
+
+    uint64_t get_failed_insertions_in_first(){
+        return 0;
+    }
+
+    uint64_t get_new_in_first(){
+        return new_in_first.load();
+    }
+
+    uint64_t get_new_in_second(){
+        return new_in_second.load();
+    }
+
+    inline void calculate_hashes(uint64_t value, std::vector<uint64_t> &hash_values){
+        if (hash_values.size() < 3)
+            hash_values.resize(3);
+        uint64_t block_hash, counter_hash;
+        if (double_hashing){
+            XXH128_hash_t hash = XXH3_128bits_withSeed(&value, sizeof(value), block_seed);
+            block_hash = hash.low64;
+            counter_hash = hash.high64;
+        } else {
+            block_hash = XXH64(&value, sizeof(value), block_seed);
+            counter_hash = XXH64(&value, sizeof(value), counter_seed);
+        }
+        hash_values[0] = fast_range(block_hash, blocks);
+        // Counters a + i*b with odd b are distinct for up to 128 hash functions
+        hash_values[1] = counter_hash % counters_per_block;
+        hash_values[2] = ((counter_hash >> 7) % counters_per_block) | 1;
+    }
+
+    // Replaces the counters with one bit per counter telling if it reached the threshold, packed to the first quarter of the array
+    void resize(std::size_t n_threads = 1){
+        memoryfunctions::compact_in_place(blocks, n_threads, [this](uint64_t begin, uint64_t end){
+            for (uint64_t block = begin; block < end; block++){
+                uint64_t counter_words[words_per_block];
+                for (std::size_t w = 0; w < words_per_block; w++)
+                    counter_words[w] = words[block*words_per_block + w].load(std::memory_order_relaxed);
+                for (std::size_t half = 0; half < 2; half++){
+                    uint64_t bits = 0;
+                    for (std::size_t c = 0; c < 64; c++){
+                        std::size_t counter = half*64 + c;
+                        if (((counter_words[counter / counters_per_word] >> (4*(counter % counters_per_word))) & 15) >= threshold)
+                            bits |= uint64_t(1) << c;
+                    }
+                    words[block*2 + half].store(bits, std::memory_order_relaxed);
+                }
+            }
+        });
+        memoryfunctions::shrink_table_memory(words, bytes, bytes/4);
+        resized = true;
+    }
+
+    uint64_t second_contains(std::vector<uint64_t> &hash_values){
+        for (std::size_t i = 0; i < numHashFunctions; ++i){
+            std::size_t counter = counter_position(hash_values, i);
+            if (resized){
+                if (((words[hash_values[0]*2 + counter/64].load(std::memory_order_acquire) >> (counter % 64)) & 1) == 0)
+                    return 0;
+            } else {
+                uint64_t word = words[hash_values[0]*words_per_block + counter/counters_per_word].load(std::memory_order_acquire);
+                if (((word >> (4*(counter % counters_per_word))) & 15) < threshold)
+                    return 0;
+            }
+        }
+        return numHashFunctions;
+    }
+
+    bool second_contains_value(uint64_t value, std::vector<uint64_t> &hash_values){
+        calculate_hashes(value, hash_values);
+        return second_contains(hash_values) == numHashFunctions;
+    }
+
+    // Increases the counters of the value by one, saturating at 15.
+    // Returns 1 before the value passes, 2 when it passes and 3 after that
+    uint64_t insertion_process(uint64_t value, std::vector<uint64_t> &hash_values){
+        calculate_hashes(value, hash_values);
+        // Smallest counter of the value before and after the increase
+        uint64_t old_min = 15;
+        uint64_t new_min = 15;
+        for (std::size_t w = 0; w < words_per_block; w++){
+            // Increases of the counters in this word, all made with one compare and swap
+            uint64_t counter_mask = 0;
+            for (std::size_t i = 0; i < numHashFunctions; ++i){
+                std::size_t counter = counter_position(hash_values, i);
+                if (counter / counters_per_word == w)
+                    counter_mask |= uint64_t(15) << (4*(counter % counters_per_word));
+            }
+            if (counter_mask == 0)
+                continue;
+            std::atomic<uint64_t> & word = words[hash_values[0]*words_per_block + w];
+            uint64_t expected = word.load(std::memory_order_acquire);
+            uint64_t desired;
+            uint64_t word_min;
+            do {
+                desired = expected;
+                word_min = 15;
+                for (std::size_t c = 0; c < counters_per_word; c++){
+                    uint64_t shift = 4*c;
+                    if (((counter_mask >> shift) & 15) == 0)
+                        continue;
+                    uint64_t count = (expected >> shift) & 15;
+                    word_min = std::min(word_min, count);
+                    if (count < 15)
+                        desired += uint64_t(1) << shift;
+                }
+            } while (desired != expected && !word.compare_exchange_weak(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire));
+            old_min = std::min(old_min, word_min);
+            new_min = std::min(new_min, std::min(word_min + 1, uint64_t(15)));
+        }
+        if (old_min == 0)
+            new_in_first.add();
+        if (old_min >= threshold)
+            return 3;
+        if (new_min >= threshold){
+            new_in_second.add();
+            return 2;
+        }
+        return 1;
+    }
+};
+
 // Regular double bloom filter using my bit array
 class DoubleDoubleBloomFilter {
 private:
@@ -0,0 +1,54 @@
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+#pragma once
+
+//////////////////////////////////////////////
+//
+// Binary k-mer database output
+//
+//////////////////////////////////////////////
+
+/*
+    File layout (little-endian, as on the x86-64 and aarch64 hosts kaarme runs on):
+
+    header (32 bytes):
+        8 bytes  magic "KAARMEDB"
+        uint32   format version (1)
+        uint32   k-mer length k
+        uint32   64-bit words per k-mer, (k + 31) / 32
+        uint32   bytes per count (4)
+        uint64   number of records
+
+    records, each 8 * words + 4 bytes:
+        uint64   words of the canonical k-mer, 2 bits per character (A=0, C=1, G=2, T=3),
+                 leftmost word first as in KMerFactoryCanonical2BC: the first word holds
+                 the first k - 32 * (words - 1) characters, the first character in its
+                 highest used bits, and the last character is in the lowest bits of the last word
+        uint32   count, saturated at 2^32 - 1
+*/
+namespace kmerdatabasefunctions
+{
+    const uint64_t header_bytes = 32;
+
+    const uint32_t format_version = 1;
+
+    const uint32_t count_bytes = 4;
+
+    uint32_t words_per_kmer(uint32_t kmer_len);
+
+    uint64_t record_bytes(uint32_t kmer_len);
+
+    // Writes the header_bytes long header in header
+    void fill_header(char* header, uint32_t kmer_len, uint64_t records);
+
+    // Returns the number of records in the header, exits if it is not a database of k-mers of length kmer_len
+    uint64_t header_records(const char* header, uint32_t kmer_len);
+
+    // Writes the record of the k-mer words and count to out, returns the end of the record
+    char* write_record(const uint64_t* kmer, uint32_t kmer_words, uint64_t count, char* out);
+
+    // Converts k-mer bytes of the byte packed plain hash tables (first byte holds the first (k-1)%4+1 characters) to words
+    void bytes2words(const uint8_t* kmer, uint32_t kmer_bytes, uint32_t kmer_words, uint64_t* out);
+}
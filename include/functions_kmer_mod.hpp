@@ -1,16 +1,55 @@
 #include <cstdint>
 #include <iostream>
+#include <algorithm>
 
 #pragma once
 
+/*
+    Bit layout of the 64-bit data word of OneCharacterAndPointerKMerAtomicVariable (from right to left):
+    * 8 bits for flags (fixed)
+    * 2 bits for right character (fixed)
+    * 2 bits for left character (fixed)
+    * count_bits bits for count
+    * pointer_bits bits for pointer
+
+    Pointer bits that a table can never use are given to the count instead.
+*/
+template<uint64_t POINTER_BITS>
+struct SlotLayout
+{
+    static_assert(POINTER_BITS > 0 && POINTER_BITS < 52, "Slot layout needs room for the count");
+
+    static constexpr uint64_t right_char_shift = 8;
+    static constexpr uint64_t left_char_shift = 10;
+    static constexpr uint64_t count_shift = 12;
+    static constexpr uint64_t pointer_bits = POINTER_BITS;
+    static constexpr uint64_t pointer_shift = 64 - POINTER_BITS;
+    static constexpr uint64_t count_bits = pointer_shift - count_shift;
+    // Largest count that can be stored (counts saturate here)
+    static constexpr uint64_t max_count = (uint64_t(1) << count_bits) - 1;
+    // Adding this to the data word increases the count by one
+    static constexpr uint64_t count_one = uint64_t(1) << count_shift;
+    // Everything below the pointer
+    static constexpr uint64_t below_pointer_mask = (uint64_t(1) << pointer_shift) - 1;
+    // Number of slots the pointer can address (main table and secondary array alike)
+    static constexpr uint64_t max_slots = uint64_t(1) << POINTER_BITS;
+};
+
+// 38 bits for pointer, 14 bits for count (MAX 16,383), the original layout
+typedef SlotLayout<38> SlotLayoutP38C14;
+// 32 bits for pointer, 20 bits for count (MAX 1,048,575), for tables with at most 2^32 slots
+typedef SlotLayout<32> SlotLayoutP32C20;
+
 namespace kmod
 {
     // Data modifiers, given uint64_t D and the desired operation, return D after operation
-    uint64_t modify_to_increase_count_by_one(uint64_t D);
-    uint64_t modify_predecessor_slot(uint64_t D, uint64_t predecessor_slot);
-    uint64_t modify_predecessor_slot_and_orientations(uint64_t D, uint64_t predecessor_slot, bool self_canonical_during_insertion, bool pred_canonical_during_insertion);
-    uint64_t modify_left_character(uint64_t D, uint64_t left_char);
-    uint64_t modify_right_character(uint64_t D, uint64_t right_char);
+    // Modifiers touching the count, characters or pointer depend on the slot layout
+    template<class slot_layout> uint64_t modify_to_increase_count_by_one(uint64_t D);
+    template<class slot_layout> uint64_t modify_to_increase_count_by(uint64_t D, uint64_t increase);
+    template<class slot_layout> uint64_t modify_predecessor_slot(uint64_t D, uint64_t predecessor_slot);
+    template<class slot_layout> uint64_t modify_predecessor_slot_and_orientations(uint64_t D, uint64_t predecessor_slot, bool self_canonical_during_insertion, bool pred_canonical_during_insertion);
+    template<class slot_layout> uint64_t modify_left_character(uint64_t D, uint64_t left_char);
+    template<class slot_layout> uint64_t modify_right_character(uint64_t D, uint64_t right_char);
     uint64_t modify_to_occupied(uint64_t D);
     uint64_t modify_to_unoccupied(uint64_t D);
     uint64_t modify_to_have_predecessor(uint64_t D);
@@ -27,6 +66,13 @@ namespace kmod
     uint64_t modify_to_be_unflagged_1(uint64_t D);
     uint64_t modify_to_be_flagged_2(uint64_t D);
     uint64_t modify_to_be_unflagged_2(uint64_t D);
-    uint64_t modify_for_migration(uint64_t D, uint64_t left_char, uint64_t right_char, uint64_t  predecessor_slot, uint64_t self_forward_canonical, uint64_t pred_forward_canonical);
-    uint64_t modify_for_insertion(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, bool self_canonical_during_insertion, uint64_t left_char, uint64_t right_char);
+    template<class slot_layout> uint64_t modify_for_migration(uint64_t D, uint64_t left_char, uint64_t right_char, uint64_t  predecessor_slot, uint64_t self_forward_canonical, uint64_t pred_forward_canonical);
+    template<class slot_layout> uint64_t modify_for_insertion(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, bool self_canonical_during_insertion, uint64_t left_char, uint64_t right_char);
+
+    // Data modifiers for OneCharacterAndPointerKMerAtomicVariableBIG (4 characters per side, count kept separately)
+    uint64_t modify_left_characters_big(uint64_t D, uint64_t left_chars);
+    uint64_t modify_right_characters_big(uint64_t D, uint64_t right_chars);
+    uint64_t modify_predecessor_distance_big(uint64_t D, uint64_t predecessor_distance);
+    uint64_t modify_for_migration_big(uint64_t D, uint64_t left_chars, uint64_t right_chars, uint64_t predecessor_slot, uint64_t predecessor_distance, bool self_canonical_during_insertion, bool pred_canonical_during_insertion);
+    uint64_t modify_for_insertion_big(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, uint64_t predecessor_distance, bool self_canonical_during_insertion, uint64_t left_chars, uint64_t right_chars);
 }
\ No newline at end of file
@@ -32,6 +32,31 @@ namespace mathfunctions
     */
     uint64_t next_prime3mod4(uint64_t at_least);
 
+    /*
+        This function returns the size of one shard when
+        min_slots slots are split into n_shards hash tables
+
+        Uneven shards (minimizer partitions) get 50% more room
+    */
+    uint64_t shard_hash_table_size(uint64_t min_slots, uint64_t n_shards, bool uneven_shards);
+
+    /*
+        This function returns the false positive rate of a bloom filter
+        of n_words words of word_bits bits, when each of n_items items
+        sets n_hash_functions distinct random bits of one random word
+    */
+    double word_blocked_bloom_filter_fpr(double n_words, uint64_t n_items, uint64_t n_hash_functions, uint64_t word_bits);
+
+    /*
+        This function returns the smallest number of bits for which
+        a word blocked bloom filter of n_items items reaches the false
+        positive rate fpr, and the number of hash functions for it
+
+        Needs more bits than the textbook formula, about 1.25 times
+        at fpr 0.01 and 1.6 times at fpr 0.001 for 64-bit words
+    */
+    uint64_t word_blocked_bloom_filter_bits(uint64_t n_items, double fpr, uint64_t word_bits, uint64_t& n_hash_functions);
+
 
     /*
         This function returns the multiplicative inverse of A
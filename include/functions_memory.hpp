@@ -0,0 +1,79 @@
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+//////////////////////////////////////////////
+//
+// Memory allocation for the big hash table arrays
+//
+//////////////////////////////////////////////
+
+namespace memoryfunctions
+{
+    /*
+        Returns the number of NUMA nodes that are online (1 if unknown)
+    */
+    int number_of_numa_nodes();
+
+    // Size of a transparent huge page on x86-64 and most aarch64 kernels
+    const uint64_t huge_page_bytes = uint64_t(1) << 21;
+
+    /*
+        Allocates zeroed memory for a hash table array with mmap. Pages are not
+        backed until they are first touched, so arrays whose all-zero state is a
+        valid empty table need no initialization. Arrays of at least one huge page
+        are aligned to the huge page size and advised to use huge pages.
+        If interleave is set and the machine has more than one NUMA node, pages
+        are spread round-robin over the nodes.
+        Exits if the memory cannot be allocated.
+    */
+    void* allocate_table_memory(uint64_t bytes, bool interleave);
+
+    /*
+        Returns the whole pages after the first new_bytes of memory returned by
+        allocate_table_memory to the system. The memory is still freed with the
+        original size.
+    */
+    void shrink_table_memory(void* memory, uint64_t bytes, uint64_t new_bytes);
+
+    /*
+        Frees memory returned by allocate_table_memory
+    */
+    void free_table_memory(void* memory, uint64_t bytes);
+
+    /*
+        Runs compact(begin, end) over units [0, units) of an in-place compaction
+        where units below 2i write only below what unit i reads (e.g. unit i
+        packs source words 2i and 2i+1 into word i). Units run in ranges
+        [a, 2a) one after another: a range reads only what no earlier range has
+        written, so each range is split between up to n_threads threads.
+    */
+    template<class compact_function>
+    void compact_in_place(uint64_t units, std::size_t n_threads, compact_function compact)
+    {
+        // Small ranges are not worth starting threads for
+        const uint64_t min_units_per_thread = 4096;
+        if (units == 0)
+            return;
+        compact(uint64_t(0), uint64_t(1));
+        for (uint64_t begin = 1; begin < units; begin *= 2){
+            uint64_t end = std::min(units, 2*begin);
+            uint64_t threads = std::max(uint64_t(1), std::min(uint64_t(n_threads), (end - begin) / min_units_per_thread));
+            if (threads == 1){
+                compact(begin, end);
+                continue;
+            }
+            uint64_t step = (end - begin + threads - 1) / threads;
+            std::vector<std::thread> workers;
+            for (uint64_t range_begin = begin; range_begin < end; range_begin += step)
+                workers.emplace_back(compact, range_begin, std::min(end, range_begin + step));
+            for (auto & worker : workers)
+                worker.join();
+        }
+    }
+}
@@ -23,6 +23,9 @@ namespace purestringfunctions
 
     int is_canonical(std::string & s);
 
+    // Writes value in decimal to out and returns the position after the last digit
+    char* write_uint(uint64_t value, char* out);
+
 
 }
 
@@ -43,6 +46,10 @@ namespace twobitstringfunctions
     std::string int2string_single(uint64_t s, int l);
 
     std::string int2string_multi(uint64_t* d, int b, int l);
+
+    // Writes the l characters of a k-mer packed in b blocks like in KMerFactoryCanonical2BC
+    // (first character in the highest used bits of the partly used first block) to out
+    void blocks2chars(const uint64_t* d, int b, int l, char* out);
     
     bool is_clean_string(std::string s);
 
@@ -90,6 +90,8 @@ class RollingHasherDual
         uint64_t hashed_count;
         // Two bit mod
         bool tbm;
+        // Powers d^i under mod q for i = 0,...,m
+        std::vector<uint64_t> powers;
 
 
         // Constructor
@@ -120,6 +122,8 @@ class RollingHasherDual
         void reset();
         // Load full contents from canonical k-mer factory
         void load_full_factory_canonical(KMerFactoryCanonical2BC* kmer_factory);
+        // Fill the power table (called by the constructors)
+        void compute_powers();
 };
 
 class AdderHasher1
@@ -158,4 +162,88 @@ class ProbeHasher1
         // Better quadratic probing
         uint64_t probe_4(uint64_t iteration, uint64_t position, uint64_t modulo);
 
-};
\ No newline at end of file
+};
+
+// Probe sequence h, h+1, h-1, h+4, h-4, h+9, ... which visits every slot when the number of slots is a prime = 3 mod 4
+class QuadraticProbeSequence
+{
+    private:
+        uint64_t home_slot;
+        uint64_t modulo;
+        uint64_t square;
+        uint64_t root;
+        uint64_t probes;
+        uint64_t slot;
+
+    public:
+
+        QuadraticProbeSequence(uint64_t h, uint64_t m) : home_slot(h), modulo(m), square(0), root(0), probes(1), slot(h) {};
+
+        uint64_t get_slot() const {return slot;}
+
+        // Moves to the next slot, returns false if every slot has been probed
+        bool next()
+        {
+            if (probes >= modulo)
+                return false;
+            if (probes % 2 == 1)
+            {
+                root++;
+                square = (square + 2*root - 1) % modulo;
+                slot = (home_slot + square) % modulo;
+            }
+            else
+            {
+                slot = (home_slot + modulo - square) % modulo;
+            }
+            probes++;
+            return true;
+        }
+};
+// Rolling canonical minimizer of the current k-mer. The m-mers are compared by a hash of the canonical
+// (smaller of forward and reverse complement) m-mer, so a k-mer and its reverse complement get the same minimizer.
+class CanonicalMinimizerHasher
+{
+    private:
+
+        // k-mer length
+        uint64_t k;
+        // Minimizer length (at most 32)
+        uint64_t m;
+        // Number of m-mers in one k-mer
+        uint64_t w;
+        uint64_t mmer_mask;
+        // Current m-mer in both orientations
+        uint64_t forward_mmer;
+        uint64_t backward_mmer;
+        // Characters pushed after the last reset
+        uint64_t pushed_count;
+        // Hashes of the last w m-mers (ring buffer by m-mer index)
+        std::vector<uint64_t> mmer_hashes;
+        // Smallest hash in the window and the index of its m-mer
+        uint64_t minimizer_hash;
+        uint64_t minimizer_index;
+
+        // Nonzero seed xored to the m-mers before mix, without it the all-A m-mer hashes to 0 and is the minimizer of every k-mer containing it
+        uint64_t seed;
+
+        static uint64_t mix(uint64_t x);
+
+    public:
+
+        static const uint64_t default_seed = 0x9E3779B97F4A7C15ULL;
+
+        // Other seeds give other minimizers, used to split a minimizer partition further
+        CanonicalMinimizerHasher(uint64_t k, uint64_t m, uint64_t seed = default_seed);
+
+        ~CanonicalMinimizerHasher(){};
+
+        void reset();
+
+        // Push one 2-bit character (0-3)
+        void push(uint64_t c);
+
+        // Minimizer hash of the last k pushed characters (valid when at least k characters have been pushed)
+        uint64_t get_minimizer_hash() const {return minimizer_hash;}
+
+};
@@ -100,15 +100,42 @@ class OneCharacterAndPointerKMerAtomicFlag
 };
 
 
+// Value copy of the data word of OneCharacterAndPointerKMerAtomicVariable.
+// Load the slot once with snapshot() and decode as many fields as needed without further atomic loads.
+template<class slot_layout>
+class AtomicVariableSlotSnapshot
+{
+    public:
+        uint64_t data;
+
+        constexpr explicit AtomicVariableSlotSnapshot(uint64_t d) : data(d) {}
+
+        constexpr uint64_t get_data() const {return data;}
+        constexpr uint64_t get_predecessor_slot() const {return data >> slot_layout::pointer_shift;}
+        constexpr uint64_t get_count() const {return (data >> slot_layout::count_shift) & slot_layout::max_count;}
+        constexpr uint64_t get_left_character() const {return (data >> slot_layout::left_char_shift) & uint64_t(3);}
+        constexpr uint64_t get_right_character() const {return (data >> slot_layout::right_char_shift) & uint64_t(3);}
+        constexpr bool is_occupied() const {return data & uint64_t(1);}
+        constexpr bool predecessor_exists() const {return (data >> 1) & uint64_t(1);}
+        constexpr bool left_char_is_null() const {return (data >> 2) & uint64_t(1);}
+        constexpr bool right_char_is_null() const {return (data >> 3) & uint64_t(1);}
+        constexpr bool canonical_during_insertion_self() const {return (data >> 4) & uint64_t(1);}
+        constexpr bool canonical_during_insertion_predecessor() const {return (data >> 5) & uint64_t(1);}
+        constexpr bool is_flagged_1() const {return (data >> 6) & uint64_t(1);}
+        constexpr bool is_flagged_2() const {return (data >> 7) & uint64_t(1);}
+        constexpr bool is_complete() const {return left_char_is_null() && right_char_is_null();}
+};
+
+template<class slot_layout>
 class OneCharacterAndPointerKMerAtomicVariable
 {
     
     public:
         std::atomic<uint64_t> data;
         /*
-            Data (from right to left):
-            * 38 bits for pointer (MAX 274,877,906,944 pointers: if at max -> uses 2 terabytes)
-            * 14 bits for count (MAX 16,383)
+            Data (from right to left), field widths are given by slot_layout (see functions_kmer_mod.hpp):
+            * slot_layout::pointer_bits bits for pointer (38 bits -> MAX 274,877,906,944 pointers)
+            * slot_layout::count_bits bits for count (14 bits -> MAX 16,383)
             * 2 bits for left character
             * 2 bits for right character
             * 8 bits for various flags (from right to left)
@@ -126,26 +153,53 @@ class OneCharacterAndPointerKMerAtomicVariable
         
         // Destructor
         ~OneCharacterAndPointerKMerAtomicVariable();
+
+        // Load the data word once
+        AtomicVariableSlotSnapshot<slot_layout> snapshot() const {return AtomicVariableSlotSnapshot<slot_layout>(data.load(std::memory_order_acquire));}
         
-        // Getters
-        uint64_t get_data();
-        uint64_t get_predecessor_slot();
-        uint64_t get_count();
-        uint64_t get_left_character();
-        uint64_t get_right_character();
-        bool is_occupied();
-        bool predecessor_exists();
-        bool left_char_is_null();
-        bool right_char_is_null();
-        bool canonical_during_insertion_self();
-        bool canonical_during_insertion_predecessor();
-        bool is_flagged_1();
-        bool is_flagged_2();
-        bool is_complete(); // inferred from 4 and 8
+        // Getters (each one loads the data word, use snapshot() to read several fields)
+        uint64_t get_data() const {return data.load(std::memory_order_acquire);}
+        uint64_t get_predecessor_slot() const {return snapshot().get_predecessor_slot();}
+        uint64_t get_count() const {return snapshot().get_count();}
+        uint64_t get_left_character() const {return snapshot().get_left_character();}
+        uint64_t get_right_character() const {return snapshot().get_right_character();}
+        bool is_occupied() const {return snapshot().is_occupied();}
+        bool predecessor_exists() const {return snapshot().predecessor_exists();}
+        bool left_char_is_null() const {return snapshot().left_char_is_null();}
+        bool right_char_is_null() const {return snapshot().right_char_is_null();}
+        bool canonical_during_insertion_self() const {return snapshot().canonical_during_insertion_self();}
+        bool canonical_during_insertion_predecessor() const {return snapshot().canonical_during_insertion_predecessor();}
+        bool is_flagged_1() const {return snapshot().is_flagged_1();}
+        bool is_flagged_2() const {return snapshot().is_flagged_2();}
+        bool is_complete() const {return snapshot().is_complete();} // inferred from 4 and 8
         
         // Counter increaser (+1)
         void increase_count();
 
+        // Counter increaser (+increase), one atomic update for the whole increase
+        void increase_count_by(uint64_t increase);
+
+};
+
+// Value copy of the data word of OneCharacterAndPointerKMerAtomicVariableBIG (count is not included)
+class AtomicVariableSlotSnapshotBIG
+{
+    public:
+        uint64_t data;
+
+        constexpr explicit AtomicVariableSlotSnapshotBIG(uint64_t d) : data(d) {}
+
+        constexpr uint64_t get_data() const {return data;}
+        constexpr uint64_t get_predecessor_slot() const {return data >> (64-38);}
+        constexpr uint64_t get_predecessor_distance() const {return ((data >> 8) & uint64_t(3)) + 1;}
+        constexpr uint64_t get_left_characters() const {return (data >> 18) & uint64_t(255);}
+        constexpr uint64_t get_right_characters() const {return (data >> 10) & uint64_t(255);}
+        constexpr bool is_occupied() const {return data & uint64_t(1);}
+        constexpr bool predecessor_exists() const {return (data >> 1) & uint64_t(1);}
+        constexpr bool canonical_during_insertion_self() const {return (data >> 4) & uint64_t(1);}
+        constexpr bool canonical_during_insertion_predecessor() const {return (data >> 5) & uint64_t(1);}
+        constexpr bool is_flagged_1() const {return (data >> 6) & uint64_t(1);}
+        constexpr bool is_flagged_2() const {return (data >> 7) & uint64_t(1);}
 };
 
 class OneCharacterAndPointerKMerAtomicVariableBIG
@@ -157,11 +211,11 @@ class OneCharacterAndPointerKMerAtomicVariableBIG
         /*
             Data (from right to left):
             * 38 bits for pointer (MAX 274,877,906,944 pointers: if at max -> uses 2 terabytes)
-            *  8 bits for left characters
-            *  8 bits for right characters
+            *  8 bits for left characters (first 4 characters of the canonical k-mer, first one in the lowest bits)
+            *  8 bits for right characters (last 4 characters of the canonical k-mer, first one in the lowest bits)
             * 10 bits for various flags (from right to left)
-                - (512) 1 bit for free flag 4 (marks anything that is needed)
-                - (256) 1 bit for free flag 3 (marks anything that is needed)
+                - (512) 2 bits for predecessor distance - 1 (predecessor is 1-4 k-mers back in the read)
+                - (256)
                 - (128) 1 bit for free flag 2 (marks anything that is needed)       
                 -  (64) 1 bit for free flag 1 (marks anything that is needed)
                 -  (32) 1 bit for predecessor was canonical in read when inserted
@@ -170,30 +224,38 @@ class OneCharacterAndPointerKMerAtomicVariableBIG
                 -   (4) 1 bit for left character is null
                 -   (2) 1 bit for predecessor k-mer exists (1 = exists, 0 = does not exist)
                 -   (1) 1 bit for occupied (1 = occupied, 0 = free)
+            Count is kept separately (MAX 65,535)
         */
+        // Number of characters stored on both sides
+        static constexpr uint64_t chars_per_side = 4;
+
         // Constructor
         OneCharacterAndPointerKMerAtomicVariableBIG();
         
         // Destructor
         ~OneCharacterAndPointerKMerAtomicVariableBIG();
         
-        // Getters
-        uint64_t get_data();
-        uint64_t get_predecessor_slot();
-        uint64_t get_count();
-        uint64_t get_left_character();
-        uint64_t get_right_character();
-        bool is_occupied();
-        bool predecessor_exists();
-        bool left_char_is_null();
-        bool right_char_is_null();
-        bool canonical_during_insertion_self();
-        bool canonical_during_insertion_predecessor();
-        bool is_flagged_1();
-        bool is_flagged_2();
-        bool is_complete(); // inferred from 4 and 8
+        // Load the data word once
+        AtomicVariableSlotSnapshotBIG snapshot() const {return AtomicVariableSlotSnapshotBIG(data.load(std::memory_order_acquire));}
+
+        // Getters (each one loads the data word, use snapshot() to read several fields)
+        uint64_t get_data() const {return data.load(std::memory_order_acquire);}
+        uint64_t get_predecessor_slot() const {return snapshot().get_predecessor_slot();}
+        uint64_t get_predecessor_distance() const {return snapshot().get_predecessor_distance();}
+        uint64_t get_count() const {return count.load(std::memory_order_acquire);}
+        uint64_t get_left_characters() const {return snapshot().get_left_characters();}
+        uint64_t get_right_characters() const {return snapshot().get_right_characters();}
+        bool is_occupied() const {return snapshot().is_occupied();}
+        bool predecessor_exists() const {return snapshot().predecessor_exists();}
+        bool canonical_during_insertion_self() const {return snapshot().canonical_during_insertion_self();}
+        bool canonical_during_insertion_predecessor() const {return snapshot().canonical_during_insertion_predecessor();}
+        bool is_flagged_1() const {return snapshot().is_flagged_1();}
+        bool is_flagged_2() const {return snapshot().is_flagged_2();}
         
         // Counter increaser (+1)
         void increase_count();
 
+        // Counter increaser (+increase), one atomic update for the whole increase
+        void increase_count_by(uint64_t increase);
+
 };
\ No newline at end of file
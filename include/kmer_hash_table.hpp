@@ -6,6 +6,7 @@
 #include "kmer.hpp"
 #include "hash_functions.hpp"
 #include "functions_math.hpp"
+#include "sharded_counter.hpp"
 //#include "bit_vectors.hpp"
 #include <tuple>
 //#include <sdsl/bit_vectors.hpp>
@@ -15,17 +16,29 @@
 #pragma once
 
 
+// Lock-free plain hash table for k <= 32, every k-mer is a single 64-bit word.
+// A canonical k-mer is never all T (its reverse complement all A is smaller), so the complement
+// of the k-mer is stored and an all-zero word marks an empty slot.
 class BasicAtomicHashTable
 {
     public:
         BasicAtomicKMer* kmer_array;
         uint64_t size;
         uint64_t kmer_len;
+        std::atomic<uint64_t> occupied_slots;
+        uint64_t max_occupied_slots;
     
-        BasicAtomicHashTable(uint64_t s, uint64_t k);
+        // s = size, k = k-mer length, l = maximum load factor
+        BasicAtomicHashTable(uint64_t s, uint64_t k, double l = 1.0);
 
         ~BasicAtomicHashTable();
 
+        // Inserts canonical k-mer or increases its count by n, returns false if the table is over its maximum load factor
+        bool insert_or_increase(uint64_t kmer, uint64_t hash, uint64_t n = 1);
+
+        // binary = write a binary k-mer database (see functions_kmer_database.hpp) instead of text lines
+        void write_kmers(uint64_t min_abundance, std::string& output_path, bool binary = false);
+
         //void insert_new_atomically(uint64_t kmer);
 
         //void update_count_atomically(uint64_t slot, uint64_t new_count);
@@ -44,13 +57,19 @@ class BasicAtomicFlagHashTableLong
         uint64_t size;
         uint32_t kmer_len;
         uint32_t kmer_bytes;
+        std::atomic<uint64_t> occupied_slots;
+        uint64_t max_occupied_slots;
 
-        // s = size, k = k-mer length
-        BasicAtomicFlagHashTableLong(uint64_t s, uint32_t k);
+        // s = size, k = k-mer length, l = maximum load factor
+        BasicAtomicFlagHashTableLong(uint64_t s, uint32_t k, double l = 1.0);
 
         ~BasicAtomicFlagHashTableLong();
 
-        void write_kmers(uint64_t min_abundance, std::string& output_path);
+        // Inserts canonical k-mer bytes or increases their count, returns false if the table is over its maximum load factor
+        bool insert_or_increase(const uint8_t* kmer, uint64_t hash);
+
+        // binary = write a binary k-mer database (see functions_kmer_database.hpp) instead of text lines
+        void write_kmers(uint64_t min_abundance, std::string& output_path, bool binary = false);
 
         //void insert_new_atomically(uint64_t kmer);
 
@@ -75,7 +94,8 @@ class BasicAtomicVariableHashTableLong
 
         ~BasicAtomicVariableHashTableLong();
 
-        void write_kmers(uint64_t min_abundance, std::string& output_path);
+        // binary = write a binary k-mer database (see functions_kmer_database.hpp) instead of text lines
+        void write_kmers(uint64_t min_abundance, std::string& output_path, bool binary = false);
 
         //void insert_new_atomically(uint64_t kmer);
 
@@ -87,6 +107,9 @@ class BasicAtomicVariableHashTableLong
 };
 
 
+// Lock-free plain hash table for any k, every k-mer is stored in kmer_blocks 64-bit words (leftmost block first, as in KMerFactoryCanonical2BC).
+// Count word of a slot: 0 = empty, 1 = k-mer is being written, otherwise count << 1.
+// The k-mer of a slot is published by storing its first count, readers wait while the lowest bit is set.
 class BasicAtomicVariableHashTableLong64
 {
     public:
@@ -95,12 +118,26 @@ class BasicAtomicVariableHashTableLong64
         uint64_t size;
         uint32_t kmer_len;
         uint32_t kmer_blocks;
+        std::atomic<uint64_t> occupied_slots;
+        uint64_t max_occupied_slots;
 
-        // s = size, k = k-mer length
-        BasicAtomicVariableHashTableLong64(uint64_t s, uint32_t k);
+        // s = size, k = k-mer length, l = maximum load factor
+        BasicAtomicVariableHashTableLong64(uint64_t s, uint32_t k, double l = 1.0);
 
         ~BasicAtomicVariableHashTableLong64();
 
+        // Inserts canonical k-mer blocks or increases their count by n, returns false if the table is over its maximum load factor
+        bool insert_or_increase(const uint64_t* kmer, uint64_t hash, uint64_t n = 1);
+
+        // binary = write a binary k-mer database (see functions_kmer_database.hpp) instead of text lines
+        void write_kmers(uint64_t min_abundance, std::string& output_path, bool binary = false);
+
+    private:
+        // Largest count word, counts stop increasing there
+        static const uint32_t max_count_word = ~uint32_t(1);
+
+        bool kmer_in_slot_matches(uint64_t slot, const uint64_t* kmer) const;
+
         //void insert_new_atomically(uint64_t kmer);
 
         //void update_count_atomically(uint64_t slot, uint64_t new_count);
@@ -210,13 +247,37 @@ class PointerHashTableCanonicalAF
 };
 
 
+// Per-thread direct-mapped cache of pending count increases for the atomic variable hash tables.
+// Repeated hits on the same slot (adapters, satellites...) only increase the pending count here, and the
+// slot count is updated with one atomic operation when the entry is evicted, gets full or the cache is flushed.
+class CountStagingCache
+{
+    public:
+        static constexpr uint64_t cache_entries = 1024;
+        static constexpr uint64_t max_pending = 1024;
+        uint64_t slots[cache_entries];
+        uint64_t pending[cache_entries];
+
+        CountStagingCache()
+        {
+            for (uint64_t i = 0; i < cache_entries; i++)
+            {
+                slots[i] = 0;
+                pending[i] = 0;
+            }
+        }
+};
+
+
+// slot_layout gives the bit widths of the slot data word (see functions_kmer_mod.hpp)
+template<class slot_layout>
 class PointerHashTableCanonicalAV
 {
 
     private:
 
         // k-mers are stored in this array
-        OneCharacterAndPointerKMerAtomicVariable* hash_table_array;
+        OneCharacterAndPointerKMerAtomicVariable<slot_layout>* hash_table_array;
         // Size of the hash table
         uint64_t size;
         // Length of the k-mers
@@ -224,7 +285,7 @@ class PointerHashTableCanonicalAV
         // Number of bits used to represent one character
         uint64_t bits_per_char;
         // Number of items inserted in the hash table
-        uint64_t inserted_items;
+        ShardedCounter inserted_items;
         // Number of complete k-mers inserted in the hash table (subset of inserted items)
         uint64_t inserted_complete_kmers;
         // Integers needed to store full k-mer in 2bits per char representation
@@ -235,21 +296,24 @@ class PointerHashTableCanonicalAV
         // Secondary array stuff
         uint64_t max_secondary_slots;
         uint64_t touched_secondary_slots;
-        uint64_t secondary_slots_in_use;
+        ShardedCounter secondary_slots_in_use;
         uint64_t max_secondary_slot_in_use;
         uint64_t smallest_unused_secondary_slot;
+        // Every secondary slot below this one is in use
+        uint64_t secondary_search_start;
         std::vector<uint64_t> secondary_array;
         std::vector<uint8_t> secondary_free_slots;
 
-        uint64_t max_kmer_reconstruction_chain;
-        uint64_t total_reconstruction_chain;
+        // Updated by concurrent reconstructions in the writer threads
+        std::atomic<uint64_t> max_kmer_reconstruction_chain;
+        ShardedCounter total_reconstruction_chain;
 
         std::atomic_flag secondary_lock;
 
 
     public:
         // s = slots, k = k-mer length, b = 64bit blocks per k-mer
-        PointerHashTableCanonicalAV(uint64_t s, uint64_t k, uint64_t b);
+        PointerHashTableCanonicalAV(uint64_t s, uint64_t k, uint64_t b, bool interleave = false);
 
         ~PointerHashTableCanonicalAV();
 
@@ -289,6 +353,9 @@ class PointerHashTableCanonicalAV
 
         std::string reconstruct_kmer_in_slot(uint64_t slot);
 
+        // Writes the 2-bit characters of the occupied slot to kmer_characters (kmer_len characters)
+        void reconstruct_kmer_characters_in_slot(uint64_t slot, std::vector<uint64_t>& kmer_characters);
+
         bool check_for_cycle(uint64_t reconstruction_slot, uint64_t avoid_slot);
 
         uint64_t get_number_of_inserted_items();
@@ -303,9 +370,18 @@ class PointerHashTableCanonicalAV
 
         void write_kmers_on_disk_separately_faster(uint64_t min_abundance, std::string& output_path);
 
-        void write_kmers_on_disk_separately_even_faster(uint64_t min_abundance, std::string& output_path);
+        // append = add the k-mers at the end of an existing output file, n_threads = threads that reconstruct and write k-mers,
+        // binary = write a binary k-mer database (see functions_kmer_database.hpp) instead of text lines
+        void write_kmers_on_disk_separately_even_faster(uint64_t min_abundance, std::string& output_path, bool append = false, uint64_t n_threads = 1, bool binary = false);
+
+        // If count_cache is given, count increases of existing k-mers go through it and it must be flushed before counts are read
+        uint64_t process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot, CountStagingCache* count_cache = nullptr);
 
-        uint64_t process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot);
+        // Increases the count of the slot by one, through count_cache if it is not nullptr
+        void stage_count_increase(uint64_t kmer_slot, CountStagingCache* count_cache);
+
+        // Writes all pending count increases of count_cache into the hash table
+        void flush_count_cache(CountStagingCache* count_cache);
 
         void analyze_pointer_chain_lengths();
 
@@ -315,3 +391,104 @@ class PointerHashTableCanonicalAV
 
 
 
+// Pointer hash table where every slot stores 4 characters on both sides of the canonical k-mer.
+// Predecessor pointers skip up to 4 k-mers of the read, so reconstruction chains are about 4 times shorter
+// than in PointerHashTableCanonicalAV at the cost of a 16 byte slot (8 bytes in PointerHashTableCanonicalAV).
+class PointerHashTableCanonicalAVBIG
+{
+
+    private:
+
+        // k-mers are stored in this array
+        OneCharacterAndPointerKMerAtomicVariableBIG* hash_table_array;
+        // Size of the hash table
+        uint64_t size;
+        // Length of the k-mers
+        uint64_t kmer_len;
+        // Number of items inserted in the hash table
+        ShardedCounter inserted_items;
+        // Integers needed to store full k-mer in 2bits per char representation
+        uint64_t kmer_blocks;
+        // Probing related stuff
+        ProbeHasher1 * probe_hasher;
+        // Secondary array stuff
+        uint64_t max_secondary_slots;
+        ShardedCounter secondary_slots_in_use;
+        uint64_t max_secondary_slot_in_use;
+        uint64_t smallest_unused_secondary_slot;
+        // Every secondary slot below this one is in use
+        uint64_t secondary_search_start;
+        std::vector<uint64_t> secondary_array;
+        std::vector<uint8_t> secondary_free_slots;
+
+        uint64_t max_kmer_reconstruction_chain;
+        uint64_t total_reconstruction_chain;
+        uint64_t number_of_reconstructions;
+
+        std::atomic_flag secondary_lock;
+
+        // Character at position i of the canonical k-mer (backward k-mer is the reverse complement)
+        uint64_t get_canonical_char(KMerFactoryCanonical2BC* kmer_factory, int i);
+
+        // First and last 4 characters of the canonical k-mer packed in 8 bits each
+        uint64_t get_canonical_left_characters(KMerFactoryCanonical2BC* kmer_factory);
+        uint64_t get_canonical_right_characters(KMerFactoryCanonical2BC* kmer_factory);
+
+        // Reconstruction frame: position j of the canonical k-mer in a chain slot is position
+        // Lc+j (Lc+k-1-j if pir) of the k-mer whose reconstruction started the chain.
+        // Returns false if the slot characters do not cover the given query position.
+        bool get_frame_char(uint64_t left_chars, uint64_t right_chars, int Lc, bool pir, int query_position, uint64_t& query_char);
+
+        // Moves the reconstruction frame from a slot to its predecessor
+        void move_frame_to_predecessor(AtomicVariableSlotSnapshotBIG slot, int& Lc, bool& pir);
+
+        // Secondary slot allocation, returns the reserved slot
+        uint64_t reserve_secondary_slot(KMerFactoryCanonical2BC* kmer_factory);
+        void free_secondary_slot(uint64_t secondary_slot);
+
+    public:
+        // s = slots, k = k-mer length, b = 64bit blocks per k-mer
+        PointerHashTableCanonicalAVBIG(uint64_t s, uint64_t k, uint64_t b);
+
+        ~PointerHashTableCanonicalAVBIG();
+
+        uint64_t get_kmer_count_in_slot(uint64_t slot);
+
+        bool slot_is_occupied(uint64_t slot);
+
+        // predecessor_distance = how many k-mers back the predecessor is in the read (0 = no predecessor)
+        // If count_cache is given, count increases of existing k-mers go through it and it must be flushed before counts are read
+        uint64_t process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, uint64_t predecessor_distance, uint64_t predecessor_slot, bool pred_canonical_during_insertion, CountStagingCache* count_cache = nullptr);
+
+        // Increases the count of the slot by one, through count_cache if it is not nullptr
+        void stage_count_increase(uint64_t kmer_slot, CountStagingCache* count_cache);
+
+        // Writes all pending count increases of count_cache into the hash table
+        void flush_count_cache(CountStagingCache* count_cache);
+
+        int quick_kmer_slot_check_sus(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot, uint64_t predecessor_distance, uint64_t predecessor_slot, bool pred_canonical_during_insertion);
+
+        bool full_kmer_slot_check(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot);
+
+        uint64_t get_secondary_array_char(uint64_t secondary_array_position, int char_position);
+
+        bool check_for_cycle(uint64_t reconstruction_slot, uint64_t avoid_slot);
+
+        std::string reconstruct_kmer_in_slot(uint64_t slot);
+
+        uint64_t count_reconstruction_chain_length_in_slot(uint64_t slot);
+
+        void analyze_pointer_chain_lengths();
+
+        void write_kmers_on_disk(uint64_t min_abundance, std::string& output_path);
+
+        uint64_t get_number_of_inserted_items();
+
+        uint64_t get_number_of_max_secondary_slots();
+
+        uint64_t get_max_number_of_secondary_slots_in_use();
+
+        // Prints the memory used by the slots and the secondary array, and the reconstruction chain lengths seen so far
+        void report_memory_usage();
+
+};
@@ -2,7 +2,12 @@
 
 #include <iostream>
 #include <cstdint>
+#include <algorithm>
 #include <cstring> // for memset
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+#include "functions_memory.hpp"
 
 class Atomic8
 {
@@ -44,31 +49,28 @@ class MyAtomicBitArrayFT
         ~MyAtomicBitArrayFT();
         bool test(uint64_t i);
         bool set(uint64_t i);
-        void squeeze();
+        void squeeze(std::size_t n_threads = 1);
 };
 
 MyAtomicBitArrayFT::MyAtomicBitArrayFT(uint64_t size)
 {
     squeezed = false;
     bit_tester = new uint8_t[8]{128,64,32,16,8,4,2,1};
-    uint64_t divres = size >> 3;
-    uint64_t rem = size & 7;
-    bits = size;
-    bytes = divres;
-    if (rem != 0)
-        bytes += 1;
+    // Any size works: rounded up so that both halves hold whole 64-bit words for squeeze
+    bits = std::max(uint64_t(128), (size + 127) & ~uint64_t(127));
+    bytes = bits >> 3;
     half_bits = bits >> 1;
     half_bytes = bytes >> 1;
     //bytes = (size & 7) == 0 ? (size >> 3) : (size >> 3) + 1;
-    array1 = new std::atomic<uint8_t>[bytes>>1]{};
-    array2 = new std::atomic<uint8_t>[bytes>>1]{};
+    array1 = static_cast<std::atomic<uint8_t>*>(memoryfunctions::allocate_table_memory(half_bytes, false));
+    array2 = static_cast<std::atomic<uint8_t>*>(memoryfunctions::allocate_table_memory(half_bytes, false));
 }
 
 MyAtomicBitArrayFT::~MyAtomicBitArrayFT()
 {
     if (!squeezed)
-        delete[] array2;
-    delete[] array1;
+        memoryfunctions::free_table_memory(array2, half_bytes);
+    memoryfunctions::free_table_memory(array1, half_bytes);
     delete[] bit_tester;
 }
 
@@ -124,41 +126,41 @@ bool MyAtomicBitArrayFT::set(uint64_t i)
     return true;
 }
 
-void MyAtomicBitArrayFT::squeeze()
+// Packs the odd bits of the 8 bytes of word into 4 bytes, bits of the lower byte to the high nibble
+static inline uint32_t squeeze_word(uint64_t word)
 {
-    squeezed = true;
-    for (uint64_t i = 0; 2*i+1 < bytes; i++){
-        uint8_t new_value = 0;
+#ifdef __BMI2__
+    uint64_t odd_bits = _pext_u64(word, 0x5555555555555555ULL);
+#else
+    uint64_t odd_bits = word & 0x5555555555555555ULL;
+    odd_bits = (odd_bits | (odd_bits >> 1)) & 0x3333333333333333ULL;
+    odd_bits = (odd_bits | (odd_bits >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    odd_bits = (odd_bits | (odd_bits >> 4)) & 0x00FF00FF00FF00FFULL;
+    odd_bits = (odd_bits | (odd_bits >> 8)) & 0x0000FFFF0000FFFFULL;
+    odd_bits = (odd_bits | (odd_bits >> 16)) & 0x00000000FFFFFFFFULL;
+#endif
+    uint32_t packed = uint32_t(odd_bits);
+    return ((packed & 0x0F0F0F0FU) << 4) | ((packed >> 4) & 0x0F0F0F0FU);
+}
 
-        if (2*i < half_bytes){
-            new_value = new_value | ((array1[2*i].load(std::memory_order_acquire)&64)<<1);
-            new_value = new_value | ((array1[2*i].load(std::memory_order_acquire)&16)<<2);
-            new_value = new_value | ((array1[2*i].load(std::memory_order_acquire)&4)<<3);
-            new_value = new_value | ((array1[2*i].load(std::memory_order_acquire)&1)<<4);
-        } else {
-            new_value = new_value | ((array2[2*i - half_bytes].load(std::memory_order_acquire)&64)<<1);
-            new_value = new_value | ((array2[2*i - half_bytes].load(std::memory_order_acquire)&16)<<2);
-            new_value = new_value | ((array2[2*i - half_bytes].load(std::memory_order_acquire)&4)<<3);
-            new_value = new_value | ((array2[2*i - half_bytes].load(std::memory_order_acquire)&1)<<4);
+// Keeps only the odd bits (second filter) packed to the first array and frees the second array.
+// Must not run concurrently with test or set.
+void MyAtomicBitArrayFT::squeeze(std::size_t n_threads)
+{
+    squeezed = true;
+    uint8_t * first = reinterpret_cast<uint8_t*>(array1);
+    uint8_t * second = reinterpret_cast<uint8_t*>(array2);
+    // Unit i packs source bytes 8i...8i+7 to bytes 4i...4i+3 of the first array
+    memoryfunctions::compact_in_place(half_bytes/4, n_threads, [=](uint64_t begin, uint64_t end){
+        for (uint64_t i = begin; i < end; i++){
+            uint64_t source = 8*i;
+            uint64_t word;
+            std::memcpy(&word, source < half_bytes ? first + source : second + (source - half_bytes), sizeof(word));
+            uint32_t packed = squeeze_word(word);
+            std::memcpy(first + 4*i, &packed, sizeof(packed));
         }
-        
-         if (2*i < half_bytes){
-            new_value = new_value | ((array1[2*i+1].load(std::memory_order_acquire)&64)>>3);
-            new_value = new_value | ((array1[2*i+1].load(std::memory_order_acquire)&16)>>2);
-            new_value = new_value | ((array1[2*i+1].load(std::memory_order_acquire)&4)>>1);
-            new_value = new_value | ((array1[2*i+1].load(std::memory_order_acquire)&1));
-        } else {
-            new_value = new_value | ((array2[2*i+1 - half_bytes].load(std::memory_order_acquire)&64)>>3);
-            new_value = new_value | ((array2[2*i+1 - half_bytes].load(std::memory_order_acquire)&16)>>2);
-            new_value = new_value | ((array2[2*i+1 - half_bytes].load(std::memory_order_acquire)&4)>>1);
-            new_value = new_value | ((array2[2*i+1 - half_bytes].load(std::memory_order_acquire)&1));
-        } 
-
-        uint8_t old_value = array1[i].load(std::memory_order_acquire);
-
-        while(!array1[i].compare_exchange_strong(old_value, new_value, std::memory_order_acq_rel, std::memory_order_relaxed)){}
-    }
-    delete[] array2;
+    });
+    memoryfunctions::free_table_memory(array2, half_bytes);
 }
 
 // Atomic bit array
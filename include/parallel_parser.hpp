@@ -12,8 +12,12 @@
 #include <thread>
 #include <zlib.h>
 #include <cstring>
+#include <algorithm>
 #include <bitset>
 #include <chrono>
+#include <mutex>
+#include <fstream>
+#include <cstdio>
 #include "functions_bloom_filter.hpp"
 #include "double_bloomfilter.hpp"
 
@@ -217,26 +221,89 @@ struct parse_input_ORIGINAL{
 
 
 // ==============================================================================================================
-// ATOMIC FLAG VERSION of BASIC HASH TABLE, MODE=0
+// SLOT ORDERED BATCH INSERTION FOR THE PLAIN HASH TABLE
+// ==============================================================================================================
+
+// One k-mer of a plain table batch, kmer is the k-mer word (k <= 32) or the offset of its blocks in the batch block buffer
+struct plain_batch_item{
+    uint64_t hash;
+    uint64_t kmer;
+};
+
+// Plain table batches are inserted when they have this many k-mers
+const size_t plain_batch_items = 1 << 20;
+
+// Inserts a batch of k-mers in slot order. Items are radix partitioned into slot ranges, each range is sorted by slot and k-mer,
+// and equal k-mers are collapsed so that each distinct k-mer is inserted once with its count.
+// Returns false if an insertion fails.
+template<class less_function, class equal_function, class insert_function>
+bool insert_plain_batch_in_slot_order(std::vector<plain_batch_item>& items, std::vector<plain_batch_item>& partitioned_items, uint64_t slots,
+                                      less_function kmer_less, equal_function kmer_equal, insert_function insert)
+{
+    const uint64_t n_ranges = 4096;
+    uint64_t range_width = slots / n_ranges + 1;
+    std::vector<size_t> range_starts(n_ranges + 1, 0);
+    for (const plain_batch_item& item : items)
+        range_starts[item.hash / range_width + 1]++;
+    for (uint64_t r = 0; r < n_ranges; r++)
+        range_starts[r + 1] += range_starts[r];
+    partitioned_items.resize(items.size());
+    std::vector<size_t> range_ends(range_starts.begin(), range_starts.end() - 1);
+    for (const plain_batch_item& item : items)
+        partitioned_items[range_ends[item.hash / range_width]++] = item;
+
+    auto item_less = [&](const plain_batch_item& a, const plain_batch_item& b){
+        return (a.hash != b.hash) ? (a.hash < b.hash) : kmer_less(a.kmer, b.kmer);
+    };
+    for (uint64_t r = 0; r < n_ranges; r++)
+    {
+        std::sort(partitioned_items.begin() + range_starts[r], partitioned_items.begin() + range_starts[r + 1], item_less);
+    }
+
+    size_t i = 0;
+    while (i < partitioned_items.size())
+    {
+        size_t run_end = i + 1;
+        while (run_end < partitioned_items.size() && partitioned_items[run_end].hash == partitioned_items[i].hash && kmer_equal(partitioned_items[run_end].kmer, partitioned_items[i].kmer))
+            run_end++;
+        if (!insert(partitioned_items[i], run_end - i))
+            return false;
+        i = run_end;
+    }
+    items.clear();
+    return true;
+}
+
+
+// ==============================================================================================================
+// LOCK-FREE ATOMIC VARIABLE VERSION of BASIC HASH TABLE, MODE=0
 // ==============================================================================================================
 
 template<class sym_type,
          bool is_gzipped=false>
-struct parse_input_atomic_flag{
+struct parse_input_basic_atomic_variable{
 
     
 
-    void operator()(std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k, sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode=2){
+    void operator()(std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k, sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, double max_load_factor, bool batch_insert, int input_mode=2, bool binary_output=false){
 
-        std::cout << "Starting atomic flag basic hash table\n";
+        std::cout << "Starting atomic variable basic hash table\n";
 
         auto start_building = std::chrono::high_resolution_clock::now();
         // Create the hash table
         //uint64_t ht_size = mathfunctions::next_prime(min_slots);
         uint64_t ht_size = mathfunctions::next_prime3mod4(min_slots);
         uint64_t kmer_len = k;
-        //BasicAtomicHashTable* basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len);
-        BasicAtomicFlagHashTableLong* basic_atomic_hash_table_long = new BasicAtomicFlagHashTableLong(ht_size, kmer_len);
+        // k-mers of at most 32 characters fit in one word and go in the lock-free table
+        bool single_word_kmers = (kmer_len <= 32);
+        BasicAtomicHashTable* basic_atomic_hash_table = nullptr;
+        BasicAtomicVariableHashTableLong64* basic_atomic_hash_table_long = nullptr;
+        if (single_word_kmers)
+            basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len, max_load_factor);
+        else
+            basic_atomic_hash_table_long = new BasicAtomicVariableHashTableLong64(ht_size, kmer_len, max_load_factor);
+        // Set when an insertion would take the table over its maximum load factor, the remaining chunks are skipped
+        std::atomic<bool> table_full(false);
 
         using chunk_type = text_chunk<sym_type>;
 
@@ -337,472 +404,152 @@ struct parse_input_atomic_flag{
             close(fd);
         };
 
-        //lambda functions that hash the kmers in a text chunk
-        //note: it is not necessary for this function to be a lambda. It can be a static function
-
-        // MODIFIED LONG
+        //lambda function that hashes the kmers in a text chunk
+        //k-mers of at most 32 characters are kept as forward and reverse complement 2-bit words,
+        //longer ones as 64-bit blocks in the k-mer factory. Neither table takes locks.
         auto hash_kmers =[&](chunk_type& chunk, size_t format){
 
-            off_t i =0, last;
-            size_t n_strings=0;
+            if (format != PLAIN && format != FASTA)
+            {
+                std::cout<<"Error : format not recognized"<<std::endl;
+                return;
+            }
 
+            off_t i = 0;
             RollingHasherDual* rolling_hasher = new RollingHasherDual(ht_size, kmer_len);
+            KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(kmer_len);
+            uint64_t kmer_mask = (kmer_len >= 32) ? ~uint64_t(0) : ((uint64_t(1) << 2*kmer_len) - 1);
+            uint64_t forward_kmer = 0;
+            uint64_t reverse_kmer = 0;
+            uint64_t chars_in_kmer = 0;
+            uint64_t new_char = 0;
+            bool parsing_header = (format == FASTA) && chunk.broken_header;
+            // With batch_insert the k-mers are collected here and inserted in slot order
+            std::vector<plain_batch_item> batch;
+            std::vector<plain_batch_item> partitioned_batch;
+            std::vector<uint64_t> batch_blocks;
+            uint64_t kmer_blocks = kmer_factory->number_of_blocks;
+            auto word_less = [](uint64_t a, uint64_t b){ return a < b; };
+            auto word_equal = [](uint64_t a, uint64_t b){ return a == b; };
+            auto blocks_less = [&](uint64_t a, uint64_t b){
+                return std::lexicographical_compare(&batch_blocks[a], &batch_blocks[a] + kmer_blocks, &batch_blocks[b], &batch_blocks[b] + kmer_blocks);
+            };
+            auto blocks_equal = [&](uint64_t a, uint64_t b){
+                return std::equal(&batch_blocks[a], &batch_blocks[a] + kmer_blocks, &batch_blocks[b]);
+            };
+            auto insert_word = [&](const plain_batch_item& item, uint64_t n){
+                return basic_atomic_hash_table->insert_or_increase(item.kmer, item.hash, n);
+            };
+            auto insert_blocks = [&](const plain_batch_item& item, uint64_t n){
+                return basic_atomic_hash_table_long->insert_or_increase(&batch_blocks[item.kmer], item.hash, n);
+            };
+            auto insert_batch = [&](){
+                bool inserted;
+                if (single_word_kmers)
+                    inserted = insert_plain_batch_in_slot_order(batch, partitioned_batch, ht_size, word_less, word_equal, insert_word);
+                else
+                    inserted = insert_plain_batch_in_slot_order(batch, partitioned_batch, ht_size, blocks_less, blocks_equal, insert_blocks);
+                batch_blocks.clear();
+                return inserted;
+            };
+            if (batch_insert)
+            {
+                size_t batch_capacity = std::min(plain_batch_items, size_t(chunk.syms_in_buff));
+                batch.reserve(batch_capacity);
+                if (!single_word_kmers)
+                    batch_blocks.reserve(batch_capacity * kmer_blocks);
+            }
 
-            switch (format) {
-                case PLAIN://one-string-per-line format
-                {
-                    int kmer_bytes = kmer_len / 4;
-                    if (kmer_len % 4 != 0)
-                        kmer_bytes += 1;
-                    // Characters in last block
-                    int fbmc = kmer_len % 4;
-                    if (fbmc == 0)
-                        fbmc = 4;
-                    // Store k-mer as string here
-                    //std::vector<uint64_t> kmer_string(kmer_blocks,0);
-                    uint8_t* kmer_string = new uint8_t[kmer_bytes];
-                    uint8_t* kmer_string_reverse = new uint8_t[kmer_bytes];
-                    int lshift = kmer_len % 4;
-                    int rshift = 4 - lshift;  
-                    // Store k-mer hash value here
-                    uint64_t kmer_hash = 0;
-                    // Store number of characters stored in the k-mer here
-                    uint64_t chars_in_kmer = 0;
-                    // Mask for relevant characters in the last k-mer block
-                    uint8_t first_block_mask = 0;
-                    // New character goes here
-                    uint8_t new_char = 0;
-                    // Character that drops out the window goes here
-                    uint64_t drop_out_char = 0;
-                    uint64_t current_check_slot = 0;
-                    bool kmer_was_found = false;
-                    bool forward_is_canonical = true;
+            assert(chunk.syms_in_buff>=k);
 
-                    for (int mi = 0; mi < fbmc; mi++)
+            //slide a window over the buffer
+            while(i<chunk.syms_in_buff){
+                if (format == FASTA)
+                {
+                    // If the current character is header starting character, skip the header and reset read buffer
+                    if (chunk.buffer[i]=='>')
+                        parsing_header = true;
+                    if (parsing_header)
                     {
-                        first_block_mask = first_block_mask << 2;
-                        first_block_mask = first_block_mask | uint8_t(3);
+                        while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
+                            i++;
+                        i++;
+                        parsing_header = false;
+                        forward_kmer = 0;
+                        reverse_kmer = 0;
+                        chars_in_kmer = 0;
+                        kmer_factory->reset();
+                        rolling_hasher->reset();
+                        continue;
                     }
-
-                    assert(chunk.syms_in_buff>=k);
-
-                    //slide a window over the buffer
-                    while(i<chunk.syms_in_buff){
-                        new_char =  uint8_t(twobitstringfunctions::char2int(chunk.buffer[i]));
-                        if(new_char > uint8_t(3)){//we encountered non-(A,C,G,T) character
-                            kmer_hash = 0;
-                            //std::fill(kmer_string.begin(), kmer_string.end(), 0);
-                            for (int ii = 0; ii < kmer_bytes; ii++)
-                                kmer_string[ii] = 0;
-                            chars_in_kmer = 0;
-                            n_strings++;
-                            rolling_hasher->reset();
-                        } else {
-                            // First get the drop out char
-                            //std::cout << "NEW CHAR IS : " << new_char << "\n";
-                            //std::cout << "NEW CHAR after shift IS : " << (new_char<<62) << "\n";
-
-                            drop_out_char = uint64_t((kmer_string[0] >> 2*(fbmc-1)) & uint8_t(3));
-                            //std::cout << "K-MER STRING IS: " << (kmer_string[0] >> 2*28) << "\n";
-                            //std::cout << "DROP PUT CHAR IS: " << drop_out_char << "\n";
-                            // Update k-mer string
-                            for (int ci = 0; ci < kmer_bytes-1; ci++)
-                            {
-                                kmer_string[ci] <<= 2;
-                                kmer_string[ci] |= (kmer_string[ci+1] >> 6);
-                            }
-                            kmer_string[0] &= first_block_mask;
-                            kmer_string[kmer_bytes-1] <<=2;
-                            kmer_string[kmer_bytes-1] |= new_char;
-
-                            // Update hash value
-                            rolling_hasher->update_rolling_hash(new_char, drop_out_char);
-                            chars_in_kmer = std::min(chars_in_kmer+1, kmer_len);
-                                                        
-                            // Build reverse k-mer
-                            // I) Swap bytes and characters within bytes
-                            for (int ci = 0; ci < kmer_bytes; ci++)
-                            {
-                                kmer_string_reverse[ci] = ((kmer_string[kmer_bytes-1-ci] & uint8_t(240)) >> 4) | ((kmer_string[kmer_bytes-1-ci] & uint8_t(15)) << 4);
-                                kmer_string_reverse[ci] = ((kmer_string_reverse[ci] & uint8_t(204)) >> 2) | ((kmer_string_reverse[ci] & uint8_t(51)) << 2);
-                            }
-                            // II) Shift bytes
-                            if (lshift != 0)
-                            {
-                                for (int ci = kmer_bytes-1; ci > 0; ci--)
-                                {
-                                    kmer_string_reverse[ci] = ((kmer_string_reverse[ci] >> 2*rshift) | (kmer_string_reverse[ci-1] << 2*lshift));
-                                }
-                                kmer_string_reverse[0] = kmer_string_reverse[0] >> 2*rshift;    
-                            }
-                            // III) And complement characters
-                            for (int ci = 0; ci < kmer_bytes; ci++)
-                            {
-                                kmer_string_reverse[ci] = ~kmer_string_reverse[ci];
-                            }
-                            kmer_string_reverse[0] &= first_block_mask;
-
-                            //std::cout << "Forward : " << std::bitset<8>(kmer_string[0]) << " " <<  std::bitset<8>(kmer_string[1]) << " " << std::bitset<8>(kmer_string[2]) << "\n";
-                            //std::cout << "Reverse : " << std::bitset<8>(kmer_string_reverse[0])<< " " << std::bitset<8>(kmer_string_reverse[1])<< " " << std::bitset<8>(kmer_string_reverse[2]) << "\n";
-                        
-                            // Determine correct orientation
-                            kmer_hash = rolling_hasher->get_current_hash_forward();
-                            forward_is_canonical = true;
-                            
-                            for (int icc = 0; icc < kmer_bytes; icc++)
-                            {
-                                if (kmer_string_reverse[icc] < kmer_string[icc])
-                                {
-                                    forward_is_canonical = false;
-                                    kmer_hash = rolling_hasher->get_current_hash_backward();
-                                    break;
-                                }
-                                else if (kmer_string_reverse[icc] > kmer_string[icc])
-                                {
-                                    break;
-                                }
-                            }
-                            // Insert the k-mer in the hash table
-                            current_check_slot = kmer_hash;
-                            kmer_was_found = false;
-                            uint64_t probing_round = 0;
-                            bool slot_is_in_use = false;
-                            bool handled_successfully = false;
-                            if (chars_in_kmer >= uint64_t(k))
-                            {
-                                if (forward_is_canonical)
-                                {
-                                    while(true)
-                                    {
-                                        probing_round=1;
-                                        // First, acquire the lock
-                                        while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                        // Then, check the k-mer
-                                        // If count == 0, no k-mer -> insert as new
-                                        if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                        {
-                                            basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                            std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes);
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // k-mer exists in the slot, check if it matches
-                                        // If match, k-mer was found
-                                        else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes) == 0)
-                                        {
-                                            // Increase count and done
-                                            basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // Otherwise, probe to next position
-                                        else
-                                        {
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            current_check_slot = current_check_slot + (probing_round*probing_round);
-                                            current_check_slot = current_check_slot % ht_size;
-                                            if (current_check_slot == kmer_hash)
-                                            {
-                                                std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                return;
-                                            }
-                                        }
-                                    }
-                                }
-                                else
-                                {
-                                    while(true)
-                                    {
-                                        probing_round=1;
-                                        // First, acquire the lock
-                                        while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                        // Then, check the k-mer
-                                        // If count == 0, no k-mer -> insert as new
-                                        if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                        {
-                                            basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                            std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes);
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // k-mer exists in the slot, check if it matches
-                                        // If match, k-mer was found
-                                        else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes) == 0)
-                                        {
-                                            // Increase count and done
-                                            basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // Otherwise, probe to next position
-                                        else
-                                        {
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            current_check_slot = current_check_slot + (probing_round*probing_round);
-                                            current_check_slot = current_check_slot % ht_size;
-                                            if (current_check_slot == kmer_hash)
-                                            {
-                                                std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                return;
-                                            }
-                                        }
-                                    }
-                                }
-                                
-                            }
-                        }
+                    // If the next character is newline, skip it
+                    if (chunk.buffer[i]=='\n')
+                    {
                         i++;
+                        continue;
                     }
-                    std::cout << "Chunk done\n";
-                    break;
                 }
-                case FASTA: 
-                {
-                    int kmer_bytes = kmer_len / 4;
-                    if (kmer_len % 4 != 0)
-                        kmer_bytes += 1;
-                    // Characters in last block
-                    int fbmc = kmer_len % 4;
-                    if (fbmc == 0)
-                        fbmc = 4;
-                    // Store k-mer as string here
-                    //std::vector<uint64_t> kmer_string(kmer_blocks,0);
-                    uint8_t* kmer_string = new uint8_t[kmer_bytes];
-                    uint8_t* kmer_string_reverse = new uint8_t[kmer_bytes];
-                    int lshift = kmer_len % 4;
-                    int rshift = 4 - lshift;  
-                    // Store k-mer hash value here
-                    uint64_t kmer_hash = 0;
-                    // Store number of characters stored in the k-mer here
-                    uint64_t chars_in_kmer = 0;
-                    // Mask for relevant characters in the last k-mer block
-                    uint8_t first_block_mask = 0;
-                    // New character goes here
-                    uint8_t new_char = 0;
-                    // Character that drops out the window goes here
-                    uint64_t drop_out_char = 0;
-                    uint64_t current_check_slot = 0;
-                    bool kmer_was_found = false;
-                    bool forward_is_canonical = true;
-
-                    for (int mi = 0; mi < fbmc; mi++)
+                new_char = twobitstringfunctions::char2int(chunk.buffer[i]);
+                if (new_char > 3){//we encountered non-(A,C,G,T) character
+                    forward_kmer = 0;
+                    reverse_kmer = 0;
+                    chars_in_kmer = 0;
+                    kmer_factory->reset();
+                    rolling_hasher->reset();
+                } else {
+                    bool inserted = true;
+                    chars_in_kmer = std::min(chars_in_kmer+1, kmer_len);
+                    if (single_word_kmers)
                     {
-                        first_block_mask = first_block_mask << 2;
-                        first_block_mask = first_block_mask | uint8_t(3);
-                    }
-
-                    assert(chunk.syms_in_buff>=k);
-                    bool parsing_header = chunk.broken_header;
-                    //slide a window over the buffer
-                    while(i<chunk.syms_in_buff){
-                        // If the current character is header starting character, reset read buffer
-                        //--------------------------------------------------------------------------------------------------------------------------------
-                        //--------------------------------------------------------------------------------------------------------------------------------
-                        // If the current character is header starting character, reset read buffer
-                        if (chunk.buffer[i]=='>')
+                        rolling_hasher->update_rolling_hash(new_char, (forward_kmer >> 2*(kmer_len-1)) & uint64_t(3));
+                        forward_kmer = ((forward_kmer << 2) | new_char) & kmer_mask;
+                        reverse_kmer = (reverse_kmer >> 2) | ((uint64_t(3) - new_char) << 2*(kmer_len-1));
+                        if (chars_in_kmer == kmer_len)
                         {
-                            parsing_header = true;
+                            plain_batch_item item;
+                            if (reverse_kmer < forward_kmer)
+                                item = {rolling_hasher->get_current_hash_backward(), reverse_kmer};
+                            else
+                                item = {rolling_hasher->get_current_hash_forward(), forward_kmer};
+                            if (batch_insert)
+                                batch.push_back(item);
+                            else
+                                inserted = basic_atomic_hash_table->insert_or_increase(item.kmer, item.hash);
                         }
-                        if (parsing_header)
-                        {
-                            while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
-                                i++;
-                            i++;
-                            parsing_header = false;
-                            kmer_hash = 0;
-                            //std::fill(kmer_string.begin(), kmer_string.end(), 0);
-                            for (int ii = 0; ii < kmer_bytes; ii++)
-                                kmer_string[ii] = 0;
-                            chars_in_kmer = 0;
-                            n_strings++;
-                            rolling_hasher->reset();
-                            continue;
-                        }                        
-                        // If the next character is newline, skip it
-                        if (chunk.buffer[i]=='\n')
+                    }
+                    else
+                    {
+                        kmer_factory->push_new_integer(new_char);
+                        rolling_hasher->update_rolling_hash(new_char, kmer_factory->get_forward_pushed_off_character());
+                        if (chars_in_kmer == kmer_len)
                         {
-                            i++;
-                            continue;
-                        }
-                        //--------------------------------------------------------------------------------------------------------------------------------
-                        //--------------------------------------------------------------------------------------------------------------------------------
-                        new_char =  uint8_t(twobitstringfunctions::char2int(chunk.buffer[i]));
-                        if(new_char > uint8_t(3)){//we encountered non-(A,C,G,T) character
-                            kmer_hash = 0;
-                            //std::fill(kmer_string.begin(), kmer_string.end(), 0);
-                            for (int ii = 0; ii < kmer_bytes; ii++)
-                                kmer_string[ii] = 0;
-                            chars_in_kmer = 0;
-                            n_strings++;
-                            rolling_hasher->reset();
-                        } else {
-                            // First get the drop out char
-                            //std::cout << "NEW CHAR IS : " << new_char << "\n";
-                            //std::cout << "NEW CHAR after shift IS : " << (new_char<<62) << "\n";
-
-                            drop_out_char = uint64_t((kmer_string[0] >> 2*(fbmc-1)) & uint8_t(3));
-                            //std::cout << "K-MER STRING IS: " << (kmer_string[0] >> 2*28) << "\n";
-                            //std::cout << "DROP PUT CHAR IS: " << drop_out_char << "\n";
-                            // Update k-mer string
-                            for (int ci = 0; ci < kmer_bytes-1; ci++)
-                            {
-                                kmer_string[ci] <<= 2;
-                                kmer_string[ci] |= (kmer_string[ci+1] >> 6);
-                            }
-                            kmer_string[0] &= first_block_mask;
-                            kmer_string[kmer_bytes-1] <<=2;
-                            kmer_string[kmer_bytes-1] |= new_char;
-
-                            // Update hash value
-                            rolling_hasher->update_rolling_hash(new_char, drop_out_char);
-                            chars_in_kmer = std::min(chars_in_kmer+1, kmer_len);
-                                                        
-                            // Build reverse k-mer
-                            // I) Swap bytes and characters within bytes
-                            for (int ci = 0; ci < kmer_bytes; ci++)
-                            {
-                                kmer_string_reverse[ci] = ((kmer_string[kmer_bytes-1-ci] & uint8_t(240)) >> 4) | ((kmer_string[kmer_bytes-1-ci] & uint8_t(15)) << 4);
-                                kmer_string_reverse[ci] = ((kmer_string_reverse[ci] & uint8_t(204)) >> 2) | ((kmer_string_reverse[ci] & uint8_t(51)) << 2);
-                            }
-                            // II) Shift bytes
-                            if (lshift != 0)
-                            {
-                                for (int ci = kmer_bytes-1; ci > 0; ci--)
-                                {
-                                    kmer_string_reverse[ci] = ((kmer_string_reverse[ci] >> 2*rshift) | (kmer_string_reverse[ci-1] << 2*lshift));
-                                }
-                                kmer_string_reverse[0] = kmer_string_reverse[0] >> 2*rshift;    
-                            }
-                            // III) And complement characters
-                            for (int ci = 0; ci < kmer_bytes; ci++)
+                            bool forward = kmer_factory->forward_kmer_is_canonical();
+                            uint64_t* kmer = forward ? kmer_factory->blocks_forward : kmer_factory->blocks_backward;
+                            uint64_t kmer_hash = forward ? rolling_hasher->get_current_hash_forward() : rolling_hasher->get_current_hash_backward();
+                            if (batch_insert)
                             {
-                                kmer_string_reverse[ci] = ~kmer_string_reverse[ci];
-                            }
-                            kmer_string_reverse[0] &= first_block_mask;
-
-                            //std::cout << "Forward : " << std::bitset<8>(kmer_string[0]) << " " <<  std::bitset<8>(kmer_string[1]) << " " << std::bitset<8>(kmer_string[2]) << "\n";
-                            //std::cout << "Reverse : " << std::bitset<8>(kmer_string_reverse[0])<< " " << std::bitset<8>(kmer_string_reverse[1])<< " " << std::bitset<8>(kmer_string_reverse[2]) << "\n";
-                        
-                            // Determine correct orientation
-                            kmer_hash = rolling_hasher->get_current_hash_forward();
-                            forward_is_canonical = true;
-                            
-                            for (int icc = 0; icc < kmer_bytes; icc++)
-                            {
-                                if (kmer_string_reverse[icc] < kmer_string[icc])
-                                {
-                                    forward_is_canonical = false;
-                                    kmer_hash = rolling_hasher->get_current_hash_backward();
-                                    break;
-                                }
-                                else if (kmer_string_reverse[icc] > kmer_string[icc])
-                                {
-                                    break;
-                                }
+                                batch.push_back({kmer_hash, batch_blocks.size()});
+                                batch_blocks.insert(batch_blocks.end(), kmer, kmer + kmer_blocks);
                             }
-                            // Insert the k-mer in the hash table
-                            current_check_slot = kmer_hash;
-                            kmer_was_found = false;
-                            uint64_t probing_round = 0;
-                            bool slot_is_in_use = false;
-                            bool handled_successfully = false;
-                            if (chars_in_kmer >= uint64_t(k))
+                            else
                             {
-                                if (forward_is_canonical)
-                                {
-                                    while(true)
-                                    {
-                                        probing_round=1;
-                                        // First, acquire the lock
-                                        while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                        // Then, check the k-mer
-                                        // If count == 0, no k-mer -> insert as new
-                                        if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                        {
-                                            basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                            std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes);
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // k-mer exists in the slot, check if it matches
-                                        // If match, k-mer was found
-                                        else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes) == 0)
-                                        {
-                                            // Increase count and done
-                                            basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // Otherwise, probe to next position
-                                        else
-                                        {
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            current_check_slot = current_check_slot + (probing_round*probing_round);
-                                            current_check_slot = current_check_slot % ht_size;
-                                            if (current_check_slot == kmer_hash)
-                                            {
-                                                std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                return;
-                                            }
-                                        }
-                                    }
-                                }
-                                else
-                                {
-                                    while(true)
-                                    {
-                                        probing_round=1;
-                                        // First, acquire the lock
-                                        while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                        // Then, check the k-mer
-                                        // If count == 0, no k-mer -> insert as new
-                                        if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                        {
-                                            basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                            std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes);
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // k-mer exists in the slot, check if it matches
-                                        // If match, k-mer was found
-                                        else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes) == 0)
-                                        {
-                                            // Increase count and done
-                                            basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            break;
-                                        }
-                                        // Otherwise, probe to next position
-                                        else
-                                        {
-                                            basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                            current_check_slot = current_check_slot + (probing_round*probing_round);
-                                            current_check_slot = current_check_slot % ht_size;
-                                            if (current_check_slot == kmer_hash)
-                                            {
-                                                std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                return;
-                                            }
-                                        }
-                                    }
-                                }
-                                
+                                inserted = basic_atomic_hash_table_long->insert_or_increase(kmer, kmer_hash);
                             }
                         }
-                        i++;
                     }
-                    std::cout << "Chunk done\n";
-                    break;
+                    if (batch.size() == plain_batch_items)
+                        inserted = insert_batch();
+                    if (!inserted)
+                    {
+                        table_full.store(true, std::memory_order_relaxed);
+                        break;
+                    }
                 }
-                case FASTQ: //fastq format
-                    //TODO
-                    std::cout<<"Not implemented yet"<<std::endl;
-                    break;
-                default:
-                    std::cout<<"Error : format not recognized"<<std::endl;
-                    break;
-
+                i++;
             }
+            if (!batch.empty() && !table_full.load(std::memory_order_relaxed) && !insert_batch())
+                table_full.store(true, std::memory_order_relaxed);
+            delete kmer_factory;
             delete rolling_hasher;
         };
 
@@ -818,7 +565,8 @@ struct parse_input_atomic_flag{
                 res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
                 assert(text_chunks[buff_id].bytes>0);
                 if(!res) break;
-                hash_kmers(text_chunks[buff_id], format);
+                if (!table_full.load(std::memory_order_relaxed))
+                    hash_kmers(text_chunks[buff_id], format);
                 consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
                 out_queue.push(buff_id);//the thread will wait until the stack is free to push
             }
@@ -856,10 +604,22 @@ struct parse_input_atomic_flag{
 #endif
         close(fd);
 
+        if (table_full.load())
+        {
+            std::cout << "Plain hash table of " << ht_size << " slots went over its maximum load factor " << max_load_factor << ", run again with a larger hash table size (-s)\n";
+            exit(1);
+        }
+
         auto start_writing = std::chrono::high_resolution_clock::now();
         if (min_abundance > 0)
-            basic_atomic_hash_table_long->write_kmers(min_abundance, output_file);
+        {
+            if (single_word_kmers)
+                basic_atomic_hash_table->write_kmers(min_abundance, output_file, binary_output);
+            else
+                basic_atomic_hash_table_long->write_kmers(min_abundance, output_file, binary_output);
+        }
         auto end_writing = std::chrono::high_resolution_clock::now();
+        delete basic_atomic_hash_table;
         delete basic_atomic_hash_table_long;
 
         auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(start_writing - start_building);
@@ -1173,14 +933,15 @@ struct parse_input_pointer_atomic_flag{
 // ==============================================================================================================
 
 template<class sym_type,
-         bool is_gzipped=false>
+         bool is_gzipped=false,
+         class slot_layout=SlotLayoutP38C14>
 struct parse_input_pointer_atomic_variable{
 
     
 
     void operator()(
                     std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k,
-                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug){
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug, bool binary_output = false){
         
         std::cout << "Starting atomic variable pointer hash table\n";
 
@@ -1193,7 +954,9 @@ struct parse_input_pointer_atomic_variable{
         uint64_t kmer_len = k;
         //BasicAtomicHashTable* basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len);
         uint64_t kmer_blocks = std::ceil(kmer_len/32.0);
-        PointerHashTableCanonicalAV* hash_table = new PointerHashTableCanonicalAV(ht_size, kmer_len, kmer_blocks);
+        PointerHashTableCanonicalAV<slot_layout>* hash_table = new PointerHashTableCanonicalAV<slot_layout>(ht_size, kmer_len, kmer_blocks, n_threads > 1);
+        if (print_other_stuff)
+            std::cout << "Slot layout: " << slot_layout::pointer_bits << " pointer bits, " << slot_layout::count_bits << " count bits (max count " << slot_layout::max_count << ")\n";
 
         using chunk_type = text_chunk<sym_type>;
 
@@ -1302,7 +1065,7 @@ struct parse_input_pointer_atomic_variable{
         //note: it is not necessary for this function to be a lambda. It can be a static function
 
         // MODIFIED LONG
-        auto hash_kmers =[&](chunk_type& chunk, size_t format){
+        auto hash_kmers =[&](chunk_type& chunk, size_t format, CountStagingCache* count_cache){
 
             off_t i =0, last;
             size_t n_strings=0;
@@ -1353,7 +1116,7 @@ struct parse_input_pointer_atomic_variable{
                             if (found_in_bf || true)
                             {
                                 //current_kmer_slot = hash_table->process_kmer(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
-                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
+                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache); 
                                 predecessor_kmer_exists = true;
                                 predecessor_kmer_slot = current_kmer_slot;
                             }
@@ -1398,113 +1161,1387 @@ struct parse_input_pointer_atomic_variable{
                     while(i<chunk.syms_in_buff){
                         // If we are parsing buffer, get to the next line
 
-                        // If the current character is header starting character, reset read buffer
-                        if (chunk.buffer[i]=='>')
-                        {
-                            parsing_header = true;
-                        }
-                        if (parsing_header)
-                        {
-                            while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
-                                i++;
-                            i++;
-                            parsing_header = false;
-                            kmer_factory->reset();
-                            rolling_hasher->reset();
-                            //bf_rolling_hasher->reset();
-                            predecessor_kmer_exists = false;
-                            predecessor_kmer_slot = ht_size;
-                            continue;
-                        }                        
-                        // If the next character is newline, skip it
-                        if (chunk.buffer[i]=='\n')
-                        {
-                            i++;
-                            continue;
-                        }
-                        new_char =  uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
-                        if (new_char > 3ULL)
-                        {
-                            std::cout << "sus reset at chunk position " << i << "\n";
-                            kmer_factory->reset();
-                        }
-                        else
-                            kmer_factory->push_new_integer(new_char);
-                        if (kmer_factory->get_number_of_stored_characters() == 0)
-                        {
-                            rolling_hasher->reset();
-                            //bf_rolling_hasher->reset();
-                            predecessor_kmer_exists = false;
-                            predecessor_kmer_slot = ht_size;
-                        }
-                        else
-                        {
-                            rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
-                            //bf_rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
-                        }
-                        if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
-                        {
-                            // Calculate Bloom filter hash values
-                            bool found_in_bf = true;
-                            // If k-mer is in bloom filter, process it
-                            if (found_in_bf || true)
-                            {
-                                //current_kmer_slot = hash_table->process_kmer(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
-                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
-                                predecessor_kmer_exists = true;
-                                predecessor_kmer_slot = current_kmer_slot;
-                            }
-                            // If not in Bloom filter, do not process
-                            else
-                            {
-                                predecessor_kmer_exists = false;
-                                predecessor_kmer_slot = ht_size;
-                            } 
-                        }
-                        i++;
-                    }
-                    if (print_other_stuff)
-                        std::cout << "Chunk " << chunk.id << " done\n";
-                    break;
+                        // If the current character is header starting character, reset read buffer
+                        if (chunk.buffer[i]=='>')
+                        {
+                            parsing_header = true;
+                        }
+                        if (parsing_header)
+                        {
+                            while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
+                                i++;
+                            i++;
+                            parsing_header = false;
+                            kmer_factory->reset();
+                            rolling_hasher->reset();
+                            //bf_rolling_hasher->reset();
+                            predecessor_kmer_exists = false;
+                            predecessor_kmer_slot = ht_size;
+                            continue;
+                        }                        
+                        // If the next character is newline, skip it
+                        if (chunk.buffer[i]=='\n')
+                        {
+                            i++;
+                            continue;
+                        }
+                        new_char =  uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
+                        if (new_char > 3ULL)
+                        {
+                            std::cout << "sus reset at chunk position " << i << "\n";
+                            kmer_factory->reset();
+                        }
+                        else
+                            kmer_factory->push_new_integer(new_char);
+                        if (kmer_factory->get_number_of_stored_characters() == 0)
+                        {
+                            rolling_hasher->reset();
+                            //bf_rolling_hasher->reset();
+                            predecessor_kmer_exists = false;
+                            predecessor_kmer_slot = ht_size;
+                        }
+                        else
+                        {
+                            rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                            //bf_rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                        }
+                        if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
+                        {
+                            // Calculate Bloom filter hash values
+                            bool found_in_bf = true;
+                            // If k-mer is in bloom filter, process it
+                            if (found_in_bf || true)
+                            {
+                                //current_kmer_slot = hash_table->process_kmer(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
+                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache); 
+                                predecessor_kmer_exists = true;
+                                predecessor_kmer_slot = current_kmer_slot;
+                            }
+                            // If not in Bloom filter, do not process
+                            else
+                            {
+                                predecessor_kmer_exists = false;
+                                predecessor_kmer_slot = ht_size;
+                            } 
+                        }
+                        i++;
+                    }
+                    if (print_other_stuff)
+                        std::cout << "Chunk " << chunk.id << " done\n";
+                    break;
+                }
+                case FASTQ: //fastq format
+                    //TODO
+                    std::cout<<"Not implemented yet"<<std::endl;
+                    break;
+                default:
+                    std::cout<<"Error : format not recognized"<<std::endl;
+                    break;
+
+            }
+            delete kmer_factory;
+            delete rolling_hasher;
+            //delete bf_rolling_hasher;
+        };
+
+        //lambda function that gets chunks from the IN queue and calls the hash_kmers lambda
+        //we feed this function to std::thread
+        auto string_worker = [&](size_t worker_id){
+
+            size_t buff_id;
+            bool res;
+            size_t consumed_kmers = 0;
+            // Pending count increases of this thread
+            CountStagingCache count_cache;
+
+            while(true){
+                res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
+                assert(text_chunks[buff_id].bytes>0);
+                if(!res) break;
+                hash_kmers(text_chunks[buff_id], format, &count_cache);
+                consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
+                out_queue.push(buff_id);//the thread will wait until the stack is free to push
+            }
+            hash_table->flush_count_cache(&count_cache);
+
+            /*
+            if (print_other_stuff)
+            {//TODO just testing
+                std::unique_lock lck(mtx);
+                std::cout<<"Thread "<<worker_id<<" consumed "<<consumed_kmers<<" kmers "<<std::endl;
+            }
+            */
+        };
+
+        std::vector<std::thread> threads;
+        threads.emplace_back(io_worker);
+        for(size_t i=0;i<n_threads;i++){
+            threads.emplace_back(string_worker, i);
+        }
+
+        for(auto & thread : threads){
+            //if (thread.joinable())
+            thread.join();
+        }
+
+        std::vector<chunk_type>().swap(text_chunks);
+
+        
+        //remove the pages of the input file from the page cache
+#ifdef __linux__
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+
+        auto start_writing = std::chrono::high_resolution_clock::now();
+        
+        if (debug){
+            std::cout << "Calculating pointer chain lengths\n";
+            hash_table->analyze_pointer_chain_lengths();
+        }
+        else if (min_abundance > 0)
+        {
+            std::cout << "Start writing k-mers in a file\n";
+            hash_table->write_kmers_on_disk_separately_even_faster(min_abundance, output_file, false, n_threads, binary_output);
+        }
+            
+        auto end_writing = std::chrono::high_resolution_clock::now();
+
+        if (print_times)
+        {
+            auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(start_writing - start_building);
+            auto writing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_writing - start_writing);
+            std::cout << "Time used to build hash table: " << build_duration.count() << " microseconds\n";
+            std::cout << "Time used to write k-mers in a file: " << writing_duration.count() << " microseconds\n";
+        }
+        if (print_other_stuff)
+        {
+            uint64_t used_slots = 0;
+            for (uint64_t cc = 0; cc < ht_size; cc++)
+            {
+                if (hash_table->slot_is_occupied(cc))
+                    used_slots+=1;
+            }
+            
+            std::cout << "Main array slots used " << used_slots << " / " << ht_size << "\n";
+            std::cout << "Max secondary array slots used " << hash_table->get_max_number_of_secondary_slots_in_use() << "\n";
+        }
+        delete hash_table;
+    }
+};
+
+
+
+// ==============================================================================================================
+// ATOMIC VARIABLES VERSION WITH 4 CHARACTERS PER SIDE, MODE=3, WITHOUT BLOOM FILTER
+// ==============================================================================================================
+
+template<class sym_type,
+         bool is_gzipped=false>
+struct parse_input_pointer_atomic_variable_BIG{
+
+    
+
+    void operator()(
+                    std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k,
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug){
+        
+        std::cout << "Starting atomic variable pointer hash table with 4 characters per side\n";
+
+        bool print_times = true;
+        bool print_other_stuff = true;
+        auto start_building = std::chrono::high_resolution_clock::now();
+        // Create the hash table
+        //uint64_t ht_size = mathfunctions::next_prime(min_slots);
+        uint64_t ht_size = mathfunctions::next_prime3mod4(min_slots);
+        uint64_t kmer_len = k;
+        //BasicAtomicHashTable* basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len);
+        uint64_t kmer_blocks = std::ceil(kmer_len/32.0);
+        PointerHashTableCanonicalAVBIG* hash_table = new PointerHashTableCanonicalAVBIG(ht_size, kmer_len, kmer_blocks);
+        // Predecessors can be up to this many k-mers back in the read
+        const uint64_t max_predecessor_distance = OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side;
+
+        using chunk_type = text_chunk<sym_type>;
+
+        ts_queue<size_t> in_queue;// thread-safe queue that manage the chunks that are ready to be used
+        ts_queue<size_t> out_queue; // thread-safe queue that stores the chunks that can be reused for new chunks
+        std::vector<chunk_type> text_chunks;
+        int fd = open(input_file.c_str(), O_RDONLY);
+
+        // this is for later: to manage compressed inputs
+        gzFile gfd;
+        if constexpr (is_gzipped){//managed at compilation time
+            gfd = gzdopen(fd, "r");
+        }
+        //
+
+        //get the file size
+        struct stat st{};
+        if(stat(input_file.c_str(), &st) != 0)  return;
+
+        size_t format; //manage to get the input format
+        if (input_mode == 2)
+            format = PLAIN;
+        else if (input_mode == 0)
+            format = FASTA;
+        else
+        {
+            std::cout << "Input file format not supported.";
+            return;
+        }   
+        //std::mutex mtx; //just for debugging (you can remove it afterwards)
+
+        //lambda function that manages IO operations
+        //we feed this function to std::thread
+        auto io_worker = [&]() -> void {
+
+            off_t rem_bytes = st.st_size;
+
+#ifdef __linux__
+            posix_fadvise(fd, 0, rem_bytes, POSIX_FADV_SEQUENTIAL);//tell the linux kernel we will access the file sequentially so it can use the readahead heuristic more effectively
+#endif
+
+            size_t chunk_id=0;
+            text_chunks.resize(active_chunks);
+            off_t tmp_ck_size;
+            bool broken_header=false;
+
+
+            while(chunk_id<active_chunks && rem_bytes>=k){
+
+                tmp_ck_size = std::min(chunk_size, rem_bytes);
+                text_chunks[chunk_id].bytes = tmp_ck_size;
+                text_chunks[chunk_id].buffer = (sym_type *)malloc(tmp_ck_size);
+                text_chunks[chunk_id].id = chunk_id;
+                text_chunks[chunk_id].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    //if (broken_header)
+                    //    std::cout << "Header is broken before check\n";
+                    //else
+                    //    std::cout << "Header not broken before check\n";
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                    //if (broken_header)
+                    //    std::cout << "Header is broken after check\n";
+                    //else
+                    //    std::cout << "Header not broken after check\n";
+                }
+                //std::cout << "\n";
+                in_queue.push(chunk_id);//as soon as we push, the chunks become visible of the worker threads to consume them
+                chunk_id++;
+                //std::cout << "Chunk pushed " << chunk_id << "\n";
+                //std::cout << "Rem bytes is " << rem_bytes << "\n";
+            }
+
+            //std::cout << "First step ready\n";
+
+            size_t buff_idx;
+            while(rem_bytes>=k){
+                out_queue.pop(buff_idx);//it will wait until out_strings contains something
+                text_chunks[buff_idx].id = chunk_id++;
+                text_chunks[buff_idx].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
+                }
+                in_queue.push(buff_idx);
+            }
+
+            //wait for the chunks to be fully processed
+            while(!in_queue.empty());
+
+            //remove the unused chunks from the out queue
+            while(!out_queue.empty()){
+                out_queue.pop(buff_idx);
+            }
+
+            in_queue.done();
+            out_queue.done();
+
+            close(fd);
+            //std::cout << "File reading is ready\n";
+        };
+
+        //lambda functions that hash the kmers in a text chunk
+        //note: it is not necessary for this function to be a lambda. It can be a static function
+
+        // MODIFIED LONG
+        auto hash_kmers =[&](chunk_type& chunk, size_t format, CountStagingCache* count_cache){
+
+            off_t i =0, last;
+            size_t n_strings=0;
+
+            // Rolling hasher for hash table positions
+            RollingHasherDual* rolling_hasher = new RollingHasherDual(ht_size, kmer_len);
+            // Rolling hasher for bloom filter root hashes 
+            //RollingHasherDual* bf_rolling_hasher = new RollingHasherDual(rolling_hasher_mod, kmer_len);
+            //RollingHasherDual* bf_rolling_hasher = new RollingHasherDual(rolling_hasher_mod, kmer_len, bf_modmulinv, bf_multiplier);
+            // Vector for storing hash values
+            //std::vector<uint64_t> bloom_filter_hash_values(hash_functions, 0);
+
+            // --- Build k-mer factory ---
+            KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(k);
+
+            switch (format) {
+                case PLAIN://one-string-per-line format
+                {
+                    // Slots and orientations of the latest k-mers of the current read
+                    uint64_t recent_kmer_slots[max_predecessor_distance];
+                    bool recent_kmer_canonical[max_predecessor_distance];
+                    uint64_t kmers_in_read = 0;
+                    uint64_t new_char = 0;
+                    uint64_t current_kmer_slot = ht_size;
+                    assert(chunk.syms_in_buff>=k);
+                    //slide a window over the buffer
+                    while(i<chunk.syms_in_buff){
+                        new_char =  uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
+                        if (new_char > 3ULL)
+                            kmer_factory->reset();
+                        else
+                            kmer_factory->push_new_integer(new_char);
+                        if (kmer_factory->get_number_of_stored_characters() == 0)
+                        {
+                            rolling_hasher->reset();
+                            //bf_rolling_hasher->reset();
+                            kmers_in_read = 0;
+                        }
+                        else
+                        {
+                            rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                            //bf_rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                        }
+                        if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
+                        {
+                            // Point to the k-mer max_predecessor_distance k-mers back, or the first k-mer of the read
+                            uint64_t predecessor_distance = std::min(kmers_in_read, max_predecessor_distance);
+                            uint64_t predecessor_index = (kmers_in_read - predecessor_distance) % max_predecessor_distance;
+                            current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_distance, recent_kmer_slots[predecessor_index], recent_kmer_canonical[predecessor_index], count_cache);
+                            recent_kmer_slots[kmers_in_read % max_predecessor_distance] = current_kmer_slot;
+                            recent_kmer_canonical[kmers_in_read % max_predecessor_distance] = kmer_factory->forward_kmer_is_canonical();
+                            kmers_in_read += 1;
+                        }
+                        i++;
+                    }
+                    if (print_other_stuff)
+                        std::cout << "Chunk done\n";
+                    break;
+                }
+                case FASTA: //fasta formta
+                {
+                    // Slots and orientations of the latest k-mers of the current read
+                    uint64_t recent_kmer_slots[max_predecessor_distance];
+                    bool recent_kmer_canonical[max_predecessor_distance];
+                    uint64_t kmers_in_read = 0;
+                    uint64_t new_char = 0;
+                    uint64_t current_kmer_slot = ht_size;
+                    assert(chunk.syms_in_buff>=k);
+                    bool parsing_header = chunk.broken_header;
+                    
+                    /*
+                    if (parsing_header)
+                    {
+                        std::cout << "\n!!!!!!!!!!!!!!!!!!!!! Chunk starts with broken header !!!!!!!!!!!!!!!!!!!!!\n";
+                        std::cout << "START skipping\n";
+                        while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
+                        {
+                            //std::cout << chunk.buffer[i];
+                            i++;
+                        }
+                        std::cout << "DONE\n";
+                        parsing_header = false;       
+                    }
+                    */
+                        
+                    //slide a window over the buffer
+                    while(i<chunk.syms_in_buff){
+                        // If we are parsing buffer, get to the next line
+
+                        // If the current character is header starting character, reset read buffer
+                        if (chunk.buffer[i]=='>')
+                        {
+                            parsing_header = true;
+                        }
+                        if (parsing_header)
+                        {
+                            while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
+                                i++;
+                            i++;
+                            parsing_header = false;
+                            kmer_factory->reset();
+                            rolling_hasher->reset();
+                            //bf_rolling_hasher->reset();
+                            kmers_in_read = 0;
+                            continue;
+                        }                        
+                        // If the next character is newline, skip it
+                        if (chunk.buffer[i]=='\n')
+                        {
+                            i++;
+                            continue;
+                        }
+                        new_char =  uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
+                        if (new_char > 3ULL)
+                        {
+                            std::cout << "sus reset at chunk position " << i << "\n";
+                            kmer_factory->reset();
+                        }
+                        else
+                            kmer_factory->push_new_integer(new_char);
+                        if (kmer_factory->get_number_of_stored_characters() == 0)
+                        {
+                            rolling_hasher->reset();
+                            //bf_rolling_hasher->reset();
+                            kmers_in_read = 0;
+                        }
+                        else
+                        {
+                            rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                            //bf_rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                        }
+                        if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
+                        {
+                            // Point to the k-mer max_predecessor_distance k-mers back, or the first k-mer of the read
+                            uint64_t predecessor_distance = std::min(kmers_in_read, max_predecessor_distance);
+                            uint64_t predecessor_index = (kmers_in_read - predecessor_distance) % max_predecessor_distance;
+                            current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_distance, recent_kmer_slots[predecessor_index], recent_kmer_canonical[predecessor_index], count_cache);
+                            recent_kmer_slots[kmers_in_read % max_predecessor_distance] = current_kmer_slot;
+                            recent_kmer_canonical[kmers_in_read % max_predecessor_distance] = kmer_factory->forward_kmer_is_canonical();
+                            kmers_in_read += 1;
+                        }
+                        i++;
+                    }
+                    if (print_other_stuff)
+                        std::cout << "Chunk " << chunk.id << " done\n";
+                    break;
+                }
+                case FASTQ: //fastq format
+                    //TODO
+                    std::cout<<"Not implemented yet"<<std::endl;
+                    break;
+                default:
+                    std::cout<<"Error : format not recognized"<<std::endl;
+                    break;
+
+            }
+            delete kmer_factory;
+            delete rolling_hasher;
+            //delete bf_rolling_hasher;
+        };
+
+        //lambda function that gets chunks from the IN queue and calls the hash_kmers lambda
+        //we feed this function to std::thread
+        auto string_worker = [&](size_t worker_id){
+
+            size_t buff_id;
+            bool res;
+            size_t consumed_kmers = 0;
+            // Pending count increases of this thread
+            CountStagingCache count_cache;
+
+            while(true){
+                res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
+                assert(text_chunks[buff_id].bytes>0);
+                if(!res) break;
+                hash_kmers(text_chunks[buff_id], format, &count_cache);
+                consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
+                out_queue.push(buff_id);//the thread will wait until the stack is free to push
+            }
+            hash_table->flush_count_cache(&count_cache);
+
+            /*
+            if (print_other_stuff)
+            {//TODO just testing
+                std::unique_lock lck(mtx);
+                std::cout<<"Thread "<<worker_id<<" consumed "<<consumed_kmers<<" kmers "<<std::endl;
+            }
+            */
+        };
+
+        std::vector<std::thread> threads;
+        threads.emplace_back(io_worker);
+        for(size_t i=0;i<n_threads;i++){
+            threads.emplace_back(string_worker, i);
+        }
+
+        for(auto & thread : threads){
+            //if (thread.joinable())
+            thread.join();
+        }
+
+        std::vector<chunk_type>().swap(text_chunks);
+
+        
+        //remove the pages of the input file from the page cache
+#ifdef __linux__
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+
+        auto start_writing = std::chrono::high_resolution_clock::now();
+        
+        if (debug){
+            std::cout << "Calculating pointer chain lengths\n";
+            hash_table->analyze_pointer_chain_lengths();
+        }
+        else if (min_abundance > 0)
+        {
+            std::cout << "Start writing k-mers in a file\n";
+            hash_table->write_kmers_on_disk(min_abundance, output_file);
+        }
+            
+        auto end_writing = std::chrono::high_resolution_clock::now();
+
+        if (print_times)
+        {
+            auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(start_writing - start_building);
+            auto writing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_writing - start_writing);
+            std::cout << "Time used to build hash table: " << build_duration.count() << " microseconds\n";
+            std::cout << "Time used to write k-mers in a file: " << writing_duration.count() << " microseconds\n";
+        }
+        if (print_other_stuff)
+        {
+            uint64_t used_slots = 0;
+            for (uint64_t cc = 0; cc < ht_size; cc++)
+            {
+                if (hash_table->slot_is_occupied(cc))
+                    used_slots+=1;
+            }
+            
+            std::cout << "Main array slots used " << used_slots << " / " << ht_size << "\n";
+            std::cout << "Max secondary array slots used " << hash_table->get_max_number_of_secondary_slots_in_use() << "\n";
+            hash_table->report_memory_usage();
+        }
+        delete hash_table;
+    }
+};
+
+
+
+// ==============================================================================================================
+// ATOMIC VARIABLES VERSION, MODE=2, SHARDED, WITHOUT BLOOM FILTER
+// ==============================================================================================================
+
+// Read segments routed to one shard. Characters are 2-bit integers (0-3) and every segment is a run of
+// consecutive k-mers of a read that were routed to the same shard (super-k-mers when routing by minimizers).
+struct shard_batch{
+    std::vector<uint8_t> characters;
+    std::vector<uint32_t> segment_lengths;
+};
+
+// Splits the reads of a text chunk into segments of consecutive k-mers that are routed to the same shard and adds them
+// to open_batches. Routing is by canonical minimizer if minimizer_len > 0, otherwise by a canonical rolling hash mod route_mod (unused with minimizers).
+// push_batch(shard, batch) is called for a batch whose last segment is finished and that has at least batch_characters characters.
+template<class chunk_type, class push_batch_function>
+void route_chunk_segments(chunk_type& chunk, size_t format, uint64_t kmer_len, size_t n_shards, size_t minimizer_len, uint64_t route_mod,
+                          std::vector<shard_batch>& open_batches, size_t batch_characters, push_batch_function& push_batch)
+{
+    if ((format != PLAIN) && (format != FASTA))
+    {
+        std::cout << "Error : format not supported with shards" << std::endl;
+        return;
+    }
+
+    off_t i = 0;
+    RollingHasherDual* route_hasher = nullptr;
+    CanonicalMinimizerHasher* minimizer_hasher = nullptr;
+    if (minimizer_len > 0)
+        minimizer_hasher = new CanonicalMinimizerHasher(kmer_len, minimizer_len);
+    else
+        route_hasher = new RollingHasherDual(route_mod, kmer_len);
+    KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(kmer_len);
+    // Shard of the current segment (n_shards = no segment)
+    size_t segment_shard = n_shards;
+    bool parsing_header = chunk.broken_header && (format == FASTA);
+    uint64_t new_char = 0;
+
+    while(i<chunk.syms_in_buff){
+        if (format == FASTA)
+        {
+            if (chunk.buffer[i]=='>')
+                parsing_header = true;
+            if (parsing_header)
+            {
+                while((i<chunk.syms_in_buff) && (chunk.buffer[i]!='\n'))
+                    i++;
+                i++;
+                parsing_header = false;
+                kmer_factory->reset();
+                if (minimizer_hasher)
+                    minimizer_hasher->reset();
+                else
+                    route_hasher->reset();
+                segment_shard = n_shards;
+                continue;
+            }
+            if (chunk.buffer[i]=='\n')
+            {
+                i++;
+                continue;
+            }
+        }
+        new_char = uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
+        if (new_char > 3ULL)
+            kmer_factory->reset();
+        else
+            kmer_factory->push_new_integer(new_char);
+        if (kmer_factory->get_number_of_stored_characters() == 0)
+        {
+            if (minimizer_hasher)
+                minimizer_hasher->reset();
+            else
+                route_hasher->reset();
+            segment_shard = n_shards;
+        }
+        else if (minimizer_hasher)
+        {
+            minimizer_hasher->push(new_char);
+        }
+        else
+        {
+            route_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+        }
+        if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
+        {
+            size_t shard;
+            if (minimizer_hasher)
+            {
+                // Smallest hash has zero high bits, so use the low bits
+                shard = size_t(minimizer_hasher->get_minimizer_hash() % n_shards);
+            }
+            else
+            {
+                uint64_t route_hash;
+                if (kmer_factory->forward_kmer_is_canonical())
+                    route_hash = route_hasher->get_current_hash_forward();
+                else
+                    route_hash = route_hasher->get_current_hash_backward();
+                shard = size_t((__uint128_t(route_hash) * n_shards) / route_mod);
+            }
+            shard_batch& batch = open_batches[shard];
+            // Same shard as the previous k-mer, extend the segment by one character
+            if (shard == segment_shard)
+            {
+                batch.characters.push_back(uint8_t(new_char));
+                batch.segment_lengths.back() += 1;
+            }
+            // Otherwise start a new segment with the whole k-mer
+            else
+            {
+                if (segment_shard < n_shards && open_batches[segment_shard].characters.size() >= batch_characters)
+                    push_batch(segment_shard, open_batches[segment_shard]);
+                for (uint64_t j = 0; j < kmer_len; j++)
+                    batch.characters.push_back(uint8_t(kmer_factory->get_forward_char_at_position(j)));
+                batch.segment_lengths.push_back(uint32_t(kmer_len));
+                segment_shard = shard;
+            }
+        }
+        i++;
+    }
+    delete kmer_factory;
+    delete route_hasher;
+    delete minimizer_hasher;
+}
+
+// Inserts the segments of a batch in the hash table. Predecessor links only exist inside a segment,
+// the first k-mer of every segment goes to the secondary array.
+template<class hash_table_type>
+void insert_shard_batch(hash_table_type* hash_table, shard_batch& batch, KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* rolling_hasher, CountStagingCache* count_cache)
+{
+    int kmer_len = kmer_factory->kmer_length;
+    size_t position = 0;
+    for (uint32_t segment_length : batch.segment_lengths)
+    {
+        kmer_factory->reset();
+        rolling_hasher->reset();
+        bool predecessor_kmer_exists = false;
+        uint64_t predecessor_kmer_slot = 0;
+        for (uint32_t j = 0; j < segment_length; j++)
+        {
+            kmer_factory->push_new_integer(batch.characters[position]);
+            rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+            position++;
+            if (kmer_factory->get_number_of_stored_characters() == kmer_len)
+            {
+                predecessor_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache);
+                predecessor_kmer_exists = true;
+            }
+        }
+    }
+}
+
+// Scratch files that are removed when the program exits, also when it exits with an error
+inline std::mutex scratch_files_lock;
+inline std::vector<std::string> scratch_files;
+
+inline void remove_scratch_files()
+{
+    std::unique_lock guard(scratch_files_lock);
+    for (std::string& path : scratch_files)
+        std::remove(path.c_str());
+    scratch_files.clear();
+}
+
+inline void register_scratch_file(const std::string& path)
+{
+    std::unique_lock guard(scratch_files_lock);
+    if (scratch_files.empty())
+        std::atexit(remove_scratch_files);
+    scratch_files.push_back(path);
+}
+
+// Removes a scratch file that is no longer needed
+inline void remove_scratch_file(const std::string& path)
+{
+    std::unique_lock guard(scratch_files_lock);
+    std::remove(path.c_str());
+    scratch_files.erase(std::remove(scratch_files.begin(), scratch_files.end(), path), scratch_files.end());
+}
+
+// Appends a batch to a partition file. Characters are packed 4 per byte. Returns false if writing failed.
+inline bool write_shard_batch(std::ofstream& partition_file, const shard_batch& batch)
+{
+    uint64_t n_segments = batch.segment_lengths.size();
+    uint64_t n_characters = batch.characters.size();
+    std::vector<uint8_t> packed((n_characters + 3) / 4, 0);
+    for (uint64_t i = 0; i < n_characters; i++)
+        packed[i / 4] |= uint8_t(batch.characters[i] << (2 * (i % 4)));
+    partition_file.write(reinterpret_cast<const char*>(&n_segments), sizeof(uint64_t));
+    partition_file.write(reinterpret_cast<const char*>(&n_characters), sizeof(uint64_t));
+    partition_file.write(reinterpret_cast<const char*>(batch.segment_lengths.data()), n_segments * sizeof(uint32_t));
+    partition_file.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+    return bool(partition_file);
+}
+
+// Reads the next batch of a partition file, returns false at the end of the file.
+// truncated is set if the file ends or cannot be read in the middle of a batch.
+inline bool read_shard_batch(std::ifstream& partition_file, shard_batch& batch, bool& truncated)
+{
+    uint64_t n_segments;
+    uint64_t n_characters;
+    truncated = false;
+    if (!partition_file.read(reinterpret_cast<char*>(&n_segments), sizeof(uint64_t)))
+    {
+        truncated = (partition_file.gcount() != 0) || !partition_file.eof();
+        return false;
+    }
+    partition_file.read(reinterpret_cast<char*>(&n_characters), sizeof(uint64_t));
+    batch.segment_lengths.resize(n_segments);
+    partition_file.read(reinterpret_cast<char*>(batch.segment_lengths.data()), n_segments * sizeof(uint32_t));
+    std::vector<uint8_t> packed((n_characters + 3) / 4);
+    partition_file.read(reinterpret_cast<char*>(packed.data()), packed.size());
+    batch.characters.resize(n_characters);
+    for (uint64_t i = 0; i < n_characters; i++)
+        batch.characters[i] = (packed[i / 4] >> (2 * (i % 4))) & uint8_t(3);
+    truncated = !partition_file;
+    return !truncated;
+}
+
+// Number of k-mers in the segments of a batch
+inline uint64_t shard_batch_kmers(const shard_batch& batch, uint64_t kmer_len)
+{
+    uint64_t kmers = 0;
+    for (uint32_t segment_length : batch.segment_lengths)
+        kmers += segment_length - kmer_len + 1;
+    return kmers;
+}
+
+// Calls push(piece) for pieces of the batch with at most max_kmers k-mers each.
+// A segment that does not fit is cut so that its pieces overlap by k-1 characters.
+template<class push_function>
+void cut_shard_batch(const shard_batch& batch, uint64_t kmer_len, uint64_t max_kmers, push_function& push)
+{
+    shard_batch piece;
+    uint64_t piece_kmers = 0;
+    size_t position = 0;
+    for (uint32_t segment_length : batch.segment_lengths)
+    {
+        uint64_t segment_kmers = segment_length - kmer_len + 1;
+        uint64_t done = 0;
+        while (done < segment_kmers)
+        {
+            if (piece_kmers == max_kmers)
+            {
+                push(piece);
+                piece = shard_batch();
+                piece_kmers = 0;
+            }
+            uint64_t taken = std::min(segment_kmers - done, max_kmers - piece_kmers);
+            auto first = batch.characters.begin() + position + done;
+            piece.characters.insert(piece.characters.end(), first, first + taken + kmer_len - 1);
+            piece.segment_lengths.push_back(uint32_t(taken + kmer_len - 1));
+            piece_kmers += taken;
+            done += taken;
+        }
+        position += segment_length;
+    }
+    if (!piece.segment_lengths.empty())
+        push(piece);
+}
+
+// Splits a partition file into sub_paths.size() files by the minimizers of its k-mers under another seed.
+// The k-mers of each new file are added to sub_kmers.
+inline void split_partition_file(const std::string& path, const std::vector<std::string>& sub_paths, uint64_t kmer_len, uint64_t minimizer_len,
+                                 uint64_t seed, size_t batch_characters, std::vector<uint64_t>& sub_kmers)
+{
+    size_t n_sub = sub_paths.size();
+    std::ifstream partition_file(path, std::ios::binary);
+    if (!partition_file)
+    {
+        std::cout << "Could not open scratch file " << path << "\n";
+        exit(1);
+    }
+    std::vector<std::ofstream> sub_files(n_sub);
+    std::vector<shard_batch> open_batches(n_sub);
+    for (size_t s = 0; s < n_sub; s++)
+    {
+        register_scratch_file(sub_paths[s]);
+        sub_files[s].open(sub_paths[s], std::ios::binary | std::ios::trunc);
+        if (!sub_files[s])
+        {
+            std::cout << "Could not create scratch file " << sub_paths[s] << "\n";
+            exit(1);
+        }
+    }
+    auto push_batch = [&](size_t s)
+    {
+        if (!write_shard_batch(sub_files[s], open_batches[s]))
+        {
+            std::cout << "Could not write scratch file " << sub_paths[s] << "\n";
+            exit(1);
+        }
+        sub_kmers[s] += shard_batch_kmers(open_batches[s], kmer_len);
+        open_batches[s] = shard_batch();
+    };
+
+    CanonicalMinimizerHasher minimizer_hasher(kmer_len, minimizer_len, seed);
+    shard_batch batch;
+    bool truncated;
+    while (read_shard_batch(partition_file, batch, truncated))
+    {
+        size_t position = 0;
+        for (uint32_t segment_length : batch.segment_lengths)
+        {
+            minimizer_hasher.reset();
+            // Sub-partition of the current segment (n_sub = no segment)
+            size_t segment_sub = n_sub;
+            for (uint32_t j = 0; j < segment_length; j++)
+            {
+                minimizer_hasher.push(batch.characters[position + j]);
+                if (j + 1 < kmer_len)
+                    continue;
+                size_t sub = size_t(minimizer_hasher.get_minimizer_hash() % n_sub);
+                shard_batch& sub_batch = open_batches[sub];
+                // Same sub-partition as the previous k-mer, extend the segment by one character
+                if (sub == segment_sub)
+                {
+                    sub_batch.characters.push_back(batch.characters[position + j]);
+                    sub_batch.segment_lengths.back() += 1;
+                }
+                // Otherwise start a new segment with the whole k-mer
+                else
+                {
+                    if (segment_sub < n_sub && open_batches[segment_sub].characters.size() >= batch_characters)
+                        push_batch(segment_sub);
+                    sub_batch.characters.insert(sub_batch.characters.end(), batch.characters.begin() + position + j + 1 - kmer_len, batch.characters.begin() + position + j + 1);
+                    sub_batch.segment_lengths.push_back(uint32_t(kmer_len));
+                    segment_sub = sub;
+                }
+            }
+            position += segment_length;
+        }
+    }
+    if (truncated)
+    {
+        std::cout << "Scratch file " << path << " is truncated or could not be read\n";
+        exit(1);
+    }
+    for (size_t s = 0; s < n_sub; s++)
+    {
+        if (!open_batches[s].segment_lengths.empty())
+            push_batch(s);
+        sub_files[s].close();
+        if (!sub_files[s])
+        {
+            std::cout << "Could not write scratch file " << sub_paths[s] << "\n";
+            exit(1);
+        }
+    }
+}
+
+template<class sym_type,
+         bool is_gzipped=false,
+         class slot_layout=SlotLayoutP38C14>
+struct parse_input_pointer_atomic_variable_SHARDED{
+
+    void operator()(
+                    std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, size_t n_shards, size_t minimizer_len, off_t k,
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug, bool binary_output = false){
+        
+        std::cout << "Starting sharded atomic variable pointer hash table\n";
+
+        bool print_times = true;
+        bool print_other_stuff = true;
+        auto start_building = std::chrono::high_resolution_clock::now();
+        // Every shard is a separate hash table owned by one thread.
+        // With minimizer_len > 0, k-mers are routed by their minimizer so consecutive k-mers of a read stay in the same shard,
+        // but minimizer partitions are less even than hash partitions and the shards get 50% more room.
+        uint64_t shard_size = mathfunctions::shard_hash_table_size(min_slots, n_shards, minimizer_len > 0);
+        uint64_t kmer_len = k;
+        uint64_t kmer_blocks = std::ceil(kmer_len/32.0);
+        // Shards are created by their owner threads, their pages are backed on the node of the owner when it first touches them
+        std::vector<PointerHashTableCanonicalAV<slot_layout>*> shards(n_shards, nullptr);
+        // Shard of a k-mer is taken from the prefix of a canonical rolling hash with a different modulus than the shards use
+        uint64_t route_mod = mathfunctions::next_prime3mod4(uint64_t(1) << 40);
+        if (print_other_stuff)
+        {
+            std::cout << "Slot layout: " << slot_layout::pointer_bits << " pointer bits, " << slot_layout::count_bits << " count bits (max count " << slot_layout::max_count << ")\n";
+            std::cout << "Shards: " << n_shards << " x " << shard_size << " slots";
+            if (minimizer_len > 0)
+                std::cout << ", routed by minimizers of length " << minimizer_len;
+            std::cout << "\n";
+        }
+        // Parsers push a batch to its shard when it has this many characters
+        const size_t batch_characters = 1 << 16;
+        // Parsers wait if the shard owners fall this far behind
+        const uint64_t max_queued_batches = 64 * n_shards;
+        std::vector<ts_queue<shard_batch>> shard_queues(n_shards);
+        std::atomic<uint64_t> queued_batches(0);
+
+        using chunk_type = text_chunk<sym_type>;
+
+        ts_queue<size_t> in_queue;// thread-safe queue that manage the chunks that are ready to be used
+        ts_queue<size_t> out_queue; // thread-safe queue that stores the chunks that can be reused for new chunks
+        std::vector<chunk_type> text_chunks;
+        int fd = open(input_file.c_str(), O_RDONLY);
+
+        // this is for later: to manage compressed inputs
+        gzFile gfd;
+        if constexpr (is_gzipped){//managed at compilation time
+            gfd = gzdopen(fd, "r");
+        }
+        //
+
+        //get the file size
+        struct stat st{};
+        if(stat(input_file.c_str(), &st) != 0)  return;
+
+        size_t format; //manage to get the input format
+        if (input_mode == 2)
+            format = PLAIN;
+        else if (input_mode == 0)
+            format = FASTA;
+        else
+        {
+            std::cout << "Input file format not supported.";
+            return;
+        }   
+        //std::mutex mtx; //just for debugging (you can remove it afterwards)
+
+        //lambda function that manages IO operations
+        //we feed this function to std::thread
+        auto io_worker = [&]() -> void {
+
+            off_t rem_bytes = st.st_size;
+
+#ifdef __linux__
+            posix_fadvise(fd, 0, rem_bytes, POSIX_FADV_SEQUENTIAL);//tell the linux kernel we will access the file sequentially so it can use the readahead heuristic more effectively
+#endif
+
+            size_t chunk_id=0;
+            text_chunks.resize(active_chunks);
+            off_t tmp_ck_size;
+            bool broken_header=false;
+
+
+            while(chunk_id<active_chunks && rem_bytes>=k){
+
+                tmp_ck_size = std::min(chunk_size, rem_bytes);
+                text_chunks[chunk_id].bytes = tmp_ck_size;
+                text_chunks[chunk_id].buffer = (sym_type *)malloc(tmp_ck_size);
+                text_chunks[chunk_id].id = chunk_id;
+                text_chunks[chunk_id].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    //if (broken_header)
+                    //    std::cout << "Header is broken before check\n";
+                    //else
+                    //    std::cout << "Header not broken before check\n";
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                    //if (broken_header)
+                    //    std::cout << "Header is broken after check\n";
+                    //else
+                    //    std::cout << "Header not broken after check\n";
+                }
+                //std::cout << "\n";
+                in_queue.push(chunk_id);//as soon as we push, the chunks become visible of the worker threads to consume them
+                chunk_id++;
+                //std::cout << "Chunk pushed " << chunk_id << "\n";
+                //std::cout << "Rem bytes is " << rem_bytes << "\n";
+            }
+
+            //std::cout << "First step ready\n";
+
+            size_t buff_idx;
+            while(rem_bytes>=k){
+                out_queue.pop(buff_idx);//it will wait until out_strings contains something
+                text_chunks[buff_idx].id = chunk_id++;
+                text_chunks[buff_idx].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
+                }
+                in_queue.push(buff_idx);
+            }
+
+            //wait for the chunks to be fully processed
+            while(!in_queue.empty());
+
+            //remove the unused chunks from the out queue
+            while(!out_queue.empty()){
+                out_queue.pop(buff_idx);
+            }
+
+            in_queue.done();
+            out_queue.done();
+
+            close(fd);
+            //std::cout << "File reading is ready\n";
+        };
+
+        //lambda function that sends a batch to the owner of the shard
+        auto push_batch = [&](size_t shard, shard_batch& batch){
+            while (queued_batches.load(std::memory_order_relaxed) >= max_queued_batches)
+                std::this_thread::yield();
+            queued_batches.fetch_add(1, std::memory_order_relaxed);
+            shard_queues[shard].push(std::move(batch));
+            batch = shard_batch();
+        };
+
+        //lambda function that splits the reads of a text chunk into segments and routes them to the shards
+        auto route_kmers =[&](chunk_type& chunk, size_t format, std::vector<shard_batch>& open_batches){
+            route_chunk_segments(chunk, format, kmer_len, n_shards, minimizer_len, route_mod, open_batches, batch_characters, push_batch);
+            if (print_other_stuff)
+                std::cout << "Chunk " << chunk.id << " done\n";
+        };
+
+        //lambda function that gets chunks from the IN queue and routes their k-mers
+        //we feed this function to std::thread
+        auto string_worker = [&](size_t worker_id){
+
+            size_t buff_id;
+            bool res;
+            std::vector<shard_batch> open_batches(n_shards);
+
+            while(true){
+                res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
+                assert(text_chunks[buff_id].bytes>0);
+                if(!res) break;
+                route_kmers(text_chunks[buff_id], format, open_batches);
+                out_queue.push(buff_id);//the thread will wait until the stack is free to push
+            }
+            for (size_t s = 0; s < n_shards; s++)
+            {
+                if (!open_batches[s].segment_lengths.empty())
+                    push_batch(s, open_batches[s]);
+            }
+        };
+
+        //lambda function that inserts the segments of one shard in its hash table, no other thread touches the shard
+        //we feed this function to std::thread
+        auto shard_worker = [&](size_t shard){
+
+            shards[shard] = new PointerHashTableCanonicalAV<slot_layout>(shard_size, kmer_len, kmer_blocks);
+            PointerHashTableCanonicalAV<slot_layout>* hash_table = shards[shard];
+            RollingHasherDual* rolling_hasher = new RollingHasherDual(shard_size, kmer_len);
+            KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(k);
+            shard_batch batch;
+
+            while(true){
+                shard_queues[shard].pop(batch);
+                // Empty batch means that all parsers are done
+                if (batch.segment_lengths.empty())
+                    break;
+                queued_batches.fetch_sub(1, std::memory_order_relaxed);
+                insert_shard_batch(hash_table, batch, kmer_factory, rolling_hasher, nullptr);
+            }
+            delete kmer_factory;
+            delete rolling_hasher;
+        };
+
+        std::vector<std::thread> shard_threads;
+        for(size_t s=0;s<n_shards;s++){
+            shard_threads.emplace_back(shard_worker, s);
+        }
+
+        std::vector<std::thread> threads;
+        threads.emplace_back(io_worker);
+        for(size_t i=0;i<n_threads;i++){
+            threads.emplace_back(string_worker, i);
+        }
+
+        for(auto & thread : threads){
+            thread.join();
+        }
+
+        // Parsers are done, stop the shard owners once their queues are empty
+        for(size_t s=0;s<n_shards;s++){
+            shard_queues[s].push(shard_batch());
+        }
+        for(auto & thread : shard_threads){
+            thread.join();
+        }
+
+        std::vector<chunk_type>().swap(text_chunks);
+
+        //remove the pages of the input file from the page cache
+#ifdef __linux__
+        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+
+        auto start_writing = std::chrono::high_resolution_clock::now();
+        
+        if (debug){
+            std::cout << "Calculating pointer chain lengths\n";
+            for (size_t s = 0; s < n_shards; s++)
+                shards[s]->analyze_pointer_chain_lengths();
+        }
+        else if (min_abundance > 0)
+        {
+            std::cout << "Start writing k-mers in a file\n";
+            // First shard creates the file and the others append to it
+            for (size_t s = 0; s < n_shards; s++)
+                shards[s]->write_kmers_on_disk_separately_even_faster(min_abundance, output_file, s > 0, n_threads, binary_output);
+        }
+            
+        auto end_writing = std::chrono::high_resolution_clock::now();
+
+        if (print_times)
+        {
+            auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(start_writing - start_building);
+            auto writing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_writing - start_writing);
+            std::cout << "Time used to build hash table: " << build_duration.count() << " microseconds\n";
+            std::cout << "Time used to write k-mers in a file: " << writing_duration.count() << " microseconds\n";
+        }
+        if (print_other_stuff)
+        {
+            uint64_t used_slots = 0;
+            uint64_t max_secondary_slots_used = 0;
+            for (size_t s = 0; s < n_shards; s++)
+            {
+                for (uint64_t cc = 0; cc < shard_size; cc++)
+                {
+                    if (shards[s]->slot_is_occupied(cc))
+                        used_slots+=1;
+                }
+                max_secondary_slots_used += shards[s]->get_max_number_of_secondary_slots_in_use();
+            }
+            
+            std::cout << "Main array slots used " << used_slots << " / " << shard_size*n_shards << "\n";
+            std::cout << "Max secondary array slots used " << max_secondary_slots_used << "\n";
+        }
+        for (size_t s = 0; s < n_shards; s++)
+            delete shards[s];
+    }
+};
+
+
+
+// ==============================================================================================================
+// ATOMIC VARIABLES VERSION, MODE=2, EXTERNAL MEMORY, WITHOUT BLOOM FILTER
+// ==============================================================================================================
+
+// First pass splits the reads into super-k-mers and spills them to one scratch file per minimizer partition.
+// Second pass counts the partitions one at a time, so only one partition hash table is in memory at once.
+template<class sym_type,
+         bool is_gzipped=false,
+         class slot_layout=SlotLayoutP38C14>
+struct parse_input_pointer_atomic_variable_EXTERNAL{
+
+    void operator()(
+                    std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, size_t n_partitions, size_t minimizer_len, off_t k,
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug, bool binary_output = false){
+        
+        std::cout << "Starting external memory atomic variable pointer hash table\n";
+
+        bool print_times = true;
+        bool print_other_stuff = true;
+        auto start_building = std::chrono::high_resolution_clock::now();
+        // Largest partition hash table that fits the memory budget
+        uint64_t max_partition_size = mathfunctions::shard_hash_table_size(min_slots, n_partitions, true);
+        uint64_t kmer_len = k;
+        uint64_t kmer_blocks = std::ceil(kmer_len/32.0);
+        if (print_other_stuff)
+        {
+            std::cout << "Slot layout: " << slot_layout::pointer_bits << " pointer bits, " << slot_layout::count_bits << " count bits (max count " << slot_layout::max_count << ")\n";
+            std::cout << "Partitions: " << n_partitions << " x at most " << max_partition_size << " slots, routed by minimizers of length " << minimizer_len << "\n";
+        }
+        // Parsers write a batch to its partition file when it has this many characters
+        const size_t batch_characters = 1 << 16;
+        // Scratch files are next to the output file
+        std::vector<std::string> partition_paths(n_partitions);
+        std::vector<std::ofstream> partition_files(n_partitions);
+        std::vector<std::mutex> partition_locks(n_partitions);
+        // K-mers (with repeats) written to each partition, the partition hash tables are sized from these
+        std::vector<uint64_t> partition_kmers(n_partitions, 0);
+        for (size_t p = 0; p < n_partitions; p++)
+        {
+            partition_paths[p] = output_file + ".part" + std::to_string(p);
+            register_scratch_file(partition_paths[p]);
+            partition_files[p].open(partition_paths[p], std::ios::binary | std::ios::trunc);
+            if (!partition_files[p])
+            {
+                std::cout << "Could not create scratch file " << partition_paths[p] << "\n";
+                exit(1);
+            }
+        }
+
+        using chunk_type = text_chunk<sym_type>;
+
+        ts_queue<size_t> in_queue;// thread-safe queue that manage the chunks that are ready to be used
+        ts_queue<size_t> out_queue; // thread-safe queue that stores the chunks that can be reused for new chunks
+        std::vector<chunk_type> text_chunks;
+        int fd = open(input_file.c_str(), O_RDONLY);
+
+        // this is for later: to manage compressed inputs
+        gzFile gfd;
+        if constexpr (is_gzipped){//managed at compilation time
+            gfd = gzdopen(fd, "r");
+        }
+        //
+
+        //get the file size
+        struct stat st{};
+        if(stat(input_file.c_str(), &st) != 0)  return;
+
+        size_t format; //manage to get the input format
+        if (input_mode == 2)
+            format = PLAIN;
+        else if (input_mode == 0)
+            format = FASTA;
+        else
+        {
+            std::cout << "Input file format not supported.";
+            return;
+        }   
+        //std::mutex mtx; //just for debugging (you can remove it afterwards)
+
+        //lambda function that manages IO operations
+        //we feed this function to std::thread
+        auto io_worker = [&]() -> void {
+
+            off_t rem_bytes = st.st_size;
+
+#ifdef __linux__
+            posix_fadvise(fd, 0, rem_bytes, POSIX_FADV_SEQUENTIAL);//tell the linux kernel we will access the file sequentially so it can use the readahead heuristic more effectively
+#endif
+
+            size_t chunk_id=0;
+            text_chunks.resize(active_chunks);
+            off_t tmp_ck_size;
+            bool broken_header=false;
+
+
+            while(chunk_id<active_chunks && rem_bytes>=k){
+
+                tmp_ck_size = std::min(chunk_size, rem_bytes);
+                text_chunks[chunk_id].bytes = tmp_ck_size;
+                text_chunks[chunk_id].buffer = (sym_type *)malloc(tmp_ck_size);
+                text_chunks[chunk_id].id = chunk_id;
+                text_chunks[chunk_id].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    //if (broken_header)
+                    //    std::cout << "Header is broken before check\n";
+                    //else
+                    //    std::cout << "Header not broken before check\n";
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[chunk_id], rem_bytes, k-1, broken_header, start_symbol);
+                    //if (broken_header)
+                    //    std::cout << "Header is broken after check\n";
+                    //else
+                    //    std::cout << "Header not broken after check\n";
+                }
+                //std::cout << "\n";
+                in_queue.push(chunk_id);//as soon as we push, the chunks become visible of the worker threads to consume them
+                chunk_id++;
+                //std::cout << "Chunk pushed " << chunk_id << "\n";
+                //std::cout << "Rem bytes is " << rem_bytes << "\n";
+            }
+
+            //std::cout << "First step ready\n";
+
+            size_t buff_idx;
+            while(rem_bytes>=k){
+                out_queue.pop(buff_idx);//it will wait until out_strings contains something
+                text_chunks[buff_idx].id = chunk_id++;
+                text_chunks[buff_idx].broken_header = broken_header;
+                if constexpr (is_gzipped){
+                    rem_bytes = read_chunk_from_gz_file<chunk_type>(gfd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
+                }else{
+                    rem_bytes = read_chunk_from_file<chunk_type>(fd, text_chunks[buff_idx], rem_bytes, k-1, broken_header, start_symbol);
                 }
-                case FASTQ: //fastq format
-                    //TODO
-                    std::cout<<"Not implemented yet"<<std::endl;
-                    break;
-                default:
-                    std::cout<<"Error : format not recognized"<<std::endl;
-                    break;
+                in_queue.push(buff_idx);
+            }
+
+            //wait for the chunks to be fully processed
+            while(!in_queue.empty());
 
+            //remove the unused chunks from the out queue
+            while(!out_queue.empty()){
+                out_queue.pop(buff_idx);
             }
-            delete kmer_factory;
-            delete rolling_hasher;
-            //delete bf_rolling_hasher;
+
+            in_queue.done();
+            out_queue.done();
+
+            close(fd);
+            //std::cout << "File reading is ready\n";
         };
 
-        //lambda function that gets chunks from the IN queue and calls the hash_kmers lambda
+        // +++ FIRST PASS: SPILL SUPER-K-MERS TO THE PARTITION FILES +++
+
+        //lambda function that appends a batch to its partition file
+        auto push_batch = [&](size_t partition, shard_batch& batch){
+            {
+                std::unique_lock guard(partition_locks[partition]);
+                if (!write_shard_batch(partition_files[partition], batch))
+                {
+                    std::cout << "Could not write scratch file " << partition_paths[partition] << "\n";
+                    exit(1);
+                }
+                partition_kmers[partition] += shard_batch_kmers(batch, kmer_len);
+            }
+            batch.characters.clear();
+            batch.segment_lengths.clear();
+        };
+
+        //lambda function that gets chunks from the IN queue and routes their super-k-mers
         //we feed this function to std::thread
         auto string_worker = [&](size_t worker_id){
 
             size_t buff_id;
             bool res;
-            size_t consumed_kmers = 0;
+            std::vector<shard_batch> open_batches(n_partitions);
 
             while(true){
                 res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
                 assert(text_chunks[buff_id].bytes>0);
                 if(!res) break;
-                hash_kmers(text_chunks[buff_id], format);
-                consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
+                route_chunk_segments(text_chunks[buff_id], format, kmer_len, n_partitions, minimizer_len, 0, open_batches, batch_characters, push_batch);
+                if (print_other_stuff)
+                    std::cout << "Chunk " << text_chunks[buff_id].id << " done\n";
                 out_queue.push(buff_id);//the thread will wait until the stack is free to push
             }
-
-            /*
-            if (print_other_stuff)
-            {//TODO just testing
-                std::unique_lock lck(mtx);
-                std::cout<<"Thread "<<worker_id<<" consumed "<<consumed_kmers<<" kmers "<<std::endl;
+            for (size_t p = 0; p < n_partitions; p++)
+            {
+                if (!open_batches[p].segment_lengths.empty())
+                    push_batch(p, open_batches[p]);
             }
-            */
         };
 
         std::vector<std::thread> threads;
@@ -1514,70 +2551,213 @@ struct parse_input_pointer_atomic_variable{
         }
 
         for(auto & thread : threads){
-            //if (thread.joinable())
             thread.join();
         }
 
         std::vector<chunk_type>().swap(text_chunks);
 
-        
         //remove the pages of the input file from the page cache
 #ifdef __linux__
         posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
 #endif
         close(fd);
 
-        auto start_writing = std::chrono::high_resolution_clock::now();
-        
-        if (debug){
-            std::cout << "Calculating pointer chain lengths\n";
-            hash_table->analyze_pointer_chain_lengths();
+        for (size_t p = 0; p < n_partitions; p++)
+        {
+            partition_files[p].close();
+            if (!partition_files[p])
+            {
+                std::cout << "Could not write scratch file " << partition_paths[p] << "\n";
+                exit(1);
+            }
         }
-        else if (min_abundance > 0)
+
+        auto end_spilling = std::chrono::high_resolution_clock::now();
+
+        // +++ SECOND PASS: COUNT THE PARTITIONS ONE AT A TIME +++
+
+        uint64_t used_slots = 0;
+        uint64_t total_slots = 0;
+        uint64_t max_secondary_slots_used = 0;
+        std::chrono::microseconds writing_duration(0);
+        bool output_created = false;
+
+        // Partitions left to count. A partition whose k-mers do not fit in the largest hash table is split in two
+        // by minimizers under another seed, level = how many times it has been split.
+        struct partition_task{
+            std::string path;
+            uint64_t kmers;
+            uint64_t level;
+        };
+        const uint64_t max_split_level = 16;
+        std::vector<partition_task> partition_tasks;
+        for (size_t p = n_partitions; p > 0; p--)
+            partition_tasks.push_back({partition_paths[p-1], partition_kmers[p-1], 0});
+
+        while (!partition_tasks.empty())
         {
-            std::cout << "Start writing k-mers in a file\n";
-            hash_table->write_kmers_on_disk_separately_even_faster(min_abundance, output_file);
+            partition_task task = partition_tasks.back();
+            partition_tasks.pop_back();
+            // With 1.5 slots per k-mer of the partition the load stays below 2/3 even if all k-mers are distinct
+            uint64_t wanted_size = task.kmers + task.kmers / 2 + 1;
+            uint64_t partition_size = std::min(mathfunctions::next_prime3mod4(std::max(wanted_size, uint64_t(1024))), max_partition_size);
+            bool can_overflow = partition_size < wanted_size;
+            // A smaller table is given up when it would go over 90% load, batches are cut so that the threads can stop in time
+            uint64_t max_load_slots = partition_size - partition_size / 10;
+            uint64_t max_batch_kmers = can_overflow ? std::max(uint64_t(1), partition_size / (32 * n_threads)) : UINT64_MAX;
+            std::atomic<bool> overflow(false);
+
+            PointerHashTableCanonicalAV<slot_layout>* hash_table = new PointerHashTableCanonicalAV<slot_layout>(partition_size, kmer_len, kmer_blocks, n_threads > 1);
+            ts_queue<shard_batch> batch_queue;
+            std::atomic<uint64_t> queued_batches(0);
+            const uint64_t max_queued_batches = 4 * n_threads;
+
+            //lambda function that inserts batches of the current partition, the partition hash table is shared by these threads
+            //we feed this function to std::thread
+            auto partition_worker = [&](size_t worker_id){
+
+                RollingHasherDual* rolling_hasher = new RollingHasherDual(partition_size, kmer_len);
+                KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(k);
+                CountStagingCache count_cache;
+                shard_batch batch;
+
+                while(true){
+                    batch_queue.pop(batch);
+                    // Empty batch means that the partition file has been read
+                    if (batch.segment_lengths.empty())
+                        break;
+                    queued_batches.fetch_sub(1, std::memory_order_relaxed);
+                    // Every thread inserts at most max_batch_kmers new k-mers after its check
+                    if (can_overflow && !overflow.load(std::memory_order_relaxed) && hash_table->get_number_of_inserted_items() + n_threads * max_batch_kmers >= max_load_slots)
+                        overflow.store(true, std::memory_order_relaxed);
+                    if (overflow.load(std::memory_order_relaxed))
+                        continue;
+                    insert_shard_batch(hash_table, batch, kmer_factory, rolling_hasher, &count_cache);
+                }
+                hash_table->flush_count_cache(&count_cache);
+                delete kmer_factory;
+                delete rolling_hasher;
+            };
+
+            std::vector<std::thread> partition_threads;
+            for(size_t i=0;i<n_threads;i++){
+                partition_threads.emplace_back(partition_worker, i);
+            }
+            std::ifstream partition_file(task.path, std::ios::binary);
+            if (!partition_file)
+            {
+                std::cout << "Could not open scratch file " << task.path << "\n";
+                exit(1);
+            }
+            auto queue_batch = [&](shard_batch& batch){
+                while (queued_batches.load(std::memory_order_relaxed) >= max_queued_batches)
+                    std::this_thread::yield();
+                queued_batches.fetch_add(1, std::memory_order_relaxed);
+                batch_queue.push(std::move(batch));
+            };
+            shard_batch batch;
+            bool truncated = false;
+            while (!overflow.load(std::memory_order_relaxed) && read_shard_batch(partition_file, batch, truncated))
+            {
+                if (can_overflow)
+                    cut_shard_batch(batch, kmer_len, max_batch_kmers, queue_batch);
+                else
+                    queue_batch(batch);
+                batch = shard_batch();
+            }
+            for(size_t i=0;i<n_threads;i++){
+                batch_queue.push(shard_batch());
+            }
+            for(auto & thread : partition_threads){
+                thread.join();
+            }
+            if (truncated)
+            {
+                std::cout << "Scratch file " << task.path << " is truncated or could not be read\n";
+                exit(1);
+            }
+            partition_file.close();
+
+            if (overflow.load())
+            {
+                delete hash_table;
+                if (task.level == max_split_level)
+                {
+                    std::cout << "Partition " << task.path << " does not fit in the memory budget after " << max_split_level << " splits, run again with a larger memory budget (--max-memory)\n";
+                    exit(1);
+                }
+                std::vector<std::string> sub_paths = {task.path + ".0", task.path + ".1"};
+                std::vector<uint64_t> sub_kmers(2, 0);
+                split_partition_file(task.path, sub_paths, kmer_len, minimizer_len, CanonicalMinimizerHasher::default_seed * (task.level + 2), 1 << 16, sub_kmers);
+                remove_scratch_file(task.path);
+                if (print_other_stuff)
+                    std::cout << "Partition " << task.path << " did not fit in " << partition_size << " slots, split it in two\n";
+                for (size_t s = 0; s < 2; s++)
+                    partition_tasks.push_back({sub_paths[s], sub_kmers[s], task.level + 1});
+                continue;
+            }
+            remove_scratch_file(task.path);
+
+            auto start_writing = std::chrono::high_resolution_clock::now();
+            if (debug){
+                std::cout << "Calculating pointer chain lengths\n";
+                hash_table->analyze_pointer_chain_lengths();
+            }
+            else if (min_abundance > 0)
+            {
+                // First partition creates the file and the others append to it
+                hash_table->write_kmers_on_disk_separately_even_faster(min_abundance, output_file, output_created, n_threads, binary_output);
+                output_created = true;
+            }
+            writing_duration += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start_writing);
+
+            for (uint64_t cc = 0; cc < partition_size; cc++)
+            {
+                if (hash_table->slot_is_occupied(cc))
+                    used_slots+=1;
+            }
+            total_slots += partition_size;
+            max_secondary_slots_used = std::max(max_secondary_slots_used, hash_table->get_max_number_of_secondary_slots_in_use());
+            if (print_other_stuff)
+                std::cout << "Partition " << task.path << " done\n";
+            delete hash_table;
         }
-            
-        auto end_writing = std::chrono::high_resolution_clock::now();
+
+        auto end_counting = std::chrono::high_resolution_clock::now();
 
         if (print_times)
         {
-            auto build_duration = std::chrono::duration_cast<std::chrono::microseconds>(start_writing - start_building);
-            auto writing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_writing - start_writing);
-            std::cout << "Time used to build hash table: " << build_duration.count() << " microseconds\n";
+            auto spilling_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_spilling - start_building);
+            auto counting_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_counting - end_spilling) - writing_duration;
+            std::cout << "Time used to write partition files: " << spilling_duration.count() << " microseconds\n";
+            std::cout << "Time used to build hash tables: " << counting_duration.count() << " microseconds\n";
             std::cout << "Time used to write k-mers in a file: " << writing_duration.count() << " microseconds\n";
         }
         if (print_other_stuff)
         {
-            uint64_t used_slots = 0;
-            for (uint64_t cc = 0; cc < ht_size; cc++)
-            {
-                if (hash_table->slot_is_occupied(cc))
-                    used_slots+=1;
-            }
-            
-            std::cout << "Main array slots used " << used_slots << " / " << ht_size << "\n";
-            std::cout << "Max secondary array slots used " << hash_table->get_max_number_of_secondary_slots_in_use() << "\n";
+            std::cout << "Main array slots used " << used_slots << " / " << total_slots << "\n";
+            std::cout << "Max secondary array slots used in one partition " << max_secondary_slots_used << "\n";
         }
-        delete hash_table;
     }
 };
 
 
 
+
+
 // ==============================================================================================================
 // ATOMIC FLAG VERSION of BASIC HASH TABLE, MODE=0, WITH BLOOM FILTER
 // ==============================================================================================================
 
 template<class sym_type,
-         bool is_gzipped=false>
+         bool is_gzipped=false,
+         class bloom_filter_type=DoubleAtomicDoubleBloomFilter>
 struct parse_input_atomic_flag_BF{
 
-    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, DoubleAtomicDoubleBloomFilter * bf, uint64_t bloom_filter_size,
+    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, bloom_filter_type * bf, uint64_t bloom_filter_size,
                     uint64_t rolling_hasher_mod, uint64_t hash_functions,
                     std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k, 
-                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode){
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, double max_load_factor, int input_mode, bool binary_output = false){
 
         std::cout << "Starting atomic flag basic hash table\n";
 
@@ -1587,7 +2767,9 @@ struct parse_input_atomic_flag_BF{
         uint64_t ht_size = mathfunctions::next_prime3mod4(min_slots);
         uint64_t kmer_len = k;
         //BasicAtomicHashTable* basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len);
-        BasicAtomicFlagHashTableLong* basic_atomic_hash_table_long = new BasicAtomicFlagHashTableLong(ht_size, kmer_len);
+        BasicAtomicFlagHashTableLong* basic_atomic_hash_table_long = new BasicAtomicFlagHashTableLong(ht_size, kmer_len, max_load_factor);
+        // Set when an insertion would take the table over its maximum load factor, the remaining chunks are skipped
+        std::atomic<bool> table_full(false);
 
         using chunk_type = text_chunk<sym_type>;
 
@@ -1772,12 +2954,12 @@ struct parse_input_atomic_flag_BF{
                             bf_rolling_hasher->update_rolling_hash(new_char, drop_out_char);
                             chars_in_kmer = std::min(chars_in_kmer+1, kmer_len);
 
+                            // Partial k-mers at the start of a read are never counted, skip their filter lookups
                             uint64_t current_root_hash = std::min(bf_rolling_hasher->get_current_hash_backward_rqless(), bf_rolling_hasher->get_current_hash_forward_rqless());
-                            bf->calculate_hashes(current_root_hash, dbf_hash_values);
-                            uint64_t bits_in_bf = bf->second_contains(dbf_hash_values);
+                            bool kmer_in_bf = (chars_in_kmer >= kmer_len) && bf->second_contains_value(current_root_hash, dbf_hash_values);
 
                             // If k-mer is in bloom filter, process it
-                            if (bits_in_bf == hash_functions)
+                            if (kmer_in_bf)
                             {
                                                             
                                 // Build reverse k-mer
@@ -1831,84 +3013,11 @@ struct parse_input_atomic_flag_BF{
                                 bool handled_successfully = false;
                                 if (chars_in_kmer >= uint64_t(k))
                                 {
-                                    if (forward_is_canonical)
+                                    if (!basic_atomic_hash_table_long->insert_or_increase(forward_is_canonical ? kmer_string : kmer_string_reverse, kmer_hash))
                                     {
-                                        while(true)
-                                        {
-                                            probing_round=1;
-                                            // First, acquire the lock
-                                            while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                            // Then, check the k-mer
-                                            // If count == 0, no k-mer -> insert as new
-                                            if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                            {
-                                                basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                                std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes);
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // k-mer exists in the slot, check if it matches
-                                            // If match, k-mer was found
-                                            else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes) == 0)
-                                            {
-                                                // Increase count and done
-                                                basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // Otherwise, probe to next position
-                                            else
-                                            {
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                current_check_slot = current_check_slot + (probing_round*probing_round);
-                                                current_check_slot = current_check_slot % ht_size;
-                                                if (current_check_slot == kmer_hash)
-                                                {
-                                                    std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                    return;
-                                                }
-                                            }
-                                        }
+                                        table_full.store(true, std::memory_order_relaxed);
+                                        return;
                                     }
-                                    else
-                                    {
-                                        while(true)
-                                        {
-                                            probing_round=1;
-                                            // First, acquire the lock
-                                            while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                            // Then, check the k-mer
-                                            // If count == 0, no k-mer -> insert as new
-                                            if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                            {
-                                                basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                                std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes);
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // k-mer exists in the slot, check if it matches
-                                            // If match, k-mer was found
-                                            else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes) == 0)
-                                            {
-                                                // Increase count and done
-                                                basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // Otherwise, probe to next position
-                                            else
-                                            {
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                current_check_slot = current_check_slot + (probing_round*probing_round);
-                                                current_check_slot = current_check_slot % ht_size;
-                                                if (current_check_slot == kmer_hash)
-                                                {
-                                                    std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                    return;
-                                                }
-                                            }
-                                        }
-                                    }   
                                 }
                             }
                         }
@@ -2018,12 +3127,12 @@ struct parse_input_atomic_flag_BF{
                             bf_rolling_hasher->update_rolling_hash(new_char, drop_out_char);
                             chars_in_kmer = std::min(chars_in_kmer+1, kmer_len);
 
+                            // Partial k-mers at the start of a read are never counted, skip their filter lookups
                             uint64_t current_root_hash = std::min(bf_rolling_hasher->get_current_hash_backward_rqless(), bf_rolling_hasher->get_current_hash_forward_rqless());
-                            bf->calculate_hashes(current_root_hash, dbf_hash_values);
-                            uint64_t bits_in_bf = bf->second_contains(dbf_hash_values);
+                            bool kmer_in_bf = (chars_in_kmer >= kmer_len) && bf->second_contains_value(current_root_hash, dbf_hash_values);
 
                             // If k-mer is in bloom filter, process it
-                            if (bits_in_bf == hash_functions)
+                            if (kmer_in_bf)
                             {
                     
                                                             
@@ -2078,85 +3187,11 @@ struct parse_input_atomic_flag_BF{
                                 bool handled_successfully = false;
                                 if (chars_in_kmer >= uint64_t(k))
                                 {
-                                    if (forward_is_canonical)
+                                    if (!basic_atomic_hash_table_long->insert_or_increase(forward_is_canonical ? kmer_string : kmer_string_reverse, kmer_hash))
                                     {
-                                        while(true)
-                                        {
-                                            probing_round=1;
-                                            // First, acquire the lock
-                                            while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                            // Then, check the k-mer
-                                            // If count == 0, no k-mer -> insert as new
-                                            if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                            {
-                                                basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                                std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes);
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // k-mer exists in the slot, check if it matches
-                                            // If match, k-mer was found
-                                            else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string, kmer_bytes) == 0)
-                                            {
-                                                // Increase count and done
-                                                basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // Otherwise, probe to next position
-                                            else
-                                            {
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                current_check_slot = current_check_slot + (probing_round*probing_round);
-                                                current_check_slot = current_check_slot % ht_size;
-                                                if (current_check_slot == kmer_hash)
-                                                {
-                                                    std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                    return;
-                                                }
-                                            }
-                                        }
+                                        table_full.store(true, std::memory_order_relaxed);
+                                        return;
                                     }
-                                    else
-                                    {
-                                        while(true)
-                                        {
-                                            probing_round=1;
-                                            // First, acquire the lock
-                                            while (basic_atomic_hash_table_long->kmer_locks[current_check_slot].test_and_set(std::memory_order_acquire));
-                                            // Then, check the k-mer
-                                            // If count == 0, no k-mer -> insert as new
-                                            if (basic_atomic_hash_table_long->counts[current_check_slot] == 0)
-                                            {
-                                                basic_atomic_hash_table_long->counts[current_check_slot] = 1;
-                                                std::memcpy(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes);
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // k-mer exists in the slot, check if it matches
-                                            // If match, k-mer was found
-                                            else if (std::memcmp(&(basic_atomic_hash_table_long->kmer_array[kmer_bytes*current_check_slot]), kmer_string_reverse, kmer_bytes) == 0)
-                                            {
-                                                // Increase count and done
-                                                basic_atomic_hash_table_long->counts[current_check_slot] += 1;
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                break;
-                                            }
-                                            // Otherwise, probe to next position
-                                            else
-                                            {
-                                                basic_atomic_hash_table_long->kmer_locks[current_check_slot].clear(std::memory_order_release);
-                                                current_check_slot = current_check_slot + (probing_round*probing_round);
-                                                current_check_slot = current_check_slot % ht_size;
-                                                if (current_check_slot == kmer_hash)
-                                                {
-                                                    std::cout << "Hash table is full... Cannot handle this yet\n";
-                                                    return;
-                                                }
-                                            }
-                                        }
-                                    }
-                                    
                                 }
                             }
                         }
@@ -2189,7 +3224,8 @@ struct parse_input_atomic_flag_BF{
                 res = in_queue.pop(buff_id);//the thread will wait until there is something to pop
                 //assert(text_chunks[buff_id].bytes>0);
                 if(!res) break;
-                hash_kmers(text_chunks[buff_id], format);
+                if (!table_full.load(std::memory_order_relaxed))
+                    hash_kmers(text_chunks[buff_id], format);
                 consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
                 out_queue.push(buff_id);//the thread will wait until the stack is free to push
             }
@@ -2227,9 +3263,15 @@ struct parse_input_atomic_flag_BF{
 #endif
         close(fd);
 
+        if (table_full.load())
+        {
+            std::cout << "Plain hash table of " << ht_size << " slots went over its maximum load factor " << max_load_factor << ", run again with a larger maximum load factor (--max-load-factor)\n";
+            exit(1);
+        }
+
         auto start_writing = std::chrono::high_resolution_clock::now();
         if (min_abundance > 0)
-            basic_atomic_hash_table_long->write_kmers(min_abundance, output_file);
+            basic_atomic_hash_table_long->write_kmers(min_abundance, output_file, binary_output);
         auto end_writing = std::chrono::high_resolution_clock::now();
         delete basic_atomic_hash_table_long;
 
@@ -2247,15 +3289,18 @@ struct parse_input_atomic_flag_BF{
 // ==============================================================================================================
 
 template<class sym_type,
-         bool is_gzipped=false>
+         bool is_gzipped=false,
+         class slot_layout=SlotLayoutP38C14,
+         class bloom_filter_type=DoubleAtomicDoubleBloomFilter>
 struct parse_input_pointer_atomic_variable_BF{
 
     
 
-    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, DoubleAtomicDoubleBloomFilter * bf, uint64_t bloom_filter_size, 
+    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, bloom_filter_type * bf, uint64_t bloom_filter_size, 
                     uint64_t rolling_hasher_mod, uint64_t hash_functions,
                     std::string& input_file,  std::string& output_file, off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k,
-                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug){
+                    sym_type start_symbol, uint64_t min_slots, uint64_t min_abundance, int input_mode, bool debug, bool single_pass = false,
+                    packed_read_cache* read_cache = nullptr, bool binary_output = false){
         
         std::cout << "Starting atomic variable pointer hash table\n";
 
@@ -2268,7 +3313,9 @@ struct parse_input_pointer_atomic_variable_BF{
         uint64_t kmer_len = k;
         //BasicAtomicHashTable* basic_atomic_hash_table = new BasicAtomicHashTable(ht_size, kmer_len);
         uint64_t kmer_blocks = std::ceil(kmer_len/32.0);
-        PointerHashTableCanonicalAV* hash_table = new PointerHashTableCanonicalAV(ht_size, kmer_len, kmer_blocks);
+        PointerHashTableCanonicalAV<slot_layout>* hash_table = new PointerHashTableCanonicalAV<slot_layout>(ht_size, kmer_len, kmer_blocks, n_threads > 1);
+        if (print_other_stuff)
+            std::cout << "Slot layout: " << slot_layout::pointer_bits << " pointer bits, " << slot_layout::count_bits << " count bits (max count " << slot_layout::max_count << ")\n";
 
         using chunk_type = text_chunk<sym_type>;
 
@@ -2373,12 +3420,34 @@ struct parse_input_pointer_atomic_variable_BF{
             //std::cout << "File reading is ready\n";
         };
 
+        // Returns 2 for the second occurrence of a k-mer, 3 for later ones and less if the k-mer is not counted.
+        // After a bloom filtering pass k-mers in the second filter are counted, in single pass mode the k-mers
+        // are inserted in the filters here and counted from their second occurrence on
+        // The standard filter sets the bits of a k-mer one at a time, so two concurrent occurrences of the same k-mer
+        // could both miss that they are the second one. Its occurrences of a k-mer update the filters under one of these locks.
+        // The blocked filter sets all bits of a k-mer with one fetch_or and needs no lock.
+        constexpr bool lock_occurrences = std::is_same<bloom_filter_type, DoubleAtomicDoubleBloomFilter>::value;
+        const uint64_t occurrence_lock_bits = 12;
+        std::vector<std::mutex> occurrence_locks((single_pass && lock_occurrences) ? (uint64_t(1) << occurrence_lock_bits) : 0);
+        auto occurrences_in_bf = [&](uint64_t root_hash, std::vector<uint64_t>& hash_values) -> uint64_t {
+            if (single_pass)
+            {
+                if constexpr (lock_occurrences)
+                {
+                    std::unique_lock guard(occurrence_locks[(root_hash * 0x9E3779B97F4A7C15ULL) >> (64 - occurrence_lock_bits)]);
+                    return bf->insertion_process(root_hash, hash_values);
+                }
+                return bf->insertion_process(root_hash, hash_values);
+            }
+            return bf->second_contains_value(root_hash, hash_values) ? 3 : 0;
+        };
+
         //lambda functions that hash the kmers in a text chunk
         //note: it is not necessary for this function to be a lambda. It can be a static function
 
         // MODIFIED LONG
         //int poppipop = 0;
-        auto hash_kmers =[&](chunk_type& chunk, size_t format){
+        auto hash_kmers =[&](chunk_type& chunk, size_t format, CountStagingCache* count_cache){
             
             //poppipop += 1;
             //std::cout << "Haloo 1:" << poppipop << "\n";
@@ -2434,15 +3503,17 @@ struct parse_input_pointer_atomic_variable_BF{
                             // Calculate Bloom filter hash values
 
                             uint64_t current_root_hash = std::min(bf_rolling_hasher->get_current_hash_backward_rqless(), bf_rolling_hasher->get_current_hash_forward_rqless());
-                            bf->calculate_hashes(current_root_hash, dbf_hash_values);
-                            uint64_t bits_in_bf = bf->second_contains(dbf_hash_values);
+                            uint64_t occurrences = occurrences_in_bf(current_root_hash, dbf_hash_values);
 
                             // If k-mer is in bloom filter, process it
-                            if (bits_in_bf == hash_functions)
+                            if (occurrences >= 2)
                             {
                                 //current_kmer_slot = hash_table->process_kmer(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
                                 //current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot);
-                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, bf_rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
+                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, bf_rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache); 
+                                // The first occurrence only went to the bloom filter
+                                if (occurrences == 2)
+                                    hash_table->stage_count_increase(current_kmer_slot, count_cache);
                                 predecessor_kmer_exists = true;
                                 predecessor_kmer_slot = current_kmer_slot;
                             }
@@ -2541,15 +3612,17 @@ struct parse_input_pointer_atomic_variable_BF{
                             // Calculate Bloom filter hash values
                             
                             uint64_t current_root_hash = std::min(bf_rolling_hasher->get_current_hash_backward_rqless(), bf_rolling_hasher->get_current_hash_forward_rqless());
-                            bf->calculate_hashes(current_root_hash, dbf_hash_values);
-                            uint64_t bits_in_bf = bf->second_contains(dbf_hash_values);
+                            uint64_t occurrences = occurrences_in_bf(current_root_hash, dbf_hash_values);
                             
                             // If k-mer is in bloom filter, process it
-                            if (bits_in_bf == hash_functions)
+                            if (occurrences >= 2)
                             {
                                 //current_kmer_slot = hash_table->process_kmer(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
                                 //current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot);
-                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, bf_rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot); 
+                                current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, bf_rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache); 
+                                // The first occurrence only went to the bloom filter
+                                if (occurrences == 2)
+                                    hash_table->stage_count_increase(current_kmer_slot, count_cache);
                                 predecessor_kmer_exists = true;
                                 predecessor_kmer_slot = current_kmer_slot;
                             }
@@ -2581,6 +3654,63 @@ struct parse_input_pointer_atomic_variable_BF{
             delete bf_rolling_hasher;
         };
 
+        // Same as hash_kmers for the runs of bases the bloom filtering pass packed in read_cache
+        auto hash_packed_kmers =[&](const packed_chunk& packed, CountStagingCache* count_cache){
+
+            RollingHasherDual* bf_rolling_hasher = new RollingHasherDual(rolling_hasher_mod, kmer_len, bf_modmulinv, bf_multiplier, ht_size, true);
+            std::vector<uint64_t> dbf_hash_values(hash_functions, 0);
+            KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(k);
+
+            uint64_t run_start = 0;
+            for (uint64_t run_end : packed.run_ends)
+            {
+                kmer_factory->reset();
+                bf_rolling_hasher->reset();
+                bool predecessor_kmer_exists = false;
+                uint64_t predecessor_kmer_slot = ht_size;
+                for (uint64_t b = run_start; b < run_end; b++)
+                {
+                    kmer_factory->push_new_integer(packed.base(b));
+                    bf_rolling_hasher->update_rolling_hash(kmer_factory->get_forward_newest_character(), kmer_factory->get_forward_pushed_off_character());
+                    if (kmer_factory->get_number_of_stored_characters() == int(kmer_len))
+                    {
+                        uint64_t current_root_hash = std::min(bf_rolling_hasher->get_current_hash_backward_rqless(), bf_rolling_hasher->get_current_hash_forward_rqless());
+                        uint64_t occurrences = occurrences_in_bf(current_root_hash, dbf_hash_values);
+                        if (occurrences >= 2)
+                        {
+                            uint64_t current_kmer_slot = hash_table->process_kmer_MT(kmer_factory, bf_rolling_hasher, predecessor_kmer_exists, predecessor_kmer_slot, count_cache);
+                            if (occurrences == 2)
+                                hash_table->stage_count_increase(current_kmer_slot, count_cache);
+                            predecessor_kmer_exists = true;
+                            predecessor_kmer_slot = current_kmer_slot;
+                        }
+                        else
+                        {
+                            predecessor_kmer_exists = false;
+                            predecessor_kmer_slot = ht_size;
+                        }
+                    }
+                }
+                run_start = run_end;
+            }
+            delete kmer_factory;
+            delete bf_rolling_hasher;
+        };
+
+        // Workers take the cached chunks in order
+        std::atomic<size_t> next_packed_chunk(0);
+        auto packed_worker = [&](size_t worker_id){
+            CountStagingCache count_cache;
+            while (true)
+            {
+                size_t chunk_id = next_packed_chunk.fetch_add(1, std::memory_order_relaxed);
+                if (chunk_id >= read_cache->size())
+                    break;
+                hash_packed_kmers((*read_cache)[chunk_id], &count_cache);
+            }
+            hash_table->flush_count_cache(&count_cache);
+        };
+
         //lambda function that gets chunks from the IN queue and calls the hash_kmers lambda
         //we feed this function to std::thread
         auto string_worker = [&](size_t worker_id){
@@ -2588,6 +3718,8 @@ struct parse_input_pointer_atomic_variable_BF{
             size_t buff_id;
             bool res;
             size_t consumed_kmers = 0;
+            // Pending count increases of this thread
+            CountStagingCache count_cache;
 
             while(true){
                 //std::cout << "Waiting for chunks\n";
@@ -2597,10 +3729,11 @@ struct parse_input_pointer_atomic_variable_BF{
                 //std::cout << "Asserted succesfully\n";
                 if(!res) break;
                 //std::cout << "Chunk was ok\n";
-                hash_kmers(text_chunks[buff_id], format);
+                hash_kmers(text_chunks[buff_id], format, &count_cache);
                 consumed_kmers+=text_chunks[buff_id].syms_in_buff-k+1;
                 out_queue.push(buff_id);//the thread will wait until the stack is free to push
             }
+            hash_table->flush_count_cache(&count_cache);
             //std::cout << "Worker " << worker_id << " created\n";
             /*
             if (print_other_stuff)
@@ -2612,12 +3745,22 @@ struct parse_input_pointer_atomic_variable_BF{
         };
 
         std::vector<std::thread> threads;
-        threads.emplace_back(io_worker);
-        //std::cout << "Starting to create workers\n";
-        for(size_t i=0;i<n_threads;i++){
-            //std::cout << "Sending worker creation request\n";
-            threads.emplace_back(string_worker, i);
-            //std::cout << "Request completed\n";
+        if (read_cache != nullptr)
+        {
+            // The input was parsed in the bloom filtering pass
+            for(size_t i=0;i<n_threads;i++){
+                threads.emplace_back(packed_worker, i);
+            }
+        }
+        else
+        {
+            threads.emplace_back(io_worker);
+            //std::cout << "Starting to create workers\n";
+            for(size_t i=0;i<n_threads;i++){
+                //std::cout << "Sending worker creation request\n";
+                threads.emplace_back(string_worker, i);
+                //std::cout << "Request completed\n";
+            }
         }
 
         for(auto & thread : threads){
@@ -2643,7 +3786,7 @@ struct parse_input_pointer_atomic_variable_BF{
         else if (min_abundance > 0)
         {
             std::cout << "Start writing k-mers in a file\n";
-            hash_table->write_kmers_on_disk_separately_even_faster(min_abundance, output_file);
+            hash_table->write_kmers_on_disk_separately_even_faster(min_abundance, output_file, false, n_threads, binary_output);
         }
             
         auto end_writing = std::chrono::high_resolution_clock::now();
@@ -2676,15 +3819,16 @@ struct parse_input_pointer_atomic_variable_BF{
 // PARALLEL PARSER FOR BLOOM FILTERING
 // ==============================================================================================================
 template<class sym_type,
-         bool is_gzipped=false>
+         bool is_gzipped=false,
+         class bloom_filter_type=DoubleAtomicDoubleBloomFilter>
 struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
 
     
 
-    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, DoubleAtomicDoubleBloomFilter * adbf, uint64_t bloom_filter_size, 
+    void operator()(uint64_t bf_modmulinv, uint64_t bf_multiplier, bloom_filter_type * adbf, uint64_t bloom_filter_size, 
                     uint64_t rolling_hasher_mod, uint64_t hash_functions,
                     std::string& input_file,  off_t chunk_size, size_t active_chunks, size_t n_threads, off_t k,
-                    sym_type start_symbol, int input_mode, bool debug){
+                    sym_type start_symbol, int input_mode, bool debug, packed_read_cache* read_cache = nullptr){
         
         std::cout << "Starting parallel bloom filtering\n";
 
@@ -2805,6 +3949,11 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
             // --- Build k-mer factory ---
             KMerFactoryCanonical2BC* kmer_factory = new KMerFactoryCanonical2BC(k);
 
+            // Bases of the chunk for the counting pass
+            packed_chunk* packed = nullptr;
+            if (read_cache != nullptr)
+                packed = new packed_chunk(chunk.syms_in_buff);
+
             switch (format) {
                 case PLAIN://one-string-per-line format
                 {
@@ -2816,8 +3965,12 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
                         
                         if (new_char > 3ULL){
                             kmer_factory->reset();
+                            if (packed != nullptr)
+                                packed->end_run(kmer_len);
                         } else {
                             kmer_factory->push_new_integer(new_char);
+                            if (packed != nullptr)
+                                packed->push_base(new_char);
                         }
                             
                         if (kmer_factory->get_number_of_stored_characters() == 0){
@@ -2865,6 +4018,8 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
                             parsing_header = false;
                             kmer_factory->reset();
                             bf_rolling_hasher->reset();
+                            if (packed != nullptr)
+                                packed->end_run(kmer_len);
                             continue;
                         }                        
                         // If the next character is newline, skip it
@@ -2876,8 +4031,12 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
                         new_char =  uint64_t(twobitstringfunctions::char2int(chunk.buffer[i]));
                         if (new_char > 3ULL){
                             kmer_factory->reset();
+                            if (packed != nullptr)
+                                packed->end_run(kmer_len);
                         } else {
                             kmer_factory->push_new_integer(new_char);
+                            if (packed != nullptr)
+                                packed->push_base(new_char);
                         }
                             
                         if (kmer_factory->get_number_of_stored_characters() == 0){
@@ -2915,6 +4074,11 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
             }
             delete kmer_factory;
             delete bf_rolling_hasher;
+            if (packed != nullptr)
+            {
+                packed->end_run(kmer_len);
+                read_cache->store(chunk.id, packed);
+            }
         };
 
         //lambda function that gets chunks from the IN queue and calls the hash_kmers lambda
@@ -2970,6 +4134,8 @@ struct parse_input_pointer_atomic_variable_BLOOM_FILTERING{
             auto filtering_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_filtering - start_filtering);
             std::cout << "Time used to bloom filter k-mers: " << filtering_duration.count() << " microseconds\n";
         }    
+        if (print_other_stuff && read_cache != nullptr)
+            std::cout << "Read cache size: " << read_cache->bytes() << " bytes\n";
     }
 };
 
@@ -0,0 +1,71 @@
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#pragma once
+
+//////////////////////////////////////////////
+//
+// Statistics counter updated by many threads
+//
+//////////////////////////////////////////////
+
+/*
+    Counter split into cache line sized slots. Every thread adds to its own slot,
+    so concurrent updates are exact and do not bounce one cache line between cores.
+    Reading sums all slots, so reads are meant for reporting, not for hot loops.
+*/
+class ShardedCounter
+{
+    private:
+        static const std::size_t shards = 64;
+
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> value;
+        };
+
+        Slot slots[shards];
+
+        // Threads get slots round-robin on their first update
+        static std::size_t thread_shard()
+        {
+            static std::atomic<std::size_t> next_shard(0);
+            thread_local std::size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % shards;
+            return shard;
+        }
+
+    public:
+        ShardedCounter()
+        {
+            reset();
+        }
+
+        ShardedCounter(const ShardedCounter&) = delete;
+        ShardedCounter& operator=(const ShardedCounter&) = delete;
+
+        void add(uint64_t amount = 1)
+        {
+            slots[thread_shard()].value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        // Slots wrap around, the sum is still exact
+        void subtract(uint64_t amount = 1)
+        {
+            slots[thread_shard()].value.fetch_sub(amount, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const
+        {
+            uint64_t sum = 0;
+            for (std::size_t i = 0; i < shards; i++)
+                sum += slots[i].value.load(std::memory_order_relaxed);
+            return sum;
+        }
+
+        void reset()
+        {
+            for (std::size_t i = 0; i < shards; i++)
+                slots[i].value.store(0, std::memory_order_relaxed);
+        }
+};
@@ -12,6 +12,7 @@
 #include <zlib.h>
 #include <cassert>
 #include <iostream>
+#include <mutex>
 
 
 template<class sym_t>
@@ -35,6 +36,87 @@ struct text_chunk {
     }
 };
 
+// Bases of one text chunk packed 2 bits per base, 32 bases per word starting from the lowest bits.
+// A run is a stretch of bases without resets, so k-mers never cross the end of a run.
+struct packed_chunk {
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> run_ends; //index after the last base of every run
+    uint64_t n_bases = 0;
+    uint64_t run_start = 0;
+
+    explicit packed_chunk(off_t expected_bases){
+        words.reserve(expected_bases/32 + 1);
+    }
+
+    inline void push_base(uint64_t base){
+        if(n_bases % 32 == 0){
+            words.push_back(0);
+        }
+        words[n_bases/32] |= base << (2*(n_bases % 32));
+        n_bases++;
+    }
+
+    //ends the current run, runs shorter than min_run bases have no k-mers and are dropped
+    inline void end_run(uint64_t min_run){
+        if(n_bases - run_start >= min_run){
+            run_ends.push_back(n_bases);
+            run_start = n_bases;
+            return;
+        }
+        n_bases = run_start;
+        words.resize((n_bases + 31) / 32);
+        if(n_bases % 32 != 0){
+            words.back() &= (uint64_t(1) << (2*(n_bases % 32))) - 1;
+        }
+    }
+
+    inline uint64_t base(uint64_t i) const {
+        return (words[i/32] >> (2*(i % 32))) & uint64_t(3);
+    }
+
+    size_t bytes() const {
+        return words.capacity()*sizeof(uint64_t) + run_ends.capacity()*sizeof(uint64_t);
+    }
+};
+
+// Packed chunks of the whole input indexed by chunk id, filled by the parsing threads of the first pass
+class packed_read_cache {
+public:
+    ~packed_read_cache(){
+        for(packed_chunk * chunk : chunks){
+            delete chunk;
+        }
+    }
+
+    void store(size_t chunk_id, packed_chunk * chunk){
+        std::unique_lock guard(lock);
+        if(chunks.size() <= chunk_id){
+            chunks.resize(chunk_id + 1, nullptr);
+        }
+        chunks[chunk_id] = chunk;
+    }
+
+    size_t size() const {
+        return chunks.size();
+    }
+
+    const packed_chunk& operator[](size_t chunk_id) const {
+        return *chunks[chunk_id];
+    }
+
+    size_t bytes() const {
+        size_t total = 0;
+        for(packed_chunk * chunk : chunks){
+            total += chunk->bytes();
+        }
+        return total;
+    }
+
+private:
+    std::mutex lock;
+    std::vector<packed_chunk*> chunks;
+};
+
 template<class text_chunk_t,
          typename sym_t = typename text_chunk_t::sym_type>
 off_t read_chunk_from_gz_file(gzFile gfd, // file descriptor
@@ -5,6 +5,7 @@
 
 #include <cmath>
 #include <chrono>
+#include <type_traits>
 
 #include "external/CLI11.hpp"
 #include <filesystem>
@@ -75,6 +76,12 @@ struct arguments{
     uint64_t min_slots = 0;
     uint64_t min_abundance = 0;
     size_t n_threads = 1;//number of threads
+    size_t n_shards = 0;//number of hash table shards (0 = one shared hash table)
+    size_t minimizer_len = 0;//minimizer length for routing k-mers to shards (0 = route by k-mer hash)
+    uint64_t max_memory = 0;//memory budget in megabytes for the hash table (0 = whole hash table in memory)
+    double max_load_factor = 0.9;//largest fraction of occupied slots in the plain hash table
+    bool batch_insert = false;//insert the k-mers of the plain hash table in slot ordered batches
+    bool binary_output = false;//write a binary k-mer database instead of text lines
 
     std::string input_file;
     std::string output_file;
@@ -90,6 +97,11 @@ struct arguments{
     double fpr = 0.01;
     uint64_t expected_number_of_unique_kmers = 0;
     bool use_bloom_filter = false;
+    bool blocked_bloom_filter = false;
+    bool counting_bloom_filter = false;
+    bool bloom_filter_double_hashing = false;
+    bool single_pass_bloom_filter = false;
+    bool read_cache = false;
 
     bool ver{};
     std::string version ="0.0.1v";
@@ -134,12 +146,23 @@ int parse_app(CLI::App& app, struct arguments& args) {
     app.add_option("INPUT", args.input_file, "Input file (automatic format detection)")->check(CLI::ExistingFile)->required();
     app.add_option("KLEN", args.k, "k-mer length")->check(CLI::PositiveNumber)->required();
 
-    app.add_option("-m,--hash-table-type", args.hash_table_mode, "Hash table type: 0 for plain and 2 for kaarme (def. 2)")->check(CLI::Range(0,2))->default_val(2);
+    app.add_option("-m,--hash-table-type", args.hash_table_mode, "Hash table type: 0 for plain, 2 for kaarme and 3 for kaarme with 4 characters per slot side (def. 2)")->check(CLI::Range(0,3))->default_val(2);
     app.add_option("-a,--min-k-abu", args.min_abundance, "Minimum abundance threshold for the output k-mers (def. 2)")->default_val(2);
     app.add_option("-t,--threads", args.n_threads, "Number of working threads (def. 3)")->check(CLI::Range(3,64));
+    app.add_option("--shards", args.n_shards, "Number of hash table shards, each owned by one working thread (type 2 without bloom filters, def. 0 = no shards)")->check(CLI::Range(0,64))->default_val(0);
+    app.add_option("--minimizer-len", args.minimizer_len, "Route super-k-mers to the shards by their minimizer of this length instead of routing single k-mers by hash (def. 0 = by hash)")->check(CLI::Range(0,31))->default_val(0);
+    app.add_option("--max-memory", args.max_memory, "Count in partitions spilled to disk so that one partition hash table fits in this many megabytes (type 2 without bloom filters, def. 0 = all in memory)")->default_val(0);
+    app.add_option("--max-load-factor", args.max_load_factor, "Maximum fraction of occupied slots in the plain hash table (type 0), counting stops with an error above it (def. 0.9)")->check(CLI::Range(0.1,1.0))->default_val(0.9);
+    app.add_flag("--batch-insert", args.batch_insert, "Sort the k-mers of each chunk by slot and insert them in slot order (type 0 without bloom filters)");
     app.add_option("-o,--output-file", args.output_file, "Output file where the k-mer counts will be stored");
+    app.add_flag("--binary-output", args.binary_output, "Write the k-mer counts as a binary database of 2-bit packed k-mers and 32-bit counts (hash table types 0 and 2)");
     auto *bf_flag = app.add_flag("-b,--use-bfilter", args.use_bloom_filter, "Use bloom filters to discard unique k-mers");
     auto fpr = app.add_option("-f,--bfilter-fpr", args.fpr, "Bloom filter false positive rate (def. 0.01)")->check(CLI::Range(0.001,0.999))->default_val(0.01);
+    auto blocked_bf_flag = app.add_flag("--blocked-bfilter", args.blocked_bloom_filter, "Keep the hash bits of each k-mer in one 64-bit word of the bloom filters, faster but sized up to reach the false positive rate (about 1.25 times the memory at -f 0.01, 1.6 times at 0.001)");
+    auto counting_bf_flag = app.add_flag("--counting-bfilter", args.counting_bloom_filter, "Use a bloom filter with 4-bit counters so that only k-mers seen at least min. abundance times (up to 15) reach the hash table, takes twice the memory of the standard filters during the filtering pass");
+    auto double_hashing_flag = app.add_flag("--bfilter-double-hashing", args.bloom_filter_double_hashing, "Derive all bloom filter hash values from one 128-bit hash");
+    auto single_pass_flag = app.add_flag("--single-pass", args.single_pass_bloom_filter, "Read the input once and count k-mers from their second occurrence in the bloom filters, the hash table is sized for all estimated unique k-mers (type 2). Approximate: on the order of -f of the output k-mers, more if -u is too low, get a count one off or were seen only once");
+    auto read_cache_flag = app.add_flag("--read-cache", args.read_cache, "Keep the reads of the bloom filtering pass in memory, 2 bits per base, and count k-mers from there (type 2)");
 
     auto ex_group = app.add_option_group("dummy group2");
     auto *ht_size = ex_group->add_option("-s,--hash-tab-size", args.min_slots, "Hash table size");
@@ -149,12 +172,146 @@ int parse_app(CLI::App& app, struct arguments& args) {
     bf_flag->needs(bf_unq_kmers);
     bf_unq_kmers->needs(bf_flag);
     fpr->needs(bf_flag);
+    blocked_bf_flag->needs(bf_flag);
+    counting_bf_flag->needs(bf_flag);
+    counting_bf_flag->excludes(blocked_bf_flag);
+    double_hashing_flag->needs(bf_flag);
+    single_pass_flag->needs(bf_flag);
+    single_pass_flag->excludes(counting_bf_flag);
+    read_cache_flag->needs(bf_flag);
+    read_cache_flag->excludes(single_pass_flag);
 
     ht_size->group("Mandatory params");
     bf_unq_kmers->group("Mandatory params");
     return 0;
 }
 
+// Filters out the k-mers seen only once with a bloom filter of the given type and counts the rest
+template<class bloom_filter_type>
+void count_with_bloom_filter(arguments& args, bool is_gzipped, off_t chunk_size, size_t active_chunks, uint64_t bf1_size, uint64_t bf_threads)
+{
+    bloom_filter_type * double_adbf;
+    if constexpr (std::is_same<bloom_filter_type, CountingBlockedBloomFilter>::value){
+        // k-mers pass the filter once they have been seen min. abundance times. There is one 4-bit counter per bit of one
+        // standard filter, so the filtering pass takes 4 * bf1_size bits instead of 2 * bf1_size, for the same false positive rate
+        double_adbf = new bloom_filter_type(bf1_size, args.bf1hfn, args.bloom_filter_double_hashing, args.min_abundance);
+    }else{
+        double_adbf = new bloom_filter_type(bf1_size, args.bf1hfn, args.bloom_filter_double_hashing);
+    }
+    // Reads parsed in the bloom filtering pass for the counting pass
+    packed_read_cache * read_cache = nullptr;
+    if (args.read_cache)
+        read_cache = new packed_read_cache();
+   
+    uint64_t rolling_hasher_mod = uint64_t(1) << 54;
+    uint64_t bf1_multiplier = 5;
+    uint64_t bf1_modmulinv = mathfunctions::modular_multiplicative_inverse_coprimes(bf1_multiplier, rolling_hasher_mod);
+
+#ifdef DEBUG
+    std::cout << "Modular multiplicative inverse for A=" << bf1_multiplier << " and M=" << rolling_hasher_mod << " is " << bf1_modmulinv << "\n";
+#endif
+
+    if (args.single_pass_bloom_filter)
+    {
+        // Every k-mer can reach the hash table on its second occurrence
+        args.min_slots = 2*args.expected_number_of_unique_kmers;
+        std::cerr << "Warning: --single-pass counts are approximate, expect on the order of " << args.fpr*100 << "% of the output k-mers (the -f rate, more if -u is too low)"
+                  << " to have a count one off or to have been seen only once\n";
+    }
+    else
+    {
+        // Bloom filter Atomic Double Bloom Filter
+        if(is_gzipped){
+            parse_input_pointer_atomic_variable_BLOOM_FILTERING<uint8_t, true, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size,
+                                                                    rolling_hasher_mod, args.bf1hfn,
+                                                                    args.input_file, chunk_size, active_chunks, bf_threads, args.k,
+                                                                    args.header_symbol, args.input_mode, args.debug, read_cache);
+        }else{
+            parse_input_pointer_atomic_variable_BLOOM_FILTERING<uint8_t, false, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size,
+                                                                    rolling_hasher_mod, args.bf1hfn,
+                                                                    args.input_file, chunk_size, active_chunks, bf_threads, args.k,
+                                                                    args.header_symbol, args.input_mode, args.debug, read_cache);
+        }
+
+        //auto end_bf = std::chrono::high_resolution_clock::now();
+        //auto duration_bf = std::chrono::duration_cast<std::chrono::microseconds>(end_bf - start_bf);
+        //std::cout << "Time used for Bloom filtering: " << duration_bf.count() << " microseconds\n";
+
+        //exit(0);
+
+        //if(args.use_bloom_filter){
+        args.min_slots = 2*double_adbf->get_new_in_second();
+        //}
+
+#ifdef DEBUG
+        std::cout << "... Resizing bloom filter ...\n";
+#endif
+        auto start_resizing = std::chrono::high_resolution_clock::now();
+        double_adbf->resize(bf_threads);
+        auto end_resizing = std::chrono::high_resolution_clock::now();
+        auto resizing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_resizing - start_resizing);
+#ifdef DEBUG
+        std::cout << "Time used to resize bloom filter: " << resizing_duration.count() << " microseconds\n";
+#endif
+    }
+
+    if(args.hash_table_mode == 0)
+    {
+        if(is_gzipped){
+            parse_input_atomic_flag_BF<uint8_t, true, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn,
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.max_load_factor, args.input_mode, args.binary_output);
+        }else{
+            parse_input_atomic_flag_BF<uint8_t, false, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn,
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.max_load_factor, args.input_mode, args.binary_output);
+        }    
+    }
+    else if (args.hash_table_mode == 1)
+    {
+        if(is_gzipped){
+            parse_input_pointer_atomic_flag<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+        }else{
+            parse_input_pointer_atomic_flag<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+        }
+    }
+    else if (args.hash_table_mode == 2)
+    {
+        // Tables with at most 2^32 slots give the unused pointer bits to the count
+        bool small_pointers = mathfunctions::next_prime3mod4(args.min_slots) <= SlotLayoutP32C20::max_slots;
+        if(is_gzipped && small_pointers){
+            parse_input_pointer_atomic_variable_BF<uint8_t, true, SlotLayoutP32C20, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn, 
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.single_pass_bloom_filter, read_cache, args.binary_output);
+        }else if(is_gzipped){
+            parse_input_pointer_atomic_variable_BF<uint8_t, true, SlotLayoutP38C14, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn, 
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.single_pass_bloom_filter, read_cache, args.binary_output);
+        }else if(small_pointers){
+            parse_input_pointer_atomic_variable_BF<uint8_t, false, SlotLayoutP32C20, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn,
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.single_pass_bloom_filter, read_cache, args.binary_output);
+        }else{
+            parse_input_pointer_atomic_variable_BF<uint8_t, false, SlotLayoutP38C14, bloom_filter_type>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
+                                                                rolling_hasher_mod, args.bf1hfn,
+                                                                args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
+                                                                args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.single_pass_bloom_filter, read_cache, args.binary_output);
+        }
+    }
+    else
+    {
+        std::cout << "Chosen mode not recognized\n";
+    }
+
+    delete double_adbf;
+    delete read_cache;
+}
+
 int main(int argc, char const* argv[])
 {
     arguments args;
@@ -196,16 +353,37 @@ int main(int argc, char const* argv[])
     std::cout<<"  gzip compressed:          "<<(is_gzipped?"yes":"no")<<std::endl;
     std::cout<<"  k-mer length:             "<<args.k<<std::endl;
     std::cout<<"  min. abundance threshold: "<<args.min_abundance<<std::endl;
-    std::cout<<"  hash table type:          "<<(args.hash_table_mode==0?"plain":"kaarme")<<std::endl;
+    std::cout<<"  hash table type:          "<<(args.hash_table_mode==0?"plain":(args.hash_table_mode==3?"kaarme (4 characters per side)":"kaarme"))<<std::endl;
     std::cout<<"  using bloom filers:       "<<(args.use_bloom_filter?"yes":"no")<<std::endl;
     if(args.use_bloom_filter){
         std::cout<<"    est. unique k-mers:     "<<args.expected_number_of_unique_kmers<<std::endl;
         std::cout<<"    false positive rate:    "<<args.fpr<<std::endl;
+        std::cout<<"    cache line blocked:     "<<(args.blocked_bloom_filter?"yes":"no")<<std::endl;
+        std::cout<<"    counting:               "<<(args.counting_bloom_filter?"yes":"no")<<std::endl;
+        std::cout<<"    double hashing:         "<<(args.bloom_filter_double_hashing?"yes":"no")<<std::endl;
+        std::cout<<"    single pass:            "<<(args.single_pass_bloom_filter?"yes":"no")<<std::endl;
+        std::cout<<"    read cache:             "<<(args.read_cache?"yes":"no")<<std::endl;
     }else{
         std::cout<<"    est. hash table size:   "<<args.min_slots<<std::endl;
     }
     std::cout<<"  working threads:          "<<args.n_threads<<std::endl;
+    if(args.hash_table_mode == 0){
+        std::cout<<"  max. load factor:         "<<args.max_load_factor<<std::endl;
+        if(!args.use_bloom_filter){
+            std::cout<<"  slot ordered batches:     "<<(args.batch_insert?"yes":"no")<<std::endl;
+        }
+    }
+    if(args.max_memory > 0){
+        std::cout<<"  memory budget:            "<<args.max_memory<<" MB"<<std::endl;
+    }
+    if(args.n_shards > 0){
+        std::cout<<"  hash table shards:        "<<args.n_shards<<std::endl;
+        if(args.minimizer_len > 0){
+            std::cout<<"    minimizer length:       "<<args.minimizer_len<<std::endl;
+        }
+    }
     std::cout<<"  output file:              "<<args.output_file<<std::endl;
+    std::cout<<"  binary output:            "<<(args.binary_output?"yes":"no")<<std::endl;
 
     //if(args.ver){
     //    std::cout<<args.version<<std::endl;
@@ -380,8 +558,59 @@ int main(int argc, char const* argv[])
         exit(1);
     }*/
 
+    if(args.use_bloom_filter && args.hash_table_mode == 3){
+        std::cerr<<"Hash table type 3 does not support bloom filters yet"<<std::endl;
+        exit(1);
+    }
+
+    if(args.n_shards > 0 && (args.use_bloom_filter || args.hash_table_mode != 2)){
+        std::cerr<<"Shards are only supported by hash table type 2 without bloom filters"<<std::endl;
+        exit(1);
+    }
+
+    if(args.read_cache && args.hash_table_mode != 2){
+        std::cerr<<"Read cache is only supported by hash table type 2"<<std::endl;
+        exit(1);
+    }
+
+    if(args.single_pass_bloom_filter && args.hash_table_mode != 2){
+        std::cerr<<"Single pass bloom filtering is only supported by hash table type 2"<<std::endl;
+        exit(1);
+    }
+
+    if(args.batch_insert && (args.use_bloom_filter || args.hash_table_mode != 0)){
+        std::cerr<<"Batch insertion is only supported by hash table type 0 without bloom filters"<<std::endl;
+        exit(1);
+    }
+
+    if(args.binary_output && args.hash_table_mode != 0 && args.hash_table_mode != 2){
+        std::cerr<<"Binary output is only supported by hash table types 0 and 2"<<std::endl;
+        exit(1);
+    }
+
+    if(args.max_memory > 0 && (args.use_bloom_filter || args.hash_table_mode != 2 || args.n_shards > 0)){
+        std::cerr<<"Memory budget is only supported by hash table type 2 without bloom filters and shards"<<std::endl;
+        exit(1);
+    }
+
+    if(args.minimizer_len > 0 && ((args.n_shards == 0 && args.max_memory == 0) || args.minimizer_len > size_t(args.k))){
+        std::cerr<<"Minimizer length needs shards or a memory budget and must be at most the k-mer length"<<std::endl;
+        exit(1);
+    }
+
+    // External memory partitions are always routed by minimizers
+    if(args.max_memory > 0 && args.minimizer_len == 0){
+        args.minimizer_len = std::min(size_t(11), size_t(args.k));
+    }
+
     args.n_threads = args.n_threads - 2;
 
+    // Shard owners are taken from the working threads, at least one thread is left for parsing
+    size_t parsing_threads = args.n_threads;
+    if(args.n_shards > 0){
+        parsing_threads = std::max(size_t(1), args.n_threads - std::min(args.n_threads, args.n_shards));
+    }
+
     //settings for the file buffers
     size_t active_chunks = 2*args.n_threads; //number of chunks in the buffer
     off_t chunk_size = 1024*1024*10; //size in bytes for every chunk
@@ -401,14 +630,8 @@ int main(int argc, char const* argv[])
         double bloom_filter_error_rate = args.fpr;
         double bloom_filter_bits_min = (-double(args.expected_number_of_unique_kmers) * std::log(bloom_filter_error_rate)) / (std::pow(std::log(2), 2));
         double hash_functions = (bloom_filter_bits_min / double(args.expected_number_of_unique_kmers)) * std::log(2);
-        uint64_t bloom_filter_bits_2P = 2;
-
-        while (bloom_filter_bits_2P < uint64_t(bloom_filter_bits_min)){
-            bloom_filter_bits_2P = 2*bloom_filter_bits_2P;
-        }
-
-        uint64_t bloom_filter_bits = bloom_filter_bits_2P;
-        //uint64_t bloom_filter_bits = bloom_filter_bits_min;
+        // Filters reduce hashes to any range, so no rounding up to a power of two
+        uint64_t bloom_filter_bits = std::max(uint64_t(2), uint64_t(std::ceil(bloom_filter_bits_min)));
 
         // Bloom filter sizes
         args.bloom_filter_1_size = bloom_filter_bits;
@@ -416,6 +639,11 @@ int main(int argc, char const* argv[])
         // Number of Bloom filter hash functions
         args.bf1hfn = std::ceil(hash_functions);
         args.bf2hfn = std::ceil(hash_functions);
+        if(args.blocked_bloom_filter){
+            // All bits of a k-mer are in one 64-bit word, which takes more bits for the same false positive rate
+            args.bloom_filter_1_size = mathfunctions::word_blocked_bloom_filter_bits(args.expected_number_of_unique_kmers, bloom_filter_error_rate, 64, args.bf1hfn);
+            args.bf2hfn = args.bf1hfn;
+        }
 
 #ifdef DEBUG
         std::cout << "Bloom filter error rate " << bloom_filter_error_rate << "\n";
@@ -427,56 +655,24 @@ int main(int argc, char const* argv[])
         uint64_t bf1_size = args.bloom_filter_1_size;
         //uint64_t bf2_size = bloom_filter_1_size;
 
-        //const uint64_t hffs = 7;
-        auto * double_adbf = new DoubleAtomicDoubleBloomFilter(bf1_size, args.bf1hfn);
-       
-        uint64_t rolling_hasher_mod = uint64_t(1) << 54;
-        uint64_t bf1_multiplier = 5;
-        uint64_t bf1_modmulinv = mathfunctions::modular_multiplicative_inverse_coprimes(bf1_multiplier, rolling_hasher_mod);
-
-#ifdef DEBUG
-        std::cout << "Modular multiplicative inverse for A=" << bf1_multiplier << " and M=" << rolling_hasher_mod << " is " << bf1_modmulinv << "\n";
-#endif
-
-        // Bloom filter Atomic Double Bloom Filter
-        parse_input_pointer_atomic_variable_BLOOM_FILTERING<uint8_t, false>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size,
-                                                                    rolling_hasher_mod, args.bf1hfn,
-                                                                    args.input_file, chunk_size, active_chunks, bf_threads, args.k,
-                                                                    args.header_symbol, args.input_mode, args.debug);
-
-        //auto end_bf = std::chrono::high_resolution_clock::now();
-        //auto duration_bf = std::chrono::duration_cast<std::chrono::microseconds>(end_bf - start_bf);
-        //std::cout << "Time used for Bloom filtering: " << duration_bf.count() << " microseconds\n";
-
-        //exit(0);
-
-        //if(args.use_bloom_filter){
-        args.min_slots = 2*double_adbf->get_new_in_second();
-        //}
-
-#ifdef DEBUG
-        std::cout << "... Resizing bloom filter ...\n";
-#endif
-        auto start_resizing = std::chrono::high_resolution_clock::now();
-        double_adbf->resize();
-        auto end_resizing = std::chrono::high_resolution_clock::now();
-        auto resizing_duration = std::chrono::duration_cast<std::chrono::microseconds>(end_resizing - start_resizing);
-#ifdef DEBUG
-        std::cout << "Time used to resize bloom filter: " << resizing_duration.count() << " microseconds\n";
-#endif
+        if(args.counting_bloom_filter){
+            count_with_bloom_filter<CountingBlockedBloomFilter>(args, is_gzipped, chunk_size, active_chunks, bf1_size, bf_threads);
+        }else if(args.blocked_bloom_filter){
+            count_with_bloom_filter<BlockedAtomicDoubleBloomFilter>(args, is_gzipped, chunk_size, active_chunks, bf1_size, bf_threads);
+        }else{
+            count_with_bloom_filter<DoubleAtomicDoubleBloomFilter>(args, is_gzipped, chunk_size, active_chunks, bf1_size, bf_threads);
+        }
+    }
 
-        if(args.hash_table_mode == 0)
+    // If bloom filter is not used
+    else
+    {
+        if (args.hash_table_mode == 0)
         {
             if(is_gzipped){
-                parse_input_atomic_flag_BF<uint8_t, true>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
-                                                                    rolling_hasher_mod, hash_functions,
-                                                                    args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
-                                                                    args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+                parse_input_basic_atomic_variable<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.max_load_factor, args.batch_insert, args.input_mode, args.binary_output);
             }else{
-                parse_input_atomic_flag_BF<uint8_t, false>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
-                                                                    rolling_hasher_mod, hash_functions,
-                                                                    args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
-                                                                    args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+                parse_input_basic_atomic_variable<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.max_load_factor, args.batch_insert, args.input_mode, args.binary_output);
             }    
         }
         else if (args.hash_table_mode == 1)
@@ -487,53 +683,58 @@ int main(int argc, char const* argv[])
                 parse_input_pointer_atomic_flag<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
             }
         }
-        else if (args.hash_table_mode == 2)
+        else if (args.hash_table_mode == 2 && args.max_memory > 0)
         {
-            if(is_gzipped){
-                parse_input_pointer_atomic_variable_BF<uint8_t, true>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
-                                                                    rolling_hasher_mod, hash_functions, 
-                                                                    args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
-                                                                    args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
+            // Half of the budget goes to the partition hash table, the rest is left for its secondary array
+            uint64_t table_budget = args.max_memory * 1024 * 1024 / 2;
+            size_t n_partitions = 1;
+            while (mathfunctions::shard_hash_table_size(args.min_slots, n_partitions, true) * sizeof(uint64_t) > table_budget)
+                n_partitions += 1;
+            bool small_pointers = mathfunctions::shard_hash_table_size(args.min_slots, n_partitions, true) <= SlotLayoutP32C20::max_slots;
+            if(is_gzipped && small_pointers){
+                parse_input_pointer_atomic_variable_EXTERNAL<uint8_t, true, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, n_partitions, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(is_gzipped){
+                parse_input_pointer_atomic_variable_EXTERNAL<uint8_t, true, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, n_partitions, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(small_pointers){
+                parse_input_pointer_atomic_variable_EXTERNAL<uint8_t, false, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, n_partitions, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
             }else{
-                parse_input_pointer_atomic_variable_BF<uint8_t, false>()(bf1_modmulinv, bf1_multiplier, double_adbf, bf1_size, 
-                                                                    rolling_hasher_mod, hash_functions,
-                                                                    args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k,
-                                                                    args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
+                parse_input_pointer_atomic_variable_EXTERNAL<uint8_t, false, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, n_partitions, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
             }
         }
-        else
-        {
-            std::cout << "Chosen mode not recognized\n";
-        }
-
-        delete double_adbf;
-    }
-
-    // If bloom filter is not used
-    else
-    {
-        if (args.hash_table_mode == 0)
+        else if (args.hash_table_mode == 2 && args.n_shards > 0)
         {
-            if(is_gzipped){
-                parse_input_atomic_flag<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+            // Every shard gets its own layout check since shards are smaller than the whole table
+            bool small_pointers = mathfunctions::shard_hash_table_size(args.min_slots, args.n_shards, args.minimizer_len > 0) <= SlotLayoutP32C20::max_slots;
+            if(is_gzipped && small_pointers){
+                parse_input_pointer_atomic_variable_SHARDED<uint8_t, true, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, parsing_threads, args.n_shards, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(is_gzipped){
+                parse_input_pointer_atomic_variable_SHARDED<uint8_t, true, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, parsing_threads, args.n_shards, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(small_pointers){
+                parse_input_pointer_atomic_variable_SHARDED<uint8_t, false, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, parsing_threads, args.n_shards, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
             }else{
-                parse_input_atomic_flag<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
-            }    
+                parse_input_pointer_atomic_variable_SHARDED<uint8_t, false, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, parsing_threads, args.n_shards, args.minimizer_len, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }
         }
-        else if (args.hash_table_mode == 1)
+        else if (args.hash_table_mode == 2)
         {
-            if(is_gzipped){
-                parse_input_pointer_atomic_flag<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+            // Tables with at most 2^32 slots give the unused pointer bits to the count
+            bool small_pointers = mathfunctions::next_prime3mod4(args.min_slots) <= SlotLayoutP32C20::max_slots;
+            if(is_gzipped && small_pointers){
+                parse_input_pointer_atomic_variable<uint8_t, true, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(is_gzipped){
+                parse_input_pointer_atomic_variable<uint8_t, true, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
+            }else if(small_pointers){
+                parse_input_pointer_atomic_variable<uint8_t, false, SlotLayoutP32C20>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
             }else{
-                parse_input_pointer_atomic_flag<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode);
+                parse_input_pointer_atomic_variable<uint8_t, false, SlotLayoutP38C14>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug, args.binary_output);
             }
         }
-        else if (args.hash_table_mode == 2)
+        else if (args.hash_table_mode == 3)
         {
             if(is_gzipped){
-                parse_input_pointer_atomic_variable<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
+                parse_input_pointer_atomic_variable_BIG<uint8_t, true>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
             }else{
-                parse_input_pointer_atomic_variable<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
+                parse_input_pointer_atomic_variable_BIG<uint8_t, false>()(args.input_file, args.output_file, chunk_size, active_chunks, args.n_threads, args.k, args.header_symbol, args.min_slots, args.min_abundance, args.input_mode, args.debug);
             }
         }
         else
@@ -0,0 +1,60 @@
+#include "functions_kmer_database.hpp"
+#include <cstring>
+#include <algorithm>
+
+namespace kmerdatabasefunctions
+{
+    static const char magic[8] = {'K', 'A', 'A', 'R', 'M', 'E', 'D', 'B'};
+
+    uint32_t words_per_kmer(uint32_t kmer_len)
+    {
+        return (kmer_len + 31) / 32;
+    }
+
+    uint64_t record_bytes(uint32_t kmer_len)
+    {
+        return 8 * uint64_t(words_per_kmer(kmer_len)) + count_bytes;
+    }
+
+    void fill_header(char* header, uint32_t kmer_len, uint64_t records)
+    {
+        uint32_t words = words_per_kmer(kmer_len);
+        std::memcpy(header, magic, 8);
+        std::memcpy(header + 8, &format_version, 4);
+        std::memcpy(header + 12, &kmer_len, 4);
+        std::memcpy(header + 16, &words, 4);
+        std::memcpy(header + 20, &count_bytes, 4);
+        std::memcpy(header + 24, &records, 8);
+    }
+
+    uint64_t header_records(const char* header, uint32_t kmer_len)
+    {
+        uint32_t version, header_kmer_len;
+        uint64_t records;
+        std::memcpy(&version, header + 8, 4);
+        std::memcpy(&header_kmer_len, header + 12, 4);
+        std::memcpy(&records, header + 24, 8);
+        if ((std::memcmp(header, magic, 8) != 0) || (version != format_version) || (header_kmer_len != kmer_len))
+        {
+            std::cout << "Output file is not a binary k-mer database of " << kmer_len << "-mers\n";
+            exit(1);
+        }
+        return records;
+    }
+
+    char* write_record(const uint64_t* kmer, uint32_t kmer_words, uint64_t count, char* out)
+    {
+        uint32_t saturated_count = uint32_t(std::min(count, uint64_t(UINT32_MAX)));
+        std::memcpy(out, kmer, 8 * kmer_words);
+        std::memcpy(out + 8 * kmer_words, &saturated_count, count_bytes);
+        return out + 8 * kmer_words + count_bytes;
+    }
+
+    void bytes2words(const uint8_t* kmer, uint32_t kmer_bytes, uint32_t kmer_words, uint64_t* out)
+    {
+        // The bytes form one big-endian number, the last byte goes to the lowest bits of the last word
+        std::memset(out, 0, 8 * kmer_words);
+        for (uint32_t r = 0; r < kmer_bytes; r++)
+            out[kmer_words - 1 - r / 8] |= uint64_t(kmer[kmer_bytes - 1 - r]) << (8 * (r % 8));
+    }
+}
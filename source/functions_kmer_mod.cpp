@@ -6,38 +6,52 @@ namespace kmod
     // Modifier functions
     //===================
 
+    template<class slot_layout>
     uint64_t modify_to_increase_count_by_one(uint64_t D)
     {
         uint64_t D2 = D;
-        if (((D2 >> 12) & uint64_t(16383)) != uint64_t(16383))
-            D2 = D2 + uint64_t(4096);
+        if (((D2 >> slot_layout::count_shift) & slot_layout::max_count) != slot_layout::max_count)
+            D2 = D2 + slot_layout::count_one;
         else
             std::cout << "Count was not increased\n";
         return D2;
     }
 
 
+    // Saturates at max count
+    template<class slot_layout>
+    uint64_t modify_to_increase_count_by(uint64_t D, uint64_t increase)
+    {
+        uint64_t current_count = (D >> slot_layout::count_shift) & slot_layout::max_count;
+        uint64_t new_count = std::min(current_count + increase, slot_layout::max_count);
+        return D + (new_count - current_count) * slot_layout::count_one;
+    }
+
+
+    template<class slot_layout>
     uint64_t modify_predecessor_slot(uint64_t D, uint64_t predecessor_slot)
     {
         uint64_t D2 = D;
-        D2 = (D2 & uint64_t(67108863));
-        D2 = (D2 | (predecessor_slot<<26));
+        D2 = (D2 & slot_layout::below_pointer_mask);
+        D2 = (D2 | (predecessor_slot << slot_layout::pointer_shift));
         return D2;
     }
 
+    template<class slot_layout>
     uint64_t modify_left_character(uint64_t D, uint64_t left_char)
     {
         uint64_t D2 = D;
-        D2 = (D2 & (~(uint64_t(3072))));
-        D2 = (D2 | (left_char << 10));
+        D2 = (D2 & (~(uint64_t(3) << slot_layout::left_char_shift)));
+        D2 = (D2 | (left_char << slot_layout::left_char_shift));
         return D2;
     }
 
+    template<class slot_layout>
     uint64_t modify_right_character(uint64_t D, uint64_t right_char)
     {
         uint64_t D2 = D;
-        D2 = (D2 & (~(uint64_t(768))));
-        D2 = (D2 | (right_char << 8));
+        D2 = (D2 & (~(uint64_t(3) << slot_layout::right_char_shift)));
+        D2 = (D2 | (right_char << slot_layout::right_char_shift));
         return D2;
     }
 
@@ -153,13 +167,14 @@ namespace kmod
         return D2;
     }
 
+    template<class slot_layout>
     uint64_t modify_for_migration(uint64_t D, uint64_t left_char, uint64_t right_char, uint64_t predecessor_slot, uint64_t self_canonical_during_insertion, uint64_t pred_canonical_during_insertion)
     {
         uint64_t D2 = D;
-        D2 = kmod::modify_left_character(D2, left_char);
-        D2 = kmod::modify_right_character(D2, right_char);
+        D2 = kmod::modify_left_character<slot_layout>(D2, left_char);
+        D2 = kmod::modify_right_character<slot_layout>(D2, right_char);
         D2 = kmod::modify_to_have_predecessor(D2);
-        D2 = kmod::modify_predecessor_slot(D2, predecessor_slot);
+        D2 = kmod::modify_predecessor_slot<slot_layout>(D2, predecessor_slot);
         if (self_canonical_during_insertion){
             D2 = kmod::modify_to_be_canonical_during_insertion_self(D2);
         } else {
@@ -173,19 +188,20 @@ namespace kmod
         return D2;   
     }
 
+    template<class slot_layout>
     uint64_t modify_for_insertion(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, bool self_canonical_during_insertion, uint64_t left_char, uint64_t right_char)
     {
         uint64_t D2 = 0;
         D2 = kmod::modify_to_occupied(D2);
-        D2 = kmod::modify_to_increase_count_by_one(D2);
-        D2 = kmod::modify_left_character(D2, left_char);
-        D2 = kmod::modify_right_character(D2, right_char);
+        D2 = kmod::modify_to_increase_count_by_one<slot_layout>(D2);
+        D2 = kmod::modify_left_character<slot_layout>(D2, left_char);
+        D2 = kmod::modify_right_character<slot_layout>(D2, right_char);
         if (predecessor_exists){
             D2 = kmod::modify_to_have_predecessor(D2);
         } else {
             D2 = kmod::modify_to_not_have_predecessor(D2);
         }
-        D2 = kmod::modify_predecessor_slot(D2, predecessor_slot);
+        D2 = kmod::modify_predecessor_slot<slot_layout>(D2, predecessor_slot);
         if (self_canonical_during_insertion){
             D2 = kmod::modify_to_be_canonical_during_insertion_self(D2);
         } else {
@@ -199,10 +215,11 @@ namespace kmod
         return D2;   
     }
 
+    template<class slot_layout>
     uint64_t modify_predecessor_slot_and_orientations(uint64_t D, uint64_t predecessor_slot, bool self_canonical_during_insertion, bool pred_canonical_during_insertion)
     {
         uint64_t D2 = D;
-        D2 = kmod::modify_predecessor_slot(D2, predecessor_slot);
+        D2 = kmod::modify_predecessor_slot<slot_layout>(D2, predecessor_slot);
         if (self_canonical_during_insertion){
             D2 = kmod::modify_to_be_canonical_during_insertion_self(D2);
         } else {
@@ -216,4 +233,92 @@ namespace kmod
         return D2;
     }
 
-}
\ No newline at end of file
+    uint64_t modify_left_characters_big(uint64_t D, uint64_t left_chars)
+    {
+        uint64_t D2 = D;
+        D2 = (D2 & (~(uint64_t(255) << 18)));
+        D2 = (D2 | (left_chars << 18));
+        return D2;
+    }
+
+    uint64_t modify_right_characters_big(uint64_t D, uint64_t right_chars)
+    {
+        uint64_t D2 = D;
+        D2 = (D2 & (~(uint64_t(255) << 10)));
+        D2 = (D2 | (right_chars << 10));
+        return D2;
+    }
+
+    uint64_t modify_predecessor_distance_big(uint64_t D, uint64_t predecessor_distance)
+    {
+        uint64_t D2 = D;
+        D2 = (D2 & (~(uint64_t(3) << 8)));
+        D2 = (D2 | ((predecessor_distance - 1) << 8));
+        return D2;
+    }
+
+    uint64_t modify_for_migration_big(uint64_t D, uint64_t left_chars, uint64_t right_chars, uint64_t predecessor_slot, uint64_t predecessor_distance, bool self_canonical_during_insertion, bool pred_canonical_during_insertion)
+    {
+        uint64_t D2 = D;
+        D2 = kmod::modify_left_characters_big(D2, left_chars);
+        D2 = kmod::modify_right_characters_big(D2, right_chars);
+        D2 = kmod::modify_predecessor_distance_big(D2, predecessor_distance);
+        D2 = kmod::modify_to_have_predecessor(D2);
+        // Pointer sits in the same 38 bits as in the original layout
+        D2 = kmod::modify_predecessor_slot<SlotLayoutP38C14>(D2, predecessor_slot);
+        if (self_canonical_during_insertion){
+            D2 = kmod::modify_to_be_canonical_during_insertion_self(D2);
+        } else {
+            D2 = kmod::modify_to_be_noncanonical_during_insertion_self(D2);
+        }
+        if (pred_canonical_during_insertion){
+            D2 = kmod::modify_to_be_canonical_during_insertion_pred(D2);
+        } else {
+            D2 = kmod::modify_to_be_noncanonical_during_insertion_pred(D2);
+        }
+        return D2;
+    }
+
+    uint64_t modify_for_insertion_big(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, uint64_t predecessor_distance, bool self_canonical_during_insertion, uint64_t left_chars, uint64_t right_chars)
+    {
+        uint64_t D2 = 0;
+        D2 = kmod::modify_to_occupied(D2);
+        D2 = kmod::modify_left_characters_big(D2, left_chars);
+        D2 = kmod::modify_right_characters_big(D2, right_chars);
+        if (predecessor_exists){
+            D2 = kmod::modify_to_have_predecessor(D2);
+            D2 = kmod::modify_predecessor_distance_big(D2, predecessor_distance);
+        } else {
+            D2 = kmod::modify_to_not_have_predecessor(D2);
+        }
+        D2 = kmod::modify_predecessor_slot<SlotLayoutP38C14>(D2, predecessor_slot);
+        if (self_canonical_during_insertion){
+            D2 = kmod::modify_to_be_canonical_during_insertion_self(D2);
+        } else {
+            D2 = kmod::modify_to_be_noncanonical_during_insertion_self(D2);
+        }
+        if (pred_canonical_during_insertion){
+            D2 = kmod::modify_to_be_canonical_during_insertion_pred(D2);
+        } else {
+            D2 = kmod::modify_to_be_noncanonical_during_insertion_pred(D2);
+        }
+        return D2;
+    }
+
+    // Instantiate the layout dependent modifiers for the supported slot layouts
+#define KMOD_INSTANTIATE_LAYOUT(L) \
+    template uint64_t modify_to_increase_count_by_one<L>(uint64_t D); \
+    template uint64_t modify_to_increase_count_by<L>(uint64_t D, uint64_t increase); \
+    template uint64_t modify_predecessor_slot<L>(uint64_t D, uint64_t predecessor_slot); \
+    template uint64_t modify_predecessor_slot_and_orientations<L>(uint64_t D, uint64_t predecessor_slot, bool self_canonical_during_insertion, bool pred_canonical_during_insertion); \
+    template uint64_t modify_left_character<L>(uint64_t D, uint64_t left_char); \
+    template uint64_t modify_right_character<L>(uint64_t D, uint64_t right_char); \
+    template uint64_t modify_for_migration<L>(uint64_t D, uint64_t left_char, uint64_t right_char, uint64_t predecessor_slot, uint64_t self_canonical_during_insertion, uint64_t pred_canonical_during_insertion); \
+    template uint64_t modify_for_insertion<L>(uint64_t D, bool predecessor_exists, bool pred_canonical_during_insertion, uint64_t predecessor_slot, bool self_canonical_during_insertion, uint64_t left_char, uint64_t right_char);
+
+    KMOD_INSTANTIATE_LAYOUT(SlotLayoutP38C14)
+    KMOD_INSTANTIATE_LAYOUT(SlotLayoutP32C20)
+
+#undef KMOD_INSTANTIATE_LAYOUT
+
+}
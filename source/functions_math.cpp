@@ -1,4 +1,6 @@
 #include "functions_math.hpp"
+#include <algorithm>
+#include <vector>
 
 
 namespace mathfunctions
@@ -96,6 +98,71 @@ namespace mathfunctions
     }
 
 
+    uint64_t shard_hash_table_size(uint64_t min_slots, uint64_t n_shards, bool uneven_shards)
+    {
+        uint64_t slots = min_slots / n_shards + 1;
+        if (uneven_shards)
+            slots += slots / 2;
+        return next_prime3mod4(slots);
+    }
+
+
+    double word_blocked_bloom_filter_fpr(double n_words, uint64_t n_items, uint64_t n_hash_functions, uint64_t word_bits)
+    {
+        uint64_t k = n_hash_functions;
+        // no_bits[i] = probability that an item sets none of i given bits of its word
+        std::vector<double> no_bits(k + 1);
+        for (uint64_t i = 0; i <= k; i++)
+        {
+            no_bits[i] = 1.0;
+            for (uint64_t t = 0; t < k; t++)
+                no_bits[i] *= (t + i < word_bits) ? double(word_bits - i - t) / double(word_bits - t) : 0.0;
+        }
+        // The items in a word follow a Poisson distribution, its tails are left out
+        double lambda = double(n_items) / n_words;
+        double spread = 12.0 * std::sqrt(lambda) + 20.0;
+        uint64_t first = uint64_t(std::max(0.0, lambda - spread));
+        uint64_t last = uint64_t(lambda + spread);
+        double result = 0.0;
+        for (uint64_t j = first; j <= last; j++)
+        {
+            double items_probability = std::exp(-lambda + double(j) * std::log(lambda) - std::lgamma(double(j) + 1.0));
+            // Probability that j items set all k bits of the queried item, by inclusion-exclusion
+            double all_set = 0.0;
+            double binomial = 1.0;
+            for (uint64_t i = 0; i <= k; i++)
+            {
+                all_set += ((i % 2) ? -binomial : binomial) * std::pow(no_bits[i], double(j));
+                binomial = binomial * double(k - i) / double(i + 1);
+            }
+            result += items_probability * std::clamp(all_set, 0.0, 1.0);
+        }
+        return std::min(result, 1.0);
+    }
+
+    uint64_t word_blocked_bloom_filter_bits(uint64_t n_items, double fpr, uint64_t word_bits, uint64_t& n_hash_functions)
+    {
+        n_items = std::max(n_items, uint64_t(1));
+        // Start from the textbook size and grow it by 2% until some number of hash functions reaches the rate
+        double bits = std::max(double(word_bits), -double(n_items) * std::log(fpr) / std::pow(std::log(2), 2));
+        while (true)
+        {
+            double best_fpr = 1.0;
+            for (uint64_t k = 1; k <= word_bits / 2; k++)
+            {
+                double k_fpr = word_blocked_bloom_filter_fpr(bits / double(word_bits), n_items, k, word_bits);
+                if (k_fpr < best_fpr)
+                {
+                    best_fpr = k_fpr;
+                    n_hash_functions = k;
+                }
+            }
+            if (best_fpr <= fpr)
+                return uint64_t(std::ceil(bits));
+            bits = bits * 1.02 + 1.0;
+        }
+    }
+
     uint64_t modular_multiplicative_inverse_coprimes(int64_t A, int64_t M)
     {
         int64_t AA = A;
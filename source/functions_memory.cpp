@@ -0,0 +1,104 @@
+#include "functions_memory.hpp"
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+
+namespace memoryfunctions
+{
+
+    int number_of_numa_nodes()
+    {
+#ifdef __linux__
+        // Format is a list of ranges, for example "0" or "0-3"
+        std::ifstream online_file("/sys/devices/system/node/online");
+        std::string online;
+        if (!(online_file >> online))
+            return 1;
+        int nodes = 0;
+        size_t position = 0;
+        while (position < online.size())
+        {
+            size_t end = online.find(',', position);
+            if (end == std::string::npos)
+                end = online.size();
+            std::string range = online.substr(position, end - position);
+            size_t dash = range.find('-');
+            if (dash == std::string::npos)
+                nodes += 1;
+            else
+                nodes += std::stoi(range.substr(dash + 1)) - std::stoi(range.substr(0, dash)) + 1;
+            position = end + 1;
+        }
+        return std::max(nodes, 1);
+#else
+        return 1;
+#endif
+    }
+
+
+    void* allocate_table_memory(uint64_t bytes, bool interleave)
+    {
+        // Large arrays are aligned to the huge page size so that the whole array can be backed by huge pages
+        uint64_t alignment = (bytes >= huge_page_bytes) ? huge_page_bytes : 0;
+        void* mapping = mmap(nullptr, bytes + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            std::cout << "Could not allocate " << bytes << " bytes for the hash table\n";
+            exit(1);
+        }
+        void* memory = mapping;
+        if (alignment > 0)
+        {
+            // Unmap the unaligned head and the tail that is left over after the array
+            uint64_t start = reinterpret_cast<uint64_t>(mapping);
+            uint64_t aligned_start = (start + alignment - 1) & ~(alignment - 1);
+            uint64_t page_bytes = sysconf(_SC_PAGESIZE);
+            uint64_t aligned_end = (aligned_start + bytes + page_bytes - 1) & ~(page_bytes - 1);
+            if (aligned_start > start)
+                munmap(mapping, aligned_start - start);
+            if (start + bytes + alignment > aligned_end)
+                munmap(reinterpret_cast<void*>(aligned_end), start + bytes + alignment - aligned_end);
+            memory = reinterpret_cast<void*>(aligned_start);
+        }
+#ifdef MADV_HUGEPAGE
+        // Only a hint, without transparent huge pages the array just uses normal pages
+        if (alignment > 0)
+            madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef __linux__
+        int nodes = number_of_numa_nodes();
+        if (interleave && nodes > 1 && nodes <= 64)
+        {
+            uint64_t node_mask = (nodes == 64) ? ~uint64_t(0) : ((uint64_t(1) << nodes) - 1);
+            // Without the policy the pages just follow the first touch
+            if (syscall(SYS_mbind, memory, bytes, MPOL_INTERLEAVE, &node_mask, 64, 0) != 0)
+                std::cout << "Could not interleave the hash table over " << nodes << " NUMA nodes\n";
+        }
+#endif
+        return memory;
+    }
+
+
+    void shrink_table_memory(void* memory, uint64_t bytes, uint64_t new_bytes)
+    {
+        uint64_t page_bytes = sysconf(_SC_PAGESIZE);
+        uint64_t start = reinterpret_cast<uint64_t>(memory);
+        uint64_t unused_start = (start + new_bytes + page_bytes - 1) & ~(page_bytes - 1);
+        if (unused_start < start + bytes)
+            munmap(reinterpret_cast<void*>(unused_start), start + bytes - unused_start);
+    }
+
+
+    void free_table_memory(void* memory, uint64_t bytes)
+    {
+        munmap(memory, bytes);
+    }
+
+}
@@ -1,4 +1,8 @@
 #include "functions_strings.hpp"
+#include <cstring>
+#if defined(__BMI2__) && defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 namespace purestringfunctions
 {
@@ -44,6 +48,38 @@ namespace purestringfunctions
         }
         return 0;
     }
+
+    char* write_uint(uint64_t value, char* out)
+    {
+        static const char digit_pairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        // Digits are formed from the right, two at a time
+        char digits[20];
+        int position = 20;
+        while (value >= 100)
+        {
+            uint64_t pair = (value % 100) * 2;
+            value /= 100;
+            position -= 2;
+            digits[position] = digit_pairs[pair];
+            digits[position + 1] = digit_pairs[pair + 1];
+        }
+        if (value >= 10)
+        {
+            position -= 2;
+            digits[position] = digit_pairs[value * 2];
+            digits[position + 1] = digit_pairs[value * 2 + 1];
+        }
+        else
+        {
+            position -= 1;
+            digits[position] = char('0' + value);
+        }
+        std::memcpy(out, digits + position, 20 - position);
+        return out + (20 - position);
+    }
 }
 
 
@@ -119,6 +155,35 @@ namespace twobitstringfunctions
         return your_string;
     }
     
+    void blocks2chars(const uint64_t* d, int b, int l, char* out)
+    {
+        for (int block = 0; block < b; block++)
+        {
+            int chars_in_block = (block == 0) ? l - 32*(b-1) : 32;
+            // Move the first character of the block to the highest bits
+            uint64_t word = (chars_in_block == 32) ? d[block] : d[block] << (64 - 2*chars_in_block);
+            int i = 0;
+#if defined(__BMI2__) && defined(__SSSE3__)
+            // 16 characters at a time: spread the 2-bit codes to bytes and look the letters up with a shuffle
+            const __m128i letters = _mm_setr_epi8('A', 'C', 'G', 'T', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            for (; i + 16 <= chars_in_block; i += 16)
+            {
+                uint64_t first = __builtin_bswap64(_pdep_u64(word >> 48, 0x0303030303030303ULL));
+                uint64_t second = __builtin_bswap64(_pdep_u64((word >> 32) & 0xFFFF, 0x0303030303030303ULL));
+                __m128i codes = _mm_set_epi64x(static_cast<long long>(second), static_cast<long long>(first));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(letters, codes));
+                out += 16;
+                word <<= 32;
+            }
+#endif
+            for (; i < chars_in_block; i++)
+            {
+                *out++ = "ACGT"[word >> 62];
+                word <<= 2;
+            }
+        }
+    }
+
     bool is_clean_string(std::string s)
     {
         for (uint64_t i = 0; i < s.length(); i++)
@@ -23,6 +23,7 @@ RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m)
     h = 1;
     for (uint64_t i = 0; i < m-1; i++)
         h = (h*d)%q;
+    compute_powers();
 }
 
 RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m, uint64_t modular_multiplicative_inverse, uint64_t multiplier)
@@ -47,6 +48,7 @@ RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m, uint64_t modular_mu
     h = 1;
     for (uint64_t i = 0; i < m-1; i++)
         h = (h*d)%q;
+    compute_powers();
 }
 
 RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m, uint64_t modular_multiplicative_inverse, uint64_t multiplier, uint64_t return_q)
@@ -71,6 +73,7 @@ RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m, uint64_t modular_mu
     h = 1;
     for (uint64_t i = 0; i < m-1; i++)
         h = (h*d)%q;
+    compute_powers();
 
 }
 
@@ -96,26 +99,31 @@ RollingHasherDual::RollingHasherDual(uint64_t q, uint64_t m, uint64_t modular_mu
     h = 1;
     for (uint64_t i = 0; i < m-1; i++)
         h = (h*d)%q;
+    compute_powers();
 
 }
 
+void RollingHasherDual::compute_powers()
+{
+    powers.resize(m+1);
+    powers[0] = 1 % q;
+    for (uint64_t i = 1; i <= m; i++)
+        powers[i] = uint64_t((__uint128_t(powers[i-1])*d) % q);
+}
+
 void RollingHasherDual::update_rolling_hash_in(uint64_t in)
 {
     // If mod is power of 2, use this
     if (tbm){
         current_hash_forward = (d*current_hash_forward + in) & (q-1);
         // Alternative reverse update version
-        uint64_t reverse_add = twobitstringfunctions::reverse_int(in);
-        for (uint64_t i = 0; i < hashed_count; i++)
-            reverse_add = (reverse_add*d) & (q-1);
+        uint64_t reverse_add = uint64_t((__uint128_t(twobitstringfunctions::reverse_int(in))*powers[hashed_count]) & (q-1));
         current_hash_backward = (current_hash_backward + reverse_add) & (q-1);
 
     } else {
         current_hash_forward = (d*current_hash_forward + in) % q;
         // Alternative reverse update version
-        uint64_t reverse_add = twobitstringfunctions::reverse_int(in);
-        for (uint64_t i = 0; i < hashed_count; i++)
-            reverse_add = (reverse_add*d) % q;
+        uint64_t reverse_add = uint64_t((__uint128_t(twobitstringfunctions::reverse_int(in))*powers[hashed_count]) % q);
         current_hash_backward = (current_hash_backward + reverse_add) % q;
         // Original reverse update version
         //current_hash_backward = (di*current_hash_backward + twobitstringfunctions::reverse_int(in)*h) % q;
@@ -315,4 +323,69 @@ uint64_t ProbeHasher1::probe_4(uint64_t iteration, uint64_t position, uint64_t m
     }
     return new_position;
     */
-}
\ No newline at end of file
+}
+
+//##########################################################################################################
+//##########################################################################################################
+
+
+CanonicalMinimizerHasher::CanonicalMinimizerHasher(uint64_t k, uint64_t m, uint64_t seed)
+{
+    this->k = k;
+    this->m = m;
+    this->seed = seed;
+    w = k - m + 1;
+    mmer_mask = (m == 32) ? ~uint64_t(0) : ((uint64_t(1) << (2*m)) - 1);
+    mmer_hashes = std::vector<uint64_t>(w, 0);
+    reset();
+}
+
+// Murmur3 finalizer. It maps 0 to 0, so m-mers are xored with seed first to keep poly-A off the smallest hash
+uint64_t CanonicalMinimizerHasher::mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+void CanonicalMinimizerHasher::reset()
+{
+    forward_mmer = 0;
+    backward_mmer = 0;
+    pushed_count = 0;
+    minimizer_hash = ~uint64_t(0);
+    minimizer_index = 0;
+}
+
+void CanonicalMinimizerHasher::push(uint64_t c)
+{
+    forward_mmer = ((forward_mmer << 2) | c) & mmer_mask;
+    backward_mmer = (backward_mmer >> 2) | (twobitstringfunctions::reverse_int(c) << (2*(m-1)));
+    pushed_count += 1;
+    if (pushed_count < m)
+        return;
+    uint64_t mmer_index = pushed_count - m;
+    uint64_t mmer_hash = mix(std::min(forward_mmer, backward_mmer) ^ seed);
+    mmer_hashes[mmer_index % w] = mmer_hash;
+    // Minimizer left the window, find the smallest hash again
+    if ((mmer_index >= w) && (minimizer_index <= mmer_index - w))
+    {
+        minimizer_hash = ~uint64_t(0);
+        for (uint64_t i = mmer_index - w + 1; i <= mmer_index; i++)
+        {
+            if (mmer_hashes[i % w] <= minimizer_hash)
+            {
+                minimizer_hash = mmer_hashes[i % w];
+                minimizer_index = i;
+            }
+        }
+    }
+    else if (mmer_hash <= minimizer_hash)
+    {
+        minimizer_hash = mmer_hash;
+        minimizer_index = mmer_index;
+    }
+}
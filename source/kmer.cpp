@@ -607,7 +607,8 @@ void OneCharacterAndPointerKMerAtomicFlag::unset_is_flagged_2(bool atomic)
 //============
 // Constructor
 //============
-OneCharacterAndPointerKMerAtomicVariable::OneCharacterAndPointerKMerAtomicVariable()
+template<class slot_layout>
+OneCharacterAndPointerKMerAtomicVariable<slot_layout>::OneCharacterAndPointerKMerAtomicVariable()
 {
     data.store(0ULL, std::memory_order_release);
 }
@@ -615,104 +616,50 @@ OneCharacterAndPointerKMerAtomicVariable::OneCharacterAndPointerKMerAtomicVariab
 //===========
 // Destructor
 //===========
-OneCharacterAndPointerKMerAtomicVariable::~OneCharacterAndPointerKMerAtomicVariable(){}
-
-
-//==========================================
-// Functions to fetch specific parts of data
-//==========================================
-
-uint64_t OneCharacterAndPointerKMerAtomicVariable::get_data()
-{
-    return data.load(std::memory_order_acquire);
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariable::get_predecessor_slot()
-{
-    return data.load(std::memory_order_acquire) >> (64-38);
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariable::get_count()
-{
-    return ((data.load(std::memory_order_acquire) >> 12) & uint64_t(16383));
-}
+template<class slot_layout>
+OneCharacterAndPointerKMerAtomicVariable<slot_layout>::~OneCharacterAndPointerKMerAtomicVariable(){}
 
-uint64_t OneCharacterAndPointerKMerAtomicVariable::get_left_character()
-{
-    return ((data.load(std::memory_order_acquire) >> 10) & uint64_t(3));
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariable::get_right_character()
-{
-    return ((data.load(std::memory_order_acquire) >> 8) & uint64_t(3));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::is_occupied()
-{
-    return (data.load(std::memory_order_acquire) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::predecessor_exists()
-{
-    return ((data.load(std::memory_order_acquire) >> 1) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::left_char_is_null()
-{
-    return ((data.load(std::memory_order_acquire) >> 2) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::right_char_is_null()
-{
-    return ((data.load(std::memory_order_acquire) >> 3) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::canonical_during_insertion_self()
-{
-    return ((data.load(std::memory_order_acquire) >> 4) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::canonical_during_insertion_predecessor()
-{
-    return ((data.load(std::memory_order_acquire) >> 5) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::is_flagged_1()
-{
-    return ((data.load(std::memory_order_acquire) >> 6) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::is_flagged_2()
-{
-    return ((data.load(std::memory_order_acquire) >> 7) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariable::is_complete()
-{
-    return (left_char_is_null() && right_char_is_null());
-}
 
 //========================================
 // Function to increase counter atomically
 //========================================
 
-void OneCharacterAndPointerKMerAtomicVariable::increase_count()
+template<class slot_layout>
+void OneCharacterAndPointerKMerAtomicVariable<slot_layout>::increase_count()
 {
     // Get current data
     uint64_t current_data = data.load(std::memory_order_acquire);
-    if (((current_data >> 12) & uint64_t(16383)) == uint64_t(16383))
+    if (((current_data >> slot_layout::count_shift) & slot_layout::max_count) == slot_layout::max_count)
         return;
     // Try to increase count
-    //while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_release, std::memory_order_relaxed))
-    while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_acq_rel, std::memory_order_relaxed))
-    //while(!data.compare_exchange_weak(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_release, std::memory_order_relaxed))
+    //while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one<slot_layout>(current_data), std::memory_order_release, std::memory_order_relaxed))
+    while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one<slot_layout>(current_data), std::memory_order_acq_rel, std::memory_order_relaxed))
+    //while(!data.compare_exchange_weak(current_data, kmod::modify_to_increase_count_by_one<slot_layout>(current_data), std::memory_order_release, std::memory_order_relaxed))
+    {
+        // If it was already at max, do nothing
+        if (((current_data >> slot_layout::count_shift) & slot_layout::max_count) == slot_layout::max_count)
+            break;
+    }
+}
+
+template<class slot_layout>
+void OneCharacterAndPointerKMerAtomicVariable<slot_layout>::increase_count_by(uint64_t increase)
+{
+    uint64_t current_data = data.load(std::memory_order_acquire);
+    if (((current_data >> slot_layout::count_shift) & slot_layout::max_count) == slot_layout::max_count)
+        return;
+    while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by<slot_layout>(current_data, increase), std::memory_order_acq_rel, std::memory_order_relaxed))
     {
         // If it was already at max, do nothing
-        if (((current_data >> 12) & uint64_t(16383)) == uint64_t(16383))
+        if (((current_data >> slot_layout::count_shift) & slot_layout::max_count) == slot_layout::max_count)
             break;
     }
 }
 
+// Supported slot layouts
+template class OneCharacterAndPointerKMerAtomicVariable<SlotLayoutP38C14>;
+template class OneCharacterAndPointerKMerAtomicVariable<SlotLayoutP32C20>;
+
 /*
 
 // THIS IS FOR FLAGLESS K-MER WITH ATOMIC DATA VARIABLE, SEPARATE COUNT INTEGER
@@ -734,97 +681,34 @@ OneCharacterAndPointerKMerAtomicVariableBIG::OneCharacterAndPointerKMerAtomicVar
 OneCharacterAndPointerKMerAtomicVariableBIG::~OneCharacterAndPointerKMerAtomicVariableBIG(){}
 
 
-//==========================================
-// Functions to fetch specific parts of data
-//==========================================
-
-uint64_t OneCharacterAndPointerKMerAtomicVariableBIG::get_data()
-{
-    return data.load(std::memory_order_acquire);
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariableBIG::get_predecessor_slot()
-{
-    return data.load(std::memory_order_acquire) >> (64-38);
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariableBIG::get_count()
-{
-    return ((data.load(std::memory_order_acquire) >> 12) & uint64_t(16383));
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariableBIG::get_left_character()
-{
-    return ((data.load(std::memory_order_acquire) >> 10) & uint64_t(3));
-}
-
-uint64_t OneCharacterAndPointerKMerAtomicVariableBIG::get_right_character()
-{
-    return ((data.load(std::memory_order_acquire) >> 8) & uint64_t(3));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::is_occupied()
-{
-    return (data.load(std::memory_order_acquire) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::predecessor_exists()
-{
-    return ((data.load(std::memory_order_acquire) >> 1) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::left_char_is_null()
-{
-    return ((data.load(std::memory_order_acquire) >> 2) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::right_char_is_null()
-{
-    return ((data.load(std::memory_order_acquire) >> 3) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::canonical_during_insertion_self()
-{
-    return ((data.load(std::memory_order_acquire) >> 4) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::canonical_during_insertion_predecessor()
-{
-    return ((data.load(std::memory_order_acquire) >> 5) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::is_flagged_1()
-{
-    return ((data.load(std::memory_order_acquire) >> 6) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::is_flagged_2()
-{
-    return ((data.load(std::memory_order_acquire) >> 7) & uint64_t(1));
-}
-
-bool OneCharacterAndPointerKMerAtomicVariableBIG::is_complete()
-{
-    return (left_char_is_null() && right_char_is_null());
-}
-
 //========================================
 // Function to increase counter atomically
 //========================================
 
 void OneCharacterAndPointerKMerAtomicVariableBIG::increase_count()
 {
-    // Get current data
-    uint64_t current_data = data.load(std::memory_order_acquire);
-    if (((current_data >> 12) & uint64_t(16383)) == uint64_t(16383))
+    // Get current count
+    uint16_t current_count = count.load(std::memory_order_acquire);
+    if (current_count == std::numeric_limits<uint16_t>::max())
         return;
     // Try to increase count
-    //while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_release, std::memory_order_relaxed))
-    while(!data.compare_exchange_strong(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_acq_rel, std::memory_order_relaxed))
-    //while(!data.compare_exchange_weak(current_data, kmod::modify_to_increase_count_by_one(current_data), std::memory_order_release, std::memory_order_relaxed))
+    while(!count.compare_exchange_weak(current_count, current_count + 1, std::memory_order_acq_rel, std::memory_order_relaxed))
+    {
+        // If it was already at max, do nothing
+        if (current_count == std::numeric_limits<uint16_t>::max())
+            break;
+    }
+}
+
+void OneCharacterAndPointerKMerAtomicVariableBIG::increase_count_by(uint64_t increase)
+{
+    uint16_t current_count = count.load(std::memory_order_acquire);
+    if (current_count == std::numeric_limits<uint16_t>::max())
+        return;
+    while(!count.compare_exchange_weak(current_count, uint16_t(std::min(uint64_t(current_count) + increase, uint64_t(std::numeric_limits<uint16_t>::max()))), std::memory_order_acq_rel, std::memory_order_relaxed))
     {
         // If it was already at max, do nothing
-        if (((current_data >> 12) & uint64_t(16383)) == uint64_t(16383))
+        if (current_count == std::numeric_limits<uint16_t>::max())
             break;
     }
 }
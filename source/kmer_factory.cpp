@@ -29,6 +29,9 @@ KMerFactoryCanonical2BC::KMerFactoryCanonical2BC(int k) {
     left_char_mask = right_char_mask << (64 - character_bits);
     // Calculate number of useb bits in last block
     bits_in_last_block = (character_bits*k) % 64;
+    // If k is a multiple of 32, the leftmost block is full
+    if (bits_in_last_block == 0)
+        bits_in_last_block = 64;
     // Calculate needed blocks
     number_of_blocks = std::ceil((character_bits*k)/64.0);
     // Mask for the newest character in the rightmost block 
@@ -1,5 +1,14 @@
 #include "kmer_hash_table.hpp"
 #include "functions_kmer_mod.hpp"
+#include "functions_memory.hpp"
+#include "functions_kmer_database.hpp"
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 // === For CANONICAL pointer hash table =========================================================================================
 
@@ -1973,54 +1982,168 @@ void PointerHashTableCanonicalAF::write_kmers_on_disk_separately_faster(uint64_t
 
 // ==============================================================================================================
 
-BasicAtomicHashTable::BasicAtomicHashTable(uint64_t s, uint64_t k)
+BasicAtomicHashTable::BasicAtomicHashTable(uint64_t s, uint64_t k, double l)
 {
     size = s;
     kmer_len = k;
-    kmer_array = new BasicAtomicKMer[s];
+    occupied_slots = 0;
+    max_occupied_slots = std::min(s, uint64_t(std::ceil(s*l)));
+    // Zero-filled pages are empty slots
+    kmer_array = static_cast<BasicAtomicKMer*>(memoryfunctions::allocate_table_memory(s*sizeof(BasicAtomicKMer), false));
 }
 
 BasicAtomicHashTable::~BasicAtomicHashTable()
 {
-    delete[] kmer_array;
+    memoryfunctions::free_table_memory(kmer_array, size*sizeof(BasicAtomicKMer));
+}
+
+bool BasicAtomicHashTable::insert_or_increase(uint64_t kmer, uint64_t hash, uint64_t n)
+{
+    uint64_t stored_kmer = ~kmer;
+    QuadraticProbeSequence probe_sequence(hash, size);
+    do
+    {
+        uint64_t slot = probe_sequence.get_slot();
+        uint64_t slot_kmer = kmer_array[slot].kmer.load(std::memory_order_acquire);
+        // Claim an empty slot, if another thread got it first check what it inserted
+        if (slot_kmer == 0)
+        {
+            if (kmer_array[slot].kmer.compare_exchange_strong(slot_kmer, stored_kmer, std::memory_order_acq_rel))
+            {
+                if (occupied_slots.fetch_add(1, std::memory_order_relaxed) >= max_occupied_slots)
+                    return false;
+                slot_kmer = stored_kmer;
+            }
+        }
+        if (slot_kmer == stored_kmer)
+        {
+            kmer_array[slot].count.fetch_add(n, std::memory_order_relaxed);
+            return true;
+        }
+    } while (probe_sequence.next());
+    return false;
+}
+
+void BasicAtomicHashTable::write_kmers(uint64_t min_abundance, std::string& output_path, bool binary)
+{
+    std::ofstream output_file(output_path, std::ios::binary);
+    std::string kmer_string(kmer_len, 'A');
+    char record[kmerdatabasefunctions::header_bytes] = {};
+    uint64_t records = 0;
+    // The header gets its record count when all k-mers are written
+    if (binary)
+        output_file.write(record, kmerdatabasefunctions::header_bytes);
+
+    for(uint64_t i = 0; i < size; i++)
+    {
+        uint64_t slot_kmer = kmer_array[i].kmer.load(std::memory_order_acquire);
+        uint64_t count = kmer_array[i].count.load(std::memory_order_acquire);
+        // Write k-mer in the output file only if its count is at least min_abundance
+        if (slot_kmer != 0 && count >= min_abundance)
+        {
+            uint64_t kmer = ~slot_kmer;
+            if (binary)
+            {
+                output_file.write(record, kmerdatabasefunctions::write_record(&kmer, 1, count, record) - record);
+                records++;
+                continue;
+            }
+            for (uint64_t j = 0; j < kmer_len; j++)
+                kmer_string[j] = twobitstringfunctions::int2char_small((kmer >> 2*(kmer_len-1-j)) & uint64_t(3));
+            output_file << kmer_string << " " << count << "\n";
+        }
+    }
+
+    if (binary)
+    {
+        kmerdatabasefunctions::fill_header(record, kmer_len, records);
+        output_file.seekp(0);
+        output_file.write(record, kmerdatabasefunctions::header_bytes);
+    }
+    output_file.close();
+	output_file.clear();
 }
 
 // ==============================================================================================================
 
 // ATOMIC FLAG VERSION
 
-BasicAtomicFlagHashTableLong::BasicAtomicFlagHashTableLong(uint64_t s, uint32_t k)
+BasicAtomicFlagHashTableLong::BasicAtomicFlagHashTableLong(uint64_t s, uint32_t k, double l)
 {
     size = s;
     kmer_len = k;
+    occupied_slots = 0;
+    max_occupied_slots = std::min(s, uint64_t(std::ceil(s*l)));
     kmer_bytes = k / 4;
     if (k % 4 != 0)
         kmer_bytes+=1;
-    kmer_locks = new std::atomic_flag[s];
-    kmer_array = new uint8_t[s*kmer_bytes];
-    counts = new uint16_t[s];
-    for (uint64_t i = 0; i < s; i++)
-        kmer_locks[i].clear();
+    // Zero-filled pages are empty slots with clear locks
+    kmer_locks = static_cast<std::atomic_flag*>(memoryfunctions::allocate_table_memory(s*sizeof(std::atomic_flag), false));
+    kmer_array = static_cast<uint8_t*>(memoryfunctions::allocate_table_memory(s*kmer_bytes, false));
+    counts = static_cast<uint16_t*>(memoryfunctions::allocate_table_memory(s*sizeof(uint16_t), false));
 }
 
 BasicAtomicFlagHashTableLong::~BasicAtomicFlagHashTableLong()
 {
-    delete[] kmer_locks;
-    delete[] kmer_array;
-    delete[] counts;
+    memoryfunctions::free_table_memory(kmer_locks, size*sizeof(std::atomic_flag));
+    memoryfunctions::free_table_memory(kmer_array, size*kmer_bytes);
+    memoryfunctions::free_table_memory(counts, size*sizeof(uint16_t));
 }
 
-void BasicAtomicFlagHashTableLong::write_kmers(uint64_t min_abundance, std::string& output_path)
+bool BasicAtomicFlagHashTableLong::insert_or_increase(const uint8_t* kmer, uint64_t hash)
+{
+    QuadraticProbeSequence probe_sequence(hash, size);
+    do
+    {
+        uint64_t slot = probe_sequence.get_slot();
+        // First, acquire the lock
+        while (kmer_locks[slot].test_and_set(std::memory_order_acquire));
+        // If count == 0, no k-mer -> insert as new
+        if (counts[slot] == 0)
+        {
+            counts[slot] = 1;
+            std::memcpy(&kmer_array[kmer_bytes*slot], kmer, kmer_bytes);
+            kmer_locks[slot].clear(std::memory_order_release);
+            return occupied_slots.fetch_add(1, std::memory_order_relaxed) < max_occupied_slots;
+        }
+        // If the k-mer in the slot matches, increase its count (saturates so that the slot never looks empty)
+        if (std::memcmp(&kmer_array[kmer_bytes*slot], kmer, kmer_bytes) == 0)
+        {
+            if (counts[slot] < UINT16_MAX)
+                counts[slot] += 1;
+            kmer_locks[slot].clear(std::memory_order_release);
+            return true;
+        }
+        kmer_locks[slot].clear(std::memory_order_release);
+    } while (probe_sequence.next());
+    return false;
+}
+
+void BasicAtomicFlagHashTableLong::write_kmers(uint64_t min_abundance, std::string& output_path, bool binary)
 {
     //std::cout << "kmer bytes = " << kmer_bytes << "\n";
     //std::cout << "hash table size is = " << size << "\n";
-    std::ofstream output_file(output_path);
+    std::ofstream output_file(output_path, std::ios::binary);
+    uint32_t kmer_words = kmerdatabasefunctions::words_per_kmer(kmer_len);
+    std::vector<uint64_t> kmer(kmer_words);
+    std::vector<char> record(std::max(kmerdatabasefunctions::header_bytes, kmerdatabasefunctions::record_bytes(kmer_len)));
+    uint64_t records = 0;
+    // The header gets its record count when all k-mers are written
+    if (binary)
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
 
     for(uint64_t i = 0; i < size; i++)
     {   
         // Write k-mer in the output file only if its count is at least min_abundance
         if (counts[i] >= min_abundance)
         {
+            if (binary)
+            {
+                kmerdatabasefunctions::bytes2words(&kmer_array[kmer_bytes*i], kmer_bytes, kmer_words, kmer.data());
+                output_file.write(record.data(), kmerdatabasefunctions::write_record(kmer.data(), kmer_words, counts[i], record.data()) - record.data());
+                records++;
+                continue;
+            }
             //std::cout << "Map position " << i << "\n";
             uint64_t current_byte_pos = kmer_bytes*i;
             int unwritten_byte_chars = kmer_len % 4;
@@ -2044,6 +2167,12 @@ void BasicAtomicFlagHashTableLong::write_kmers(uint64_t min_abundance, std::stri
         }
     }
 
+    if (binary)
+    {
+        kmerdatabasefunctions::fill_header(record.data(), kmer_len, records);
+        output_file.seekp(0);
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
+    }
     output_file.close();
 	output_file.clear();
     
@@ -2060,25 +2189,40 @@ BasicAtomicVariableHashTableLong::BasicAtomicVariableHashTableLong(uint64_t s, u
     kmer_bytes = k / 4;
     if (k % 4 != 0)
         kmer_bytes+=1;
-    kmer_array = new uint8_t[s*kmer_bytes];
-    counts = new std::atomic<uint32_t>[s];
+    // Zero-filled pages are empty slots
+    kmer_array = static_cast<uint8_t*>(memoryfunctions::allocate_table_memory(s*kmer_bytes, false));
+    counts = static_cast<std::atomic<uint32_t>*>(memoryfunctions::allocate_table_memory(s*sizeof(std::atomic<uint32_t>), false));
 }
 
 BasicAtomicVariableHashTableLong::~BasicAtomicVariableHashTableLong()
 {
-    delete[] kmer_array;
-    delete[] counts;
+    memoryfunctions::free_table_memory(kmer_array, size*kmer_bytes);
+    memoryfunctions::free_table_memory(counts, size*sizeof(std::atomic<uint32_t>));
 }
 
-void BasicAtomicVariableHashTableLong::write_kmers(uint64_t min_abundance, std::string& output_path)
+void BasicAtomicVariableHashTableLong::write_kmers(uint64_t min_abundance, std::string& output_path, bool binary)
 {
-    std::ofstream output_file(output_path);
+    std::ofstream output_file(output_path, std::ios::binary);
+    uint32_t kmer_words = kmerdatabasefunctions::words_per_kmer(kmer_len);
+    std::vector<uint64_t> kmer(kmer_words);
+    std::vector<char> record(std::max(kmerdatabasefunctions::header_bytes, kmerdatabasefunctions::record_bytes(kmer_len)));
+    uint64_t records = 0;
+    // The header gets its record count when all k-mers are written
+    if (binary)
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
 
     for(uint64_t i = 0; i < size; i++)
     {   
         // Write k-mer in the output file only if its count is at least min_abundance
         if ((counts[i].load(std::memory_order_acquire)>>1) >= min_abundance)
         {
+            if (binary)
+            {
+                kmerdatabasefunctions::bytes2words(&kmer_array[kmer_bytes*i], kmer_bytes, kmer_words, kmer.data());
+                output_file.write(record.data(), kmerdatabasefunctions::write_record(kmer.data(), kmer_words, counts[i].load(std::memory_order_acquire)>>1, record.data()) - record.data());
+                records++;
+                continue;
+            }
             //std::cout << "Map position " << i << "\n";
             uint64_t current_byte_pos = kmer_bytes*i;
             int unwritten_byte_chars = kmer_len % 4;
@@ -2101,11 +2245,149 @@ void BasicAtomicVariableHashTableLong::write_kmers(uint64_t min_abundance, std::
         }
     }
 
+    if (binary)
+    {
+        kmerdatabasefunctions::fill_header(record.data(), kmer_len, records);
+        output_file.seekp(0);
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
+    }
     output_file.close();
 	output_file.clear();
     
 }
 
+// ==============================================================================================================
+
+// ATOMIC VARIABLE VERSION WITH 64-BIT BLOCKS
+
+BasicAtomicVariableHashTableLong64::BasicAtomicVariableHashTableLong64(uint64_t s, uint32_t k, double l)
+{
+    size = s;
+    kmer_len = k;
+    occupied_slots = 0;
+    max_occupied_slots = std::min(s, uint64_t(std::ceil(s*l)));
+    kmer_blocks = k / 32;
+    if (k % 32 != 0)
+        kmer_blocks+=1;
+    // Zero-filled pages are empty slots
+    kmer_array = static_cast<uint64_t*>(memoryfunctions::allocate_table_memory(s*kmer_blocks*sizeof(uint64_t), false));
+    counts = static_cast<std::atomic<uint32_t>*>(memoryfunctions::allocate_table_memory(s*sizeof(std::atomic<uint32_t>), false));
+}
+
+BasicAtomicVariableHashTableLong64::~BasicAtomicVariableHashTableLong64()
+{
+    memoryfunctions::free_table_memory(kmer_array, size*kmer_blocks*sizeof(uint64_t));
+    memoryfunctions::free_table_memory(counts, size*sizeof(std::atomic<uint32_t>));
+}
+
+bool BasicAtomicVariableHashTableLong64::kmer_in_slot_matches(uint64_t slot, const uint64_t* kmer) const
+{
+    const uint64_t* slot_kmer = &kmer_array[slot*kmer_blocks];
+    uint32_t b = 0;
+#ifdef __AVX2__
+    for (; b + 4 <= kmer_blocks; b += 4)
+    {
+        __m256i difference = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(slot_kmer + b)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kmer + b)));
+        if (!_mm256_testz_si256(difference, difference))
+            return false;
+    }
+#endif
+#ifdef __SSE4_1__
+    for (; b + 2 <= kmer_blocks; b += 2)
+    {
+        __m128i difference = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(slot_kmer + b)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(kmer + b)));
+        if (!_mm_testz_si128(difference, difference))
+            return false;
+    }
+#endif
+    for (; b < kmer_blocks; b++)
+    {
+        if (slot_kmer[b] != kmer[b])
+            return false;
+    }
+    return true;
+}
+
+bool BasicAtomicVariableHashTableLong64::insert_or_increase(const uint64_t* kmer, uint64_t hash, uint64_t n)
+{
+    // Count words are count << 1 and stop at max_count_word
+    uint32_t added_count_word = uint32_t(std::min(n, uint64_t(max_count_word >> 1)) << 1);
+    QuadraticProbeSequence probe_sequence(hash, size);
+    do
+    {
+        uint64_t slot = probe_sequence.get_slot();
+        uint32_t count_word = counts[slot].load(std::memory_order_acquire);
+        // Reserve an empty slot, write the k-mer and publish it with count 1
+        if (count_word == 0)
+        {
+            if (counts[slot].compare_exchange_strong(count_word, 1, std::memory_order_acquire))
+            {
+                std::memcpy(&kmer_array[slot*kmer_blocks], kmer, kmer_blocks*sizeof(uint64_t));
+                counts[slot].store(added_count_word, std::memory_order_release);
+                return occupied_slots.fetch_add(1, std::memory_order_relaxed) < max_occupied_slots;
+            }
+        }
+        // Another thread is still writing the k-mer of this slot
+        while (count_word & 1)
+            count_word = counts[slot].load(std::memory_order_acquire);
+        if (kmer_in_slot_matches(slot, kmer))
+        {
+            if (count_word <= max_count_word - added_count_word)
+                counts[slot].fetch_add(added_count_word, std::memory_order_relaxed);
+            else
+                counts[slot].store(max_count_word, std::memory_order_relaxed);
+            return true;
+        }
+    } while (probe_sequence.next());
+    return false;
+}
+
+void BasicAtomicVariableHashTableLong64::write_kmers(uint64_t min_abundance, std::string& output_path, bool binary)
+{
+    std::ofstream output_file(output_path, std::ios::binary);
+    std::string kmer_string(kmer_len, 'A');
+    // Characters in the leftmost block
+    uint32_t first_block_chars = kmer_len - 32*(kmer_blocks-1);
+    std::vector<char> record(std::max(kmerdatabasefunctions::header_bytes, kmerdatabasefunctions::record_bytes(kmer_len)));
+    uint64_t records = 0;
+    // The header gets its record count when all k-mers are written
+    if (binary)
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
+
+    for(uint64_t i = 0; i < size; i++)
+    {
+        uint64_t count = counts[i].load(std::memory_order_acquire) >> 1;
+        // Write k-mer in the output file only if its count is at least min_abundance
+        if (count > 0 && count >= min_abundance)
+        {
+            const uint64_t* kmer = &kmer_array[i*kmer_blocks];
+            if (binary)
+            {
+                output_file.write(record.data(), kmerdatabasefunctions::write_record(kmer, kmer_blocks, count, record.data()) - record.data());
+                records++;
+                continue;
+            }
+            for (uint32_t j = 0; j < first_block_chars; j++)
+                kmer_string[j] = twobitstringfunctions::int2char_small((kmer[0] >> 2*(first_block_chars-1-j)) & uint64_t(3));
+            for (uint32_t j = first_block_chars; j < kmer_len; j++)
+            {
+                uint32_t position = j - first_block_chars;
+                kmer_string[j] = twobitstringfunctions::int2char_small((kmer[1 + position/32] >> 2*(31-position%32)) & uint64_t(3));
+            }
+            output_file << kmer_string << " " << count << "\n";
+        }
+    }
+
+    if (binary)
+    {
+        kmerdatabasefunctions::fill_header(record.data(), kmer_len, records);
+        output_file.seekp(0);
+        output_file.write(record.data(), kmerdatabasefunctions::header_bytes);
+    }
+    output_file.close();
+	output_file.clear();
+}
+
 // ==============================================================================================================
 // ==============================================================================================================
 //
@@ -2125,86 +2407,144 @@ void BasicAtomicVariableHashTableLong::write_kmers(uint64_t min_abundance, std::
 // ==============================================================================================================
 
 
-PointerHashTableCanonicalAV::PointerHashTableCanonicalAV(uint64_t s, uint64_t k, uint64_t b)
+template<class slot_layout>
+PointerHashTableCanonicalAV<slot_layout>::PointerHashTableCanonicalAV(uint64_t s, uint64_t k, uint64_t b, bool interleave)
 {
+    // Slot pointers must be able to address every slot
+    if (s > slot_layout::max_slots)
+    {
+        std::cout << "Hash table size " << s << " does not fit in " << slot_layout::pointer_bits << " pointer bits\n";
+        exit(1);
+    }
     size = s;
     kmer_len = k;
-    hash_table_array = new OneCharacterAndPointerKMerAtomicVariable[size];
+    // An all-zero slot is an empty slot, so the zero-filled pages from mmap need no constructors and are only backed
+    // when first touched. With interleave the pages are spread over all NUMA nodes.
+    hash_table_array = static_cast<OneCharacterAndPointerKMerAtomicVariable<slot_layout>*>(
+        memoryfunctions::allocate_table_memory(size * sizeof(OneCharacterAndPointerKMerAtomicVariable<slot_layout>), interleave));
     bits_per_char = 2;
-    inserted_items = 0;
+    inserted_items.reset();
     kmer_blocks = b;
     probe_hasher = new ProbeHasher1();
     //probing_prime = mathfunctions::next_prime(uint64_t(std::floor(size/13.0)));
     // Secondary array stuff
     max_secondary_slots = 100;
     touched_secondary_slots = 0;
-    secondary_slots_in_use = 0;
+    secondary_slots_in_use.reset();
     max_secondary_slot_in_use = 0;
     smallest_unused_secondary_slot = 0;
+    secondary_search_start = 0;
     secondary_array = std::vector<uint64_t>(b*max_secondary_slots, uint64_t(0));
     secondary_free_slots = std::vector<uint8_t>(max_secondary_slots, 1);
     secondary_lock.clear();
     
     max_kmer_reconstruction_chain = 0;
-    total_reconstruction_chain = 0;
+    total_reconstruction_chain.reset();
 }
 
-PointerHashTableCanonicalAV::~PointerHashTableCanonicalAV()
+template<class slot_layout>
+PointerHashTableCanonicalAV<slot_layout>::~PointerHashTableCanonicalAV()
 {
-    delete[] hash_table_array;
+    memoryfunctions::free_table_memory(hash_table_array, size * sizeof(OneCharacterAndPointerKMerAtomicVariable<slot_layout>));
     delete probe_hasher;
 
 }
 
-uint64_t PointerHashTableCanonicalAV::get_kmer_count_in_slot(uint64_t slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_kmer_count_in_slot(uint64_t slot)
 {
     return hash_table_array[slot].get_count(); 
 }
 
-bool PointerHashTableCanonicalAV::kmer_in_slot_is_complete(uint64_t slot)
+template<class slot_layout>
+bool PointerHashTableCanonicalAV<slot_layout>::kmer_in_slot_is_complete(uint64_t slot)
 {
     return hash_table_array[slot].is_complete(); 
 }
 
-bool PointerHashTableCanonicalAV::slot_is_occupied(uint64_t slot)
+template<class slot_layout>
+bool PointerHashTableCanonicalAV<slot_layout>::slot_is_occupied(uint64_t slot)
 {
     return hash_table_array[slot].is_occupied();
 }
 
-void PointerHashTableCanonicalAV::resize()
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::resize()
 {
     std::cout << "Hash table resizing not implemented yet...\n";
     exit(1);
 }
 
-uint64_t PointerHashTableCanonicalAV::get_number_of_inserted_items()
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_number_of_inserted_items()
 {
-    return inserted_items;
+    return inserted_items.load();
 }
 
-uint64_t PointerHashTableCanonicalAV::get_number_of_inserted_items_in_main()
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_number_of_inserted_items_in_main()
 {
-    return inserted_items-secondary_slots_in_use;
+    return inserted_items.load() - secondary_slots_in_use.load();
 }
 
-uint64_t PointerHashTableCanonicalAV::get_number_of_max_secondary_slots()
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_number_of_max_secondary_slots()
 {
     return  max_secondary_slots;
 }
 
-uint64_t PointerHashTableCanonicalAV::get_number_of_secondary_slots_in_use()
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_number_of_secondary_slots_in_use()
 {
-    return secondary_slots_in_use;
+    return secondary_slots_in_use.load();
 }
 
-uint64_t PointerHashTableCanonicalAV::get_max_number_of_secondary_slots_in_use()
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_max_number_of_secondary_slots_in_use()
 {
     return max_secondary_slot_in_use;
 }
 
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::stage_count_increase(uint64_t kmer_slot, CountStagingCache* count_cache)
+{
+    if (count_cache == nullptr)
+    {
+        hash_table_array[kmer_slot].increase_count();
+        return;
+    }
+    uint64_t entry = kmer_slot % CountStagingCache::cache_entries;
+    if (count_cache->pending[entry] > 0 && count_cache->slots[entry] != kmer_slot)
+    {
+        hash_table_array[count_cache->slots[entry]].increase_count_by(count_cache->pending[entry]);
+        count_cache->pending[entry] = 0;
+    }
+    count_cache->slots[entry] = kmer_slot;
+    count_cache->pending[entry] += 1;
+    if (count_cache->pending[entry] == CountStagingCache::max_pending)
+    {
+        hash_table_array[kmer_slot].increase_count_by(count_cache->pending[entry]);
+        count_cache->pending[entry] = 0;
+    }
+}
+
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::flush_count_cache(CountStagingCache* count_cache)
+{
+    for (uint64_t entry = 0; entry < CountStagingCache::cache_entries; entry++)
+    {
+        if (count_cache->pending[entry] > 0)
+        {
+            hash_table_array[count_cache->slots[entry]].increase_count_by(count_cache->pending[entry]);
+            count_cache->pending[entry] = 0;
+        }
+    }
+}
+
 // NEW FUNCTION TO PROCESS K-MER
 // The previous implementation did not work correctly with multiple threads
-uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot, CountStagingCache* count_cache)
 {
     // First, find the initial k-mer slot based on canonical orientation
     uint64_t initial_position;
@@ -2242,7 +2582,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                 // Take lock
                 bool empty_secondary_slot_found = false;
                 while(secondary_lock.test_and_set(std::memory_order_acquire));
-                for (uint64_t j = 0; j < max_secondary_slots; j++)
+                for (uint64_t j = secondary_search_start; j < max_secondary_slots; j++)
                 {
                     if (secondary_free_slots[j] == 1)
                     {
@@ -2256,10 +2596,11 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                     std::cout << "SECONDARY ARRAY SLOT RESIZING ERROR THAT SHOULD NOT HAPPEN\n";
                     exit(1);
                 }
-                secondary_slots_in_use += 1;
+                secondary_slots_in_use.add();
                 max_secondary_slot_in_use = std::max(max_secondary_slot_in_use, smallest_unused_secondary_slot+1);
                 touched_secondary_slots = std::max(touched_secondary_slots, max_secondary_slot_in_use);
                 secondary_free_slots[smallest_unused_secondary_slot] = 0;
+                secondary_search_start = smallest_unused_secondary_slot + 1;
                 for (int i = 0; i < kmer_factory->number_of_blocks; i++)
                 {
                     secondary_array[smallest_unused_secondary_slot*kmer_factory->number_of_blocks + i] = kmer_factory->get_canonical_block(i);
@@ -2315,7 +2656,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
             while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
             //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                 expected_data, 
-                kmod::modify_for_insertion(expected_data, predecessor_exists, pred_canonical_during_insertion, predecessor_for_insertion, self_canonical_during_insertion, self_left_char, self_right_char), 
+                kmod::modify_for_insertion<slot_layout>(expected_data, predecessor_exists, pred_canonical_during_insertion, predecessor_for_insertion, self_canonical_during_insertion, self_left_char, self_right_char), 
                 std::memory_order_acq_rel,
                 //std::memory_order_release,
                 std::memory_order_relaxed))
@@ -2335,7 +2676,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
             // If inserted successfully
             if (insertion_was_success)
             {
-                inserted_items+=1;
+                inserted_items.add();
                 return_slot = kmer_slot;
                 kmer_was_processed_correctly = true;
 
@@ -2350,6 +2691,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                     // We must free the secondary slot that was filled at the beginning
                     while(secondary_lock.test_and_set(std::memory_order_acquire));
                     secondary_free_slots[predecessor_for_insertion] = 1;
+                    secondary_search_start = std::min(secondary_search_start, predecessor_for_insertion);
                     for (int i = 0; i < kmer_factory->number_of_blocks; i++)
                     {
                         secondary_array[predecessor_for_insertion*kmer_factory->number_of_blocks + i] = 0;
@@ -2393,7 +2735,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
 
 // +++ INCREASE COUNT BY ONE +++
 
-                hash_table_array[kmer_slot].increase_count();
+                stage_count_increase(kmer_slot, count_cache);
 
 // +++ IF CURRENT K-MER HAS A PREDECESSOR BUT THE ONE IN THE HASH TABLE DOES NOT, MIGRATE POINTER +++
 
@@ -2439,7 +2781,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                         while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
                         //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                             expected_data, 
-                            kmod::modify_for_migration(expected_data, self_left_char, self_right_char, predecessor_slot, self_forward_canonical, pred_forward_canonical),
+                            kmod::modify_for_migration<slot_layout>(expected_data, self_left_char, self_right_char, predecessor_slot, self_forward_canonical, pred_forward_canonical),
                             //std::memory_order_release,
                             std::memory_order_acq_rel,
                             std::memory_order_relaxed))
@@ -2455,7 +2797,8 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                         if (i_did_the_migration)
                         {
                             secondary_free_slots[slot_in_secondary] = 1;
-                            secondary_slots_in_use -= 1;
+                            secondary_search_start = std::min(secondary_search_start, slot_in_secondary);
+                            secondary_slots_in_use.subtract();
                             for (uint64_t o = 0; o < kmer_blocks; o++)
                                 secondary_array[slot_in_secondary*kmer_blocks+o] = 0;
                         }
@@ -2501,7 +2844,7 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
                                 while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
                                 //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                                     expected_data_before_swap, 
-                                    kmod::modify_predecessor_slot_and_orientations(expected_data_before_swap, predecessor_slot, self_forward_canonical_x, pred_forward_canonical_x),
+                                    kmod::modify_predecessor_slot_and_orientations<slot_layout>(expected_data_before_swap, predecessor_slot, self_forward_canonical_x, pred_forward_canonical_x),
                                     //std::memory_order_release,
                                     std::memory_order_acq_rel,
                                     std::memory_order_relaxed))
@@ -2571,7 +2914,8 @@ uint64_t PointerHashTableCanonicalAV::process_kmer_MT(KMerFactoryCanonical2BC* k
 // Main function that is called when we want the hash table to process a new k-mer
 // Return the slot where the k-mer resides in after it is processed
 //
-uint64_t PointerHashTableCanonicalAV::process_kmer(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::process_kmer(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
 {
     // Try to find and increment
     uint64_t kmer_slot = find_and_increment(kmer_factory, hasher, predecessor_exists, predecessor_slot);
@@ -2588,7 +2932,8 @@ uint64_t PointerHashTableCanonicalAV::process_kmer(KMerFactoryCanonical2BC* kmer
 // If found, count is increased by one. Return the slot where the k-mer resides in.
 // If not found, return the size of the hash table.
 //
-uint64_t PointerHashTableCanonicalAV::find_and_increment(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::find_and_increment(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
 {
     uint64_t kmer_slot = find(kmer_factory, hasher, predecessor_exists, predecessor_slot);
     
@@ -2642,7 +2987,7 @@ uint64_t PointerHashTableCanonicalAV::find_and_increment(KMerFactoryCanonical2BC
             while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
             //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                 expected_data, 
-                kmod::modify_for_migration(expected_data, self_left_char, self_right_char, predecessor_slot, self_forward_canonical, pred_forward_canonical),
+                kmod::modify_for_migration<slot_layout>(expected_data, self_left_char, self_right_char, predecessor_slot, self_forward_canonical, pred_forward_canonical),
                 //std::memory_order_release,
                 std::memory_order_acq_rel,
                 std::memory_order_relaxed))
@@ -2658,7 +3003,8 @@ uint64_t PointerHashTableCanonicalAV::find_and_increment(KMerFactoryCanonical2BC
             if (i_did_the_migration)
             {
                 secondary_free_slots[slot_in_secondary] = 1;
-                secondary_slots_in_use -= 1;
+                secondary_search_start = std::min(secondary_search_start, slot_in_secondary);
+                secondary_slots_in_use.subtract();
                 for (uint64_t o = 0; o < kmer_blocks; o++)
                     secondary_array[slot_in_secondary*kmer_blocks+o] = 0;
             }
@@ -2672,7 +3018,8 @@ uint64_t PointerHashTableCanonicalAV::find_and_increment(KMerFactoryCanonical2BC
 
 // DONE
 // Find where a k-mer is in the hash table
-uint64_t PointerHashTableCanonicalAV::find(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::find(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
 {
     uint64_t initial_position;
     if (kmer_factory->forward_kmer_is_canonical()){
@@ -2729,7 +3076,8 @@ uint64_t PointerHashTableCanonicalAV::find(KMerFactoryCanonical2BC* kmer_factory
 // DONE
 //
 // return: -1 = sure false, 0 = unsure, 1 = sure match
-int PointerHashTableCanonicalAV::quick_kmer_slot_check_sus(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot, uint64_t predecessor_slot)
+template<class slot_layout>
+int PointerHashTableCanonicalAV<slot_layout>::quick_kmer_slot_check_sus(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot, uint64_t predecessor_slot)
 {
     //return 0;
     uint64_t lchar;
@@ -2746,13 +3094,14 @@ int PointerHashTableCanonicalAV::quick_kmer_slot_check_sus(KMerFactoryCanonical2
         rchar = twobitstringfunctions::reverse_int(kmer_factory->get_forward_char_at_position(0));
     }
 
-    if (lchar != hash_table_array[kmer_slot].get_left_character())
+    AtomicVariableSlotSnapshot<slot_layout> slot_snapshot = hash_table_array[kmer_slot].snapshot();
+    if (lchar != slot_snapshot.get_left_character())
         return -1;
-    if (rchar != hash_table_array[kmer_slot].get_right_character())
+    if (rchar != slot_snapshot.get_right_character())
         return -1;
 
     // Then match the pointer
-    if (predecessor_slot != hash_table_array[kmer_slot].get_predecessor_slot())
+    if (predecessor_slot != slot_snapshot.get_predecessor_slot())
     {
         return 0;
     }
@@ -2766,7 +3115,8 @@ int PointerHashTableCanonicalAV::quick_kmer_slot_check_sus(KMerFactoryCanonical2
 // Makes a full k-mer slot check. If the last k-mer in chain is in secondary and it is modified by another thread, the check has to start from the beginning
 // Maybe working?
 //
-bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot)
+template<class slot_layout>
+bool PointerHashTableCanonicalAV<slot_layout>::full_kmer_slot_check(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot)
 {
 
     uint64_t position = kmer_slot;
@@ -2807,7 +3157,8 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
 
     while(true)
     {
-        if (!hash_table_array[position].predecessor_exists())
+        AtomicVariableSlotSnapshot<slot_layout> position_snapshot = hash_table_array[position].snapshot();
+        if (!position_snapshot.predecessor_exists())
         {
             perform_secondary_array_check = true;
             break;
@@ -2819,7 +3170,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
             // If needs to be handled in reverse
             if (pir)
             {
-                if (lchar != twobitstringfunctions::reverse_int(hash_table_array[position].get_right_character()))
+                if (lchar != twobitstringfunctions::reverse_int(position_snapshot.get_right_character()))
                 {
                     return false;
                 }
@@ -2835,7 +3186,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
             // If needs to be handled forward
             else
             {
-                if (lchar != hash_table_array[position].get_left_character())
+                if (lchar != position_snapshot.get_left_character())
                 {
                     return false;
                 }
@@ -2868,7 +3219,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
             // If needs to be handled in reverse
             if (pir)
             {
-                if (rchar != twobitstringfunctions::reverse_int(hash_table_array[position].get_left_character()))
+                if (rchar != twobitstringfunctions::reverse_int(position_snapshot.get_left_character()))
                 {
                     return false;
                 }
@@ -2884,7 +3235,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
             // If needs to be handled forward
             else
             {
-                if (rchar != hash_table_array[position].get_right_character())
+                if (rchar != position_snapshot.get_right_character())
                 {
                     return false;
                 }
@@ -2912,9 +3263,9 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
         }
 
         // Modify chain character positions and process-in-reverse indicator
-        if (hash_table_array[position].canonical_during_insertion_self())
+        if (position_snapshot.canonical_during_insertion_self())
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // m e q
                 // T T T
@@ -2955,7 +3306,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
         }
         else
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // F T T
                 if (pir)
@@ -2992,7 +3343,7 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
                 }
             }
         }
-        position = hash_table_array[position].get_predecessor_slot();
+        position = position_snapshot.get_predecessor_slot();
     }
 
     if (perform_secondary_array_check)
@@ -3070,7 +3421,8 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check(KMerFactoryCanonical2BC*
 
 // DONE
 // No secondary array lock used, it is assumed that the caller has locked the table beforehand
-uint64_t PointerHashTableCanonicalAV::get_secondary_array_char(uint64_t secondary_array_position, int char_position)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::get_secondary_array_char(uint64_t secondary_array_position, int char_position)
 {
     //std::cout << "Asking for secondary array position " << secondary_array_position << " character at position " << char_position << "\n";
     if ((char_position < 0) || (char_position > int(kmer_len) - 1))
@@ -3095,7 +3447,8 @@ uint64_t PointerHashTableCanonicalAV::get_secondary_array_char(uint64_t secondar
 // DONE
 // Checks if a k-mer chain would have a too short cycle after migrating a k-mer to main
 //
-bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot, uint64_t avoid_slot)
+template<class slot_layout>
+bool PointerHashTableCanonicalAV<slot_layout>::check_for_cycle(uint64_t reconstruction_slot, uint64_t avoid_slot)
 {
     //while(main_locks[reconstruction_slot].test_and_set(std::memory_order_acquire));
     bool slot_occupied = hash_table_array[reconstruction_slot].is_occupied();
@@ -3121,19 +3474,20 @@ bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot,
 
     while(true)
     {
+        AtomicVariableSlotSnapshot<slot_layout> position_snapshot = hash_table_array[position].snapshot();
         if (position == avoid_slot)
             return true;
         //std::cout << "In this iteration L is " << L << " and R is " << R << "\n";
         //std::cout << "pir is " << pir << "\n";
         
         //while(main_locks[position].test_and_set(std::memory_order_acquire));
-        bool slot_has_predecessor = hash_table_array[position].predecessor_exists();
-        bool slot_canonical_during_insertion = hash_table_array[position].canonical_during_insertion_self();
-        bool predecessor_canonical_during_insertion = hash_table_array[position].canonical_during_insertion_self();
-        uint64_t slots_predecessor_slot = hash_table_array[position].get_predecessor_slot();
+        bool slot_has_predecessor = position_snapshot.predecessor_exists();
+        bool slot_canonical_during_insertion = position_snapshot.canonical_during_insertion_self();
+        bool predecessor_canonical_during_insertion = position_snapshot.canonical_during_insertion_self();
+        uint64_t slots_predecessor_slot = position_snapshot.get_predecessor_slot();
         //main_locks[position].clear(std::memory_order_release);
         
-        //if (!hash_table_array[position].predecessor_exists())
+        //if (!position_snapshot.predecessor_exists())
         if (!slot_has_predecessor)
         {
             //std::cout << "Going to perform secondary array reconstruction\n";
@@ -3155,10 +3509,10 @@ bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot,
                 break;
         }
         // Modify chain character positions and process in reverse indicator
-        //if (hash_table_array[position].canonical_during_insertion_self())
+        //if (position_snapshot.canonical_during_insertion_self())
         if (slot_canonical_during_insertion)
         {
-            //if (hash_table_array[position].canonical_during_insertion_predecessor())
+            //if (position_snapshot.canonical_during_insertion_predecessor())
             if (predecessor_canonical_during_insertion)
             {
                 // T T T
@@ -3199,7 +3553,7 @@ bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot,
         }
         else
         {
-            //if (hash_table_array[position].canonical_during_insertion_predecessor())
+            //if (position_snapshot.canonical_during_insertion_predecessor())
             if (predecessor_canonical_during_insertion)
             {
                 // F T T
@@ -3237,7 +3591,7 @@ bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot,
                 }
             }
         }
-        //position = hash_table_array[position].get_predecessor_slot();
+        //position = position_snapshot.get_predecessor_slot();
         position = slots_predecessor_slot;
     }
     return false;
@@ -3247,7 +3601,8 @@ bool PointerHashTableCanonicalAV::check_for_cycle(uint64_t reconstruction_slot,
 
 
 // UNUSED, but kept here as a reminder for the other version
-bool PointerHashTableCanonicalAV::full_kmer_slot_check_NO_SECONDARY(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot)
+template<class slot_layout>
+bool PointerHashTableCanonicalAV<slot_layout>::full_kmer_slot_check_NO_SECONDARY(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot)
 {
     if (!hash_table_array[kmer_slot].is_occupied())
         return false;
@@ -3561,7 +3916,8 @@ bool PointerHashTableCanonicalAV::full_kmer_slot_check_NO_SECONDARY(KMerFactoryC
 // DONE? might have errors...
 // Inserts k-mer into the main array.
 //
-uint64_t PointerHashTableCanonicalAV::insert_new_kmer(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::insert_new_kmer(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, bool predecessor_exists, uint64_t predecessor_slot)
 {
     // If no predecessor, the k-mer goes to the secondary array
     if (!predecessor_exists)
@@ -3618,7 +3974,7 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer(KMerFactoryCanonical2BC* k
             while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
             //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                 expected_data, 
-                kmod::modify_for_insertion(expected_data, predecessor_exists, pred_canonical_during_insertion, predecessor_slot, self_canonical_during_insertion, self_left_char, self_right_char), 
+                kmod::modify_for_insertion<slot_layout>(expected_data, predecessor_exists, pred_canonical_during_insertion, predecessor_slot, self_canonical_during_insertion, self_left_char, self_right_char), 
                 std::memory_order_acq_rel,
                 //std::memory_order_release,
                 std::memory_order_relaxed))
@@ -3674,7 +4030,7 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer(KMerFactoryCanonical2BC* k
         }
     }
     if (!inserted_by_increasing)
-        inserted_items+=1;
+        inserted_items.add();
     return kmer_slot;
 }
 
@@ -3683,13 +4039,14 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer(KMerFactoryCanonical2BC* k
 // Inserts new k-mer to the secondary array.
 //
 //
-uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::insert_new_kmer_in_secondary(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher)
 {
     // First, modify the secondary slot
     // Take lock
     bool empty_secondary_slot_found = false;
     while(secondary_lock.test_and_set(std::memory_order_acquire));
-    for (uint64_t j = 0; j < max_secondary_slots; j++)
+    for (uint64_t j = secondary_search_start; j < max_secondary_slots; j++)
     {
         if (secondary_free_slots[j] == 1)
         {
@@ -3703,10 +4060,11 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCa
         //std::cout << "SECONDARY ARRAY SLOT RESIZING ERROR THAT SHOULD NOT HAPPEN\n";
         exit(1);
     }
-    secondary_slots_in_use += 1;
+    secondary_slots_in_use.add();
     max_secondary_slot_in_use = std::max(max_secondary_slot_in_use, smallest_unused_secondary_slot+1);
     touched_secondary_slots = std::max(touched_secondary_slots, max_secondary_slot_in_use);
     secondary_free_slots[smallest_unused_secondary_slot] = 0;
+    secondary_search_start = smallest_unused_secondary_slot + 1;
     for (int i = 0; i < kmer_factory->number_of_blocks; i++)
     {
         secondary_array[smallest_unused_secondary_slot*kmer_factory->number_of_blocks + i] = kmer_factory->get_canonical_block(i);
@@ -3769,7 +4127,7 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCa
             while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
             //while(!hash_table_array[kmer_slot].data.compare_exchange_weak(
                 expected_data, 
-                kmod::modify_for_insertion(expected_data, predecessor_exists, pred_canonical_during_insertion, smallest_unused_secondary_slot, self_canonical_during_insertion, self_left_char, self_right_char), 
+                kmod::modify_for_insertion<slot_layout>(expected_data, predecessor_exists, pred_canonical_during_insertion, smallest_unused_secondary_slot, self_canonical_during_insertion, self_left_char, self_right_char), 
                 //std::memory_order_release,
                 std::memory_order_acq_rel,
                 std::memory_order_relaxed))
@@ -3829,6 +4187,7 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCa
         // We must free the secondary slot that was filled at the beginning
         while(secondary_lock.test_and_set(std::memory_order_acquire));
         secondary_free_slots[smallest_unused_secondary_slot] = 1;
+        secondary_search_start = std::min(secondary_search_start, smallest_unused_secondary_slot);
         for (int i = 0; i < kmer_factory->number_of_blocks; i++)
         {
             secondary_array[smallest_unused_secondary_slot*kmer_factory->number_of_blocks + i] = 0;
@@ -3837,7 +4196,7 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCa
     }
     else
     {
-        inserted_items+=1;
+        inserted_items.add();
     }
     return kmer_slot;
 }
@@ -3845,14 +4204,23 @@ uint64_t PointerHashTableCanonicalAV::insert_new_kmer_in_secondary(KMerFactoryCa
 // 
 // This is done with single thread always, don't touch for now
 // 
-std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
+template<class slot_layout>
+std::string PointerHashTableCanonicalAV<slot_layout>::reconstruct_kmer_in_slot(uint64_t slot)
 {
     if (!hash_table_array[slot].is_occupied())
         return "UNOCCUPIED";
-    
-    //std::cout << "\nreconstructing k-mer\n";
     std::vector<uint64_t> kmer_characters(kmer_len, 4);
-    
+    reconstruct_kmer_characters_in_slot(slot, kmer_characters);
+    std::string return_kmer(kmer_len, 'N');
+    for (uint64_t i = 0; i < kmer_len; i++)
+        return_kmer[i] = twobitstringfunctions::int2char(kmer_characters[i]);
+    return return_kmer;
+}
+
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::reconstruct_kmer_characters_in_slot(uint64_t slot, std::vector<uint64_t>& kmer_characters)
+{
+    //std::cout << "\nreconstructing k-mer\n";
     uint64_t position = slot;
     // Leftmost untaken character position
     int L;
@@ -3873,9 +4241,10 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
 
     while(true)
     {
+        AtomicVariableSlotSnapshot<slot_layout> position_snapshot = hash_table_array[position].snapshot();
         //std::cout << "In this iteration L is " << L << " and R is " << R << "\n";
         //std::cout << "pir is " << pir << "\n";
-        if (!hash_table_array[position].predecessor_exists())
+        if (!position_snapshot.predecessor_exists())
         {
             //std::cout << "Going to perform secondary array reconstruction\n";
             perform_secondary_array_check = true;
@@ -3888,12 +4257,12 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
             // If needs to be handled in reverse
             if (pir)
             {
-                kmer_characters[L] = twobitstringfunctions::reverse_int(hash_table_array[position].get_right_character());
+                kmer_characters[L] = twobitstringfunctions::reverse_int(position_snapshot.get_right_character());
             }
             // If needs to be handled forward
             else
             {
-                kmer_characters[L] = hash_table_array[position].get_left_character();
+                kmer_characters[L] = position_snapshot.get_left_character();
             }
             //std::cout << "Adding left char in slot " << L << " = " << kmer_characters[L] << "\n";
             L = L + 1;
@@ -3907,12 +4276,12 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
             // If needs to be handled in reverse
             if (pir)
             {
-                kmer_characters[R] = twobitstringfunctions::reverse_int(hash_table_array[position].get_left_character());
+                kmer_characters[R] = twobitstringfunctions::reverse_int(position_snapshot.get_left_character());
             }
             // If needs to be handled forward
             else
             {
-                kmer_characters[R] = hash_table_array[position].get_right_character();
+                kmer_characters[R] = position_snapshot.get_right_character();
             } 
             //std::cout << "Adding right char in slot " << R << " = " << kmer_characters[R] << "\n";       
             R = R - 1;
@@ -3920,9 +4289,9 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
                 break;
         }
         // Modify chain character positions and process in reverse indicator
-        if (hash_table_array[position].canonical_during_insertion_self())
+        if (position_snapshot.canonical_during_insertion_self())
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // T T T
                 if (pir)
@@ -3962,7 +4331,7 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
         }
         else
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // F T T
                 if (pir)
@@ -3999,7 +4368,7 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
                 }
             }
         }
-        position = hash_table_array[position].get_predecessor_slot();
+        position = position_snapshot.get_predecessor_slot();
         looked_kmers += 1;
     }
 
@@ -4042,23 +4411,15 @@ std::string PointerHashTableCanonicalAV::reconstruct_kmer_in_slot(uint64_t slot)
             }
         }
     }
-    std::string return_kmer = "";
-    for (uint64_t i = 0; i < kmer_len; i++)
-    {
-        return_kmer = return_kmer + twobitstringfunctions::int2char(kmer_characters[i]);
-    }
-    if (looked_kmers > max_kmer_reconstruction_chain)
-    {
-        //std::cout << "New maximum k-mer reconstruction chain encountered: " << looked_kmers << "\n";
-        max_kmer_reconstruction_chain = looked_kmers;
-    }
+    uint64_t max_chain = max_kmer_reconstruction_chain.load(std::memory_order_relaxed);
+    while (looked_kmers > max_chain && !max_kmer_reconstruction_chain.compare_exchange_weak(max_chain, looked_kmers, std::memory_order_relaxed));
 
-    total_reconstruction_chain += looked_kmers;
-    return return_kmer;
+    total_reconstruction_chain.add(looked_kmers);
 }
 
 /*
-void PointerHashTableCanonicalAV::write_kmers_on_disk_separately(uint64_t min_abundance, std::string& output_path)
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::write_kmers_on_disk_separately(uint64_t min_abundance, std::string& output_path)
 {
     std::ofstream output_file(output_path);
 
@@ -4085,7 +4446,8 @@ void PointerHashTableCanonicalAV::write_kmers_on_disk_separately(uint64_t min_ab
 // 
 // This is done with single thread always, don't touch for now
 // 
-uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(uint64_t slot)
+template<class slot_layout>
+uint64_t PointerHashTableCanonicalAV<slot_layout>::count_reconstruction_chain_length_in_slot(uint64_t slot)
 {
     if (!hash_table_array[slot].is_occupied())
         return 0;
@@ -4114,11 +4476,12 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
 
     while(true)
     {
+        AtomicVariableSlotSnapshot<slot_layout> position_snapshot = hash_table_array[position].snapshot();
         chain_length = chain_length + 1;
 
         //std::cout << "In this iteration L is " << L << " and R is " << R << "\n";
         //std::cout << "pir is " << pir << "\n";
-        if (!hash_table_array[position].predecessor_exists())
+        if (!position_snapshot.predecessor_exists())
         {
             //std::cout << "Going to perform secondary array reconstruction\n";
             perform_secondary_array_check = true;
@@ -4131,12 +4494,12 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
             // If needs to be handled in reverse
             if (pir)
             {
-                kmer_characters[L] = twobitstringfunctions::reverse_int(hash_table_array[position].get_right_character());
+                kmer_characters[L] = twobitstringfunctions::reverse_int(position_snapshot.get_right_character());
             }
             // If needs to be handled forward
             else
             {
-                kmer_characters[L] = hash_table_array[position].get_left_character();
+                kmer_characters[L] = position_snapshot.get_left_character();
             }
             //std::cout << "Adding left char in slot " << L << " = " << kmer_characters[L] << "\n";
             L = L + 1;
@@ -4150,12 +4513,12 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
             // If needs to be handled in reverse
             if (pir)
             {
-                kmer_characters[R] = twobitstringfunctions::reverse_int(hash_table_array[position].get_left_character());
+                kmer_characters[R] = twobitstringfunctions::reverse_int(position_snapshot.get_left_character());
             }
             // If needs to be handled forward
             else
             {
-                kmer_characters[R] = hash_table_array[position].get_right_character();
+                kmer_characters[R] = position_snapshot.get_right_character();
             } 
             //std::cout << "Adding right char in slot " << R << " = " << kmer_characters[R] << "\n";       
             R = R - 1;
@@ -4163,9 +4526,9 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
                 break;
         }
         // Modify chain character positions and process in reverse indicator
-        if (hash_table_array[position].canonical_during_insertion_self())
+        if (position_snapshot.canonical_during_insertion_self())
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // T T T
                 if (pir)
@@ -4205,7 +4568,7 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
         }
         else
         {
-            if (hash_table_array[position].canonical_during_insertion_predecessor())
+            if (position_snapshot.canonical_during_insertion_predecessor())
             {
                 // F T T
                 if (pir)
@@ -4242,7 +4605,7 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
                 }
             }
         }
-        position = hash_table_array[position].get_predecessor_slot();
+        position = position_snapshot.get_predecessor_slot();
         looked_kmers += 1;
     }
 
@@ -4289,7 +4652,8 @@ uint64_t PointerHashTableCanonicalAV::count_reconstruction_chain_length_in_slot(
     return chain_length;
 }
 
-void PointerHashTableCanonicalAV::analyze_pointer_chain_lengths()
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::analyze_pointer_chain_lengths()
 {
     uint64_t chain_lengths = 100000;
     uint64_t counts[100000];
@@ -4315,216 +4679,239 @@ void PointerHashTableCanonicalAV::analyze_pointer_chain_lengths()
 	output_file.clear();
 }
 
-void PointerHashTableCanonicalAV::write_kmers_on_disk_separately_even_faster(uint64_t min_abundance, std::string& output_path)
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::write_kmers_on_disk_separately_even_faster(uint64_t min_abundance, std::string& output_path, bool append, uint64_t n_threads, bool binary)
 {
-    std::ofstream output_file(output_path);
-    uint64_t kmer_data;
-    uint64_t kmers_written = 0;
-    uint64_t kmers_skipped = 0;
-    // First count/find how many times each k-mer is referenced
-    //std::vector<uint8_t> referenced(size, 0);
-    for (uint64_t i = 0; i < size; i++)
+    int output_fd = open(output_path.c_str(), O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+    if (output_fd < 0)
     {
-        //hash_table_array[i].unset_is_flagged_1();
-        kmer_data = hash_table_array[i].get_data();
-        //while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_unflagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-        while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_unflagged_2(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-        //while(!hash_table_array[i].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_unflagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-        if ((hash_table_array[i].is_occupied()) && (hash_table_array[i].predecessor_exists()))
+        std::cout << "Could not open output file " << output_path << "\n";
+        exit(1);
+    }
+    // Records already in the binary output when appending, the header is rewritten with the new total at the end
+    uint64_t previous_records = 0;
+    char header[kmerdatabasefunctions::header_bytes] = {};
+    if (binary && append)
+    {
+        if (pread(output_fd, header, kmerdatabasefunctions::header_bytes, 0) != ssize_t(kmerdatabasefunctions::header_bytes))
         {
-            //referenced[hash_table_array[i].get_predecessor_slot()] += 1;
-            kmer_data = hash_table_array[i].get_data();
-            //while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_1(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-            while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_1(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-            //while(!hash_table_array[i].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_flagged_1(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-            //hash_table_array[hash_table_array[i].get_predecessor_slot()].set_is_flagged_1();
+            std::cout << "Could not read the header of output file " << output_path << "\n";
+            exit(1);
         }
-        else
+        previous_records = kmerdatabasefunctions::header_records(header, kmer_len);
+    }
+    // Threads reserve space for their full buffers from the end of the output and write them there with pwrite
+    std::atomic<uint64_t> output_offset(append ? uint64_t(lseek(output_fd, 0, SEEK_END)) : (binary ? kmerdatabasefunctions::header_bytes : uint64_t(0)));
+    std::atomic<uint64_t> kmers_written(0);
+    std::atomic<uint64_t> kmers_skipped(0);
+    const uint64_t buffer_bytes = uint64_t(1) << 24;
+    n_threads = std::max(uint64_t(1), std::min(n_threads, size / 65536 + 1));
+
+    // Runs work(begin, end) for n_threads consecutive slot ranges in parallel
+    auto run_on_slot_ranges = [&](auto work)
+    {
+        std::vector<std::thread> threads;
+        for (uint64_t t = 0; t < n_threads; t++)
+            threads.emplace_back(work, size * t / n_threads, size * (t + 1) / n_threads);
+        for (auto & thread : threads)
+            thread.join();
+    };
+
+    auto write_at = [&](const char* data, uint64_t bytes, uint64_t offset)
+    {
+        uint64_t done = 0;
+        while (done < bytes)
         {
-            kmer_data = hash_table_array[i].get_data();
-            //while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_unflagged_1(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-            while(!hash_table_array[i].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_unflagged_1(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-            //while(!hash_table_array[i].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_unflagged_1(kmer_data),std::memory_order_release, std::memory_order_relaxed));
+            ssize_t written = pwrite(output_fd, data + done, bytes - done, off_t(offset + done));
+            if (written <= 0)
+            {
+                std::cout << "Could not write output file " << output_path << "\n";
+                exit(1);
+            }
+            done += uint64_t(written);
         }
-    }
-    uint64_t check_position;
-    uint64_t chain_position;
-    //bool reversed = false;
-    //bool extend_left = true;
-    std::string starting_kmer;
-    std::string starting_kmer_rev;
-    uint64_t iteration_1_kmers = 0;
-    uint64_t iteration_0_kmers = 0;
+    };
 
-    uint64_t pred_pos;
-    for(int iteration = 0; iteration < 2; iteration++)
+    auto write_buffer = [&](std::string& buffer)
     {
-        check_position = 0;
-        while (check_position < size)
+        write_at(buffer.data(), buffer.size(), output_offset.fetch_add(buffer.size(), std::memory_order_relaxed));
+        buffer.clear();
+    };
+
+    // Sets flag 2 (written) of the slot. Returns false if it was already set, so every k-mer is written by one thread only
+    auto claim_slot = [&](uint64_t slot)
+    {
+        uint64_t kmer_data = hash_table_array[slot].get_data();
+        while (!AtomicVariableSlotSnapshot<slot_layout>(kmer_data).is_flagged_2())
         {
-            // If first iteration and referenced, skip
-            //if ((iteration == 0) && (referenced[check_position] > 0))
-            if ((iteration == 0) && (hash_table_array[check_position].is_flagged_1()))
-            {
-                check_position += 1;
-                continue;
+            if (hash_table_array[slot].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_flagged_2(kmer_data), std::memory_order_acq_rel, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    };
+
+    // K-mers are kept in 2-bit blocks like in KMerFactoryCanonical2BC, together with their reverse complements
+    int bits_in_last_block = (2*kmer_len) % 64 == 0 ? 64 : (2*kmer_len) % 64;
+    uint64_t used_left_block_mask = bits_in_last_block == 64 ? ~uint64_t(0) : (uint64_t(1) << bits_in_last_block) - 1;
+    int last_block = kmer_blocks - 1;
+
+    // Appends c to the right end of append_to and its complement to the left end of other (the reverse complement of append_to)
+    auto roll = [&](uint64_t* append_to, uint64_t* other, uint64_t c)
+    {
+        for (int i = 0; i < last_block; i++)
+            append_to[i] = (append_to[i] << 2) | (append_to[i+1] >> 62);
+        append_to[last_block] = (append_to[last_block] << 2) | c;
+        append_to[0] &= used_left_block_mask;
+        for (int i = last_block; i > 0; i--)
+            other[i] = (other[i] >> 2) | (other[i-1] << 62);
+        other[0] = (other[0] >> 2) | (twobitstringfunctions::reverse_int(c) << (bits_in_last_block-2));
+    };
+
+    // Turns kmer (and its reverse complement kmer_rc) in chain_position into the k-mer in its predecessor pred_pos
+    auto step_to_predecessor = [&](uint64_t chain_position, uint64_t pred_pos, uint64_t*& kmer, uint64_t*& kmer_rc)
+    {
+        AtomicVariableSlotSnapshot<slot_layout> chain_snapshot = hash_table_array[chain_position].snapshot();
+        AtomicVariableSlotSnapshot<slot_layout> pred_snapshot = hash_table_array[pred_pos].snapshot();
+        if (chain_snapshot.canonical_during_insertion_self())
+        {
+            if (chain_snapshot.canonical_during_insertion_predecessor()){
+                // F + F
+                roll(kmer_rc, kmer, twobitstringfunctions::reverse_int(pred_snapshot.get_left_character()));
+            } else {
+                // F + R
+                roll(kmer_rc, kmer, pred_snapshot.get_right_character());
+                std::swap(kmer, kmer_rc);
             }
-            // If not occupied or already written, skip
-            if ((!hash_table_array[check_position].is_occupied()) || (hash_table_array[check_position].is_flagged_2()))
-            {
-                check_position += 1;
-                continue;
+        }
+        else
+        {
+            if (chain_snapshot.canonical_during_insertion_predecessor()){
+                // R + F
+                roll(kmer, kmer_rc, twobitstringfunctions::reverse_int(pred_snapshot.get_left_character()));
+                std::swap(kmer, kmer_rc);
+            } else {
+                // R + R
+                roll(kmer, kmer_rc, pred_snapshot.get_right_character());
             }
+        }
+    };
 
-            // Construct first chain k-mer
-            starting_kmer = reconstruct_kmer_in_slot(check_position);
-            starting_kmer_rev = purestringfunctions::reverse_string(starting_kmer);
-            //purestringfunctions::reverse_this_string(starting_kmer_rev);
-            // Write all unwritten k-mers in the chain
-            chain_position = check_position;
-            // Write first
-            if (hash_table_array[chain_position].get_count() >= min_abundance)
+    // Flag 1 = has a predecessor, flag 2 = written. Only the thread of the range modifies its slots here
+    run_on_slot_ranges([&](uint64_t begin, uint64_t end)
+    {
+        for (uint64_t i = begin; i < end; i++)
+        {
+            uint64_t kmer_data = hash_table_array[i].get_data();
+            while (true)
             {
-                kmers_written += 1;
-                if (iteration == 0)
-                    iteration_0_kmers+=1;
+                AtomicVariableSlotSnapshot<slot_layout> snapshot(kmer_data);
+                uint64_t new_data = kmod::modify_to_be_unflagged_2(kmer_data);
+                if (snapshot.is_occupied() && snapshot.predecessor_exists())
+                    new_data = kmod::modify_to_be_flagged_1(new_data);
                 else
-                    iteration_1_kmers+=1;
-                output_file << starting_kmer << " " << hash_table_array[chain_position].get_count() << "\n";
-            } else {
-                kmers_skipped += 1;
-            }
-            kmer_data = hash_table_array[chain_position].get_data();
-            //while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-            while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-            //while(!hash_table_array[chain_position].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-            //hash_table_array[chain_position].set_is_flagged_2();
-            // Move to previous
-            if (hash_table_array[chain_position].predecessor_exists())
-            {
-                pred_pos = hash_table_array[chain_position].get_predecessor_slot();
-                if (hash_table_array[pred_pos].predecessor_exists())
-                {   
-                    if (hash_table_array[chain_position].canonical_during_insertion_self())
-                    {
-                        if (hash_table_array[chain_position].canonical_during_insertion_predecessor()){
-                            // F + F
-                            starting_kmer = twobitstringfunctions::int2char(hash_table_array[pred_pos].get_left_character()) + starting_kmer.substr(0,kmer_len-1);
-                            starting_kmer_rev =  starting_kmer_rev.substr(1,kmer_len-1) + twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_left_character()));
-                        } else {
-                            // F + R
-                            starting_kmer = twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_right_character())) + starting_kmer.substr(0,kmer_len-1);
-                            starting_kmer_rev = starting_kmer_rev.substr(1, kmer_len-1) + twobitstringfunctions::int2char(hash_table_array[pred_pos].get_right_character());
-                            starting_kmer.swap(starting_kmer_rev);
-                        }
-                    }
-                    else
-                    {
-                        if (hash_table_array[chain_position].canonical_during_insertion_predecessor()){
-                            // R + F
-                            starting_kmer = starting_kmer.substr(1,kmer_len-1) + twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_left_character()));
-                            starting_kmer_rev = twobitstringfunctions::int2char(hash_table_array[pred_pos].get_left_character()) + starting_kmer_rev.substr(0, kmer_len-1);
-                            starting_kmer.swap(starting_kmer_rev);
-                        } else {
-                            // R + R
-                            starting_kmer = starting_kmer.substr(1,kmer_len-1) + twobitstringfunctions::int2char(hash_table_array[pred_pos].get_right_character());
-                            starting_kmer_rev = twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_right_character())) + starting_kmer_rev.substr(0,kmer_len-1);
-                        }
-                    }
-                }
-                chain_position = pred_pos;
+                    new_data = kmod::modify_to_be_unflagged_1(new_data);
+                // Empty and unchanged slots are not written
+                if ((new_data == kmer_data) || hash_table_array[i].data.compare_exchange_strong(kmer_data, new_data, std::memory_order_acq_rel, std::memory_order_relaxed))
+                    break;
             }
-            else
+        }
+    });
+
+    // First write the k-mers without predecessor, then walk the chains from the others towards them.
+    // Each k-mer in a chain is rolled from the previous one instead of reconstructing it.
+    for (int iteration = 0; iteration < 2; iteration++)
+    {
+        run_on_slot_ranges([&](uint64_t begin, uint64_t end)
+        {
+            std::string buffer;
+            buffer.reserve(buffer_bytes + kmer_len + 32);
+            uint64_t written = 0;
+            uint64_t skipped = 0;
+            std::vector<uint64_t> kmer_characters(kmer_len);
+            std::vector<uint64_t> packed_kmers(2*kmer_blocks, 0);
+            uint64_t* kmer = packed_kmers.data();
+            uint64_t* kmer_rc = packed_kmers.data() + kmer_blocks;
+            // k-mer, space, count and newline, or one binary record
+            std::vector<char> line(std::max(uint64_t(kmer_len + 32), kmerdatabasefunctions::record_bytes(kmer_len)));
+
+            auto load_kmer = [&](uint64_t slot)
             {
-                check_position += 1;
-                continue;
-            }
-            while(!hash_table_array[chain_position].is_flagged_2())
+                reconstruct_kmer_characters_in_slot(slot, kmer_characters);
+                for (uint64_t c : kmer_characters)
+                    roll(kmer, kmer_rc, c);
+            };
+
+            auto output_kmer = [&](uint64_t slot)
             {
-                if (!hash_table_array[chain_position].predecessor_exists())
+                uint64_t count = hash_table_array[slot].get_count();
+                if (count < min_abundance)
                 {
-                    if (hash_table_array[chain_position].get_count() >= min_abundance)
-                    {
-                        kmers_written += 1;
-                        if (iteration == 0)
-                            iteration_0_kmers+=1;
-                        else
-                            iteration_1_kmers+=1;
-                        output_file << reconstruct_kmer_in_slot(chain_position) << " " << std::to_string(hash_table_array[chain_position].get_count()) << "\n";
-                    } else {
-                        kmers_skipped += 1;
-                    }
-                    kmer_data = hash_table_array[chain_position].get_data();
-                    //while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-                    while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-                    //while(!hash_table_array[chain_position].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-                    //hash_table_array[chain_position].set_is_flagged_2();
-                    break;
+                    skipped += 1;
+                    return;
                 }
-                if (hash_table_array[chain_position].get_count() >= min_abundance)
+                char* line_end;
+                if (binary)
                 {
-                    kmers_written += 1;
-                    if (iteration == 0)
-                        iteration_0_kmers+=1;
-                    else
-                        iteration_1_kmers+=1;
-                    output_file << starting_kmer << " " << hash_table_array[chain_position].get_count() << "\n";
-                } else {
-                    kmers_skipped += 1;
-                }
-                kmer_data = hash_table_array[chain_position].get_data();
-                //while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-                while(!hash_table_array[chain_position].data.compare_exchange_strong(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_acq_rel, std::memory_order_relaxed));
-                //while(!hash_table_array[chain_position].data.compare_exchange_weak(kmer_data, kmod::modify_to_be_flagged_2(kmer_data),std::memory_order_release, std::memory_order_relaxed));
-                //hash_table_array[chain_position].set_is_flagged_2();
-                pred_pos = hash_table_array[chain_position].get_predecessor_slot();
-                if (hash_table_array[pred_pos].predecessor_exists())
+                    line_end = kmerdatabasefunctions::write_record(kmer, kmer_blocks, count, line.data());
+                }
+                else
                 {
-                    if (hash_table_array[pred_pos].predecessor_exists())
-                    {   
-                        if (hash_table_array[chain_position].canonical_during_insertion_self())
-                        {
-                            if (hash_table_array[chain_position].canonical_during_insertion_predecessor()){
-                                // F + F
-                                starting_kmer = twobitstringfunctions::int2char(hash_table_array[pred_pos].get_left_character()) + starting_kmer.substr(0,kmer_len-1);
-                                starting_kmer_rev =  starting_kmer_rev.substr(1,kmer_len-1) + twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_left_character()));
-                            } else {
-                                // F + R
-                                starting_kmer = twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_right_character())) + starting_kmer.substr(0,kmer_len-1);
-                                starting_kmer_rev = starting_kmer_rev.substr(1, kmer_len-1) + twobitstringfunctions::int2char(hash_table_array[pred_pos].get_right_character());
-                                starting_kmer.swap(starting_kmer_rev);
-                            }
-                        }
-                        else
-                        {
-                            if (hash_table_array[chain_position].canonical_during_insertion_predecessor()){
-                                // R + F
-                                starting_kmer = starting_kmer.substr(1,kmer_len-1) + twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_left_character()));
-                                starting_kmer_rev = twobitstringfunctions::int2char(hash_table_array[pred_pos].get_left_character()) + starting_kmer_rev.substr(0, kmer_len-1);
-                                starting_kmer.swap(starting_kmer_rev);
-                            } else {
-                                // R + R
-                                starting_kmer = starting_kmer.substr(1,kmer_len-1) + twobitstringfunctions::int2char(hash_table_array[pred_pos].get_right_character());
-                                starting_kmer_rev = twobitstringfunctions::int2char(twobitstringfunctions::reverse_int(hash_table_array[pred_pos].get_right_character())) + starting_kmer_rev.substr(0,kmer_len-1);
-                            }
-                        }
+                    twobitstringfunctions::blocks2chars(kmer, kmer_blocks, kmer_len, line.data());
+                    line[kmer_len] = ' ';
+                    line_end = purestringfunctions::write_uint(count, line.data() + kmer_len + 1);
+                    *line_end++ = '\n';
+                }
+                buffer.append(line.data(), line_end - line.data());
+                written += 1;
+                if (buffer.size() >= buffer_bytes)
+                    write_buffer(buffer);
+            };
+
+            for (uint64_t check_position = begin; check_position < end; check_position++)
+            {
+                if ((iteration == 0) && (hash_table_array[check_position].is_flagged_1()))
+                    continue;
+                if ((!hash_table_array[check_position].is_occupied()) || (!claim_slot(check_position)))
+                    continue;
+                load_kmer(check_position);
+                output_kmer(check_position);
+                // Write the predecessors until the chain reaches a k-mer some thread has already written
+                uint64_t chain_position = check_position;
+                while (hash_table_array[chain_position].predecessor_exists())
+                {
+                    uint64_t pred_pos = hash_table_array[chain_position].get_predecessor_slot();
+                    if (!claim_slot(pred_pos))
+                        break;
+                    if (!hash_table_array[pred_pos].predecessor_exists())
+                    {
+                        load_kmer(pred_pos);
+                        output_kmer(pred_pos);
+                        break;
                     }
+                    step_to_predecessor(chain_position, pred_pos, kmer, kmer_rc);
+                    output_kmer(pred_pos);
+                    chain_position = pred_pos;
                 }
-                chain_position = pred_pos;
             }
-            check_position += 1;
-        }
+            if (!buffer.empty())
+                write_buffer(buffer);
+            kmers_written += written;
+            kmers_skipped += skipped;
+        });
     }
-    //std::cout << "Iteration 0 k-mers: " << iteration_0_kmers << "\n";
-    //std::cout << "Iteration 1 k-mers: " << iteration_1_kmers << "\n";
-    output_file.close(); // close file
-	output_file.clear(); // clear flags
+    if (binary)
+    {
+        kmerdatabasefunctions::fill_header(header, kmer_len, previous_records + kmers_written);
+        write_at(header, kmerdatabasefunctions::header_bytes, 0);
+    }
+    close(output_fd);
     std::cout << "Written k-mers: " << kmers_written << "\n";
     std::cout << "Skipped k-mers: " << kmers_skipped << "\n";
 }
 
 /*
-void PointerHashTableCanonicalAV::write_kmers_on_disk_separately_faster(uint64_t min_abundance, std::string& output_path)
+template<class slot_layout>
+void PointerHashTableCanonicalAV<slot_layout>::write_kmers_on_disk_separately_faster(uint64_t min_abundance, std::string& output_path)
 {
     std::ofstream output_file(output_path);
     // First count/find how many times each k-mer is referenced
@@ -4657,3 +5044,603 @@ void PointerHashTableCanonicalAV::write_kmers_on_disk_separately_faster(uint64_t
 	output_file.clear(); // clear flags
 }
 */
+
+// Supported slot layouts
+template class PointerHashTableCanonicalAV<SlotLayoutP38C14>;
+template class PointerHashTableCanonicalAV<SlotLayoutP32C20>;
+
+
+
+// === For CANONICAL pointer hash table with 4 characters per side ==============================================
+
+// s = slots, k = k-mer length, b = 64bit blocks per k-mer
+PointerHashTableCanonicalAVBIG::PointerHashTableCanonicalAVBIG(uint64_t s, uint64_t k, uint64_t b)
+{
+    if (k < OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side)
+    {
+        std::cout << "k-mer length must be at least " << OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side << " with this hash table\n";
+        exit(1);
+    }
+    size = s;
+    kmer_len = k;
+    hash_table_array = new OneCharacterAndPointerKMerAtomicVariableBIG[size];
+    inserted_items.reset();
+    kmer_blocks = b;
+    probe_hasher = new ProbeHasher1();
+    // Secondary array stuff
+    max_secondary_slots = 100;
+    secondary_slots_in_use.reset();
+    max_secondary_slot_in_use = 0;
+    smallest_unused_secondary_slot = 0;
+    secondary_search_start = 0;
+    secondary_array = std::vector<uint64_t>(b*max_secondary_slots, uint64_t(0));
+    secondary_free_slots = std::vector<uint8_t>(max_secondary_slots, 1);
+    secondary_lock.clear();
+
+    max_kmer_reconstruction_chain = 0;
+    total_reconstruction_chain = 0;
+    number_of_reconstructions = 0;
+}
+
+PointerHashTableCanonicalAVBIG::~PointerHashTableCanonicalAVBIG()
+{
+    delete[] hash_table_array;
+    delete probe_hasher;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_kmer_count_in_slot(uint64_t slot)
+{
+    return hash_table_array[slot].get_count();
+}
+
+bool PointerHashTableCanonicalAVBIG::slot_is_occupied(uint64_t slot)
+{
+    return hash_table_array[slot].is_occupied();
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_number_of_inserted_items()
+{
+    return inserted_items.load();
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_number_of_max_secondary_slots()
+{
+    return max_secondary_slots;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_max_number_of_secondary_slots_in_use()
+{
+    return max_secondary_slot_in_use;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_canonical_char(KMerFactoryCanonical2BC* kmer_factory, int i)
+{
+    if (kmer_factory->forward_kmer_is_canonical())
+        return kmer_factory->get_forward_char_at_position(i);
+    return kmer_factory->get_backward_char_at_position(i);
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_canonical_left_characters(KMerFactoryCanonical2BC* kmer_factory)
+{
+    uint64_t chars = 0;
+    for (uint64_t i = 0; i < OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side; i++)
+        chars |= get_canonical_char(kmer_factory, i) << (2*i);
+    return chars;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_canonical_right_characters(KMerFactoryCanonical2BC* kmer_factory)
+{
+    uint64_t chars = 0;
+    uint64_t first = kmer_len - OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side;
+    for (uint64_t i = 0; i < OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side; i++)
+        chars |= get_canonical_char(kmer_factory, first + i) << (2*i);
+    return chars;
+}
+
+bool PointerHashTableCanonicalAVBIG::get_frame_char(uint64_t left_chars, uint64_t right_chars, int Lc, bool pir, int query_position, uint64_t& query_char)
+{
+    int cps = int(OneCharacterAndPointerKMerAtomicVariableBIG::chars_per_side);
+    int k = int(kmer_len);
+    int j = pir ? (Lc + k - 1 - query_position) : (query_position - Lc);
+    uint64_t slot_char;
+    if ((j >= 0) && (j < cps))
+        slot_char = (left_chars >> (2*j)) & uint64_t(3);
+    else if ((j >= k - cps) && (j < k))
+        slot_char = (right_chars >> (2*(j - (k - cps)))) & uint64_t(3);
+    else
+        return false;
+    if (pir)
+        query_char = twobitstringfunctions::reverse_int(slot_char);
+    else
+        query_char = slot_char;
+    return true;
+}
+
+void PointerHashTableCanonicalAVBIG::move_frame_to_predecessor(AtomicVariableSlotSnapshotBIG slot, int& Lc, bool& pir)
+{
+    // Same rules as in PointerHashTableCanonicalAV, but the frame moves by the predecessor distance
+    int distance = int(slot.get_predecessor_distance());
+    bool self_canonical = slot.canonical_during_insertion_self();
+    bool pred_canonical = slot.canonical_during_insertion_predecessor();
+    if (self_canonical != pir)
+        Lc = Lc - distance;
+    else
+        Lc = Lc + distance;
+    if (self_canonical != pred_canonical)
+        pir = !pir;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::reserve_secondary_slot(KMerFactoryCanonical2BC* kmer_factory)
+{
+    bool empty_secondary_slot_found = false;
+    while(secondary_lock.test_and_set(std::memory_order_acquire));
+    for (uint64_t j = secondary_search_start; j < max_secondary_slots; j++)
+    {
+        if (secondary_free_slots[j] == 1)
+        {
+            smallest_unused_secondary_slot = j;
+            empty_secondary_slot_found = true;
+            break;
+        }
+    }
+    if (!empty_secondary_slot_found)
+    {
+        std::cout << "SECONDARY ARRAY SLOT RESIZING ERROR THAT SHOULD NOT HAPPEN\n";
+        exit(1);
+    }
+    uint64_t secondary_slot = smallest_unused_secondary_slot;
+    secondary_slots_in_use.add();
+    max_secondary_slot_in_use = std::max(max_secondary_slot_in_use, secondary_slot+1);
+    secondary_free_slots[secondary_slot] = 0;
+    secondary_search_start = secondary_slot + 1;
+    for (uint64_t i = 0; i < kmer_blocks; i++)
+    {
+        secondary_array[secondary_slot*kmer_blocks + i] = kmer_factory->get_canonical_block(i);
+    }
+    if (secondary_slot == max_secondary_slots-1)
+    {
+        if (max_secondary_slots < 1000000){
+            max_secondary_slots *= 2;
+        } else {
+            max_secondary_slots *= 1.5;
+        }
+        secondary_array.resize(kmer_blocks*max_secondary_slots, 0);
+        secondary_free_slots.resize(max_secondary_slots, 1);
+    }
+    secondary_lock.clear(std::memory_order_release);
+    return secondary_slot;
+}
+
+void PointerHashTableCanonicalAVBIG::free_secondary_slot(uint64_t secondary_slot)
+{
+    while(secondary_lock.test_and_set(std::memory_order_acquire));
+    secondary_free_slots[secondary_slot] = 1;
+    secondary_search_start = std::min(secondary_search_start, secondary_slot);
+    secondary_slots_in_use.subtract();
+    for (uint64_t i = 0; i < kmer_blocks; i++)
+        secondary_array[secondary_slot*kmer_blocks + i] = 0;
+    secondary_lock.clear(std::memory_order_release);
+}
+
+void PointerHashTableCanonicalAVBIG::stage_count_increase(uint64_t kmer_slot, CountStagingCache* count_cache)
+{
+    if (count_cache == nullptr)
+    {
+        hash_table_array[kmer_slot].increase_count();
+        return;
+    }
+    uint64_t entry = kmer_slot % CountStagingCache::cache_entries;
+    if (count_cache->pending[entry] > 0 && count_cache->slots[entry] != kmer_slot)
+    {
+        hash_table_array[count_cache->slots[entry]].increase_count_by(count_cache->pending[entry]);
+        count_cache->pending[entry] = 0;
+    }
+    count_cache->slots[entry] = kmer_slot;
+    count_cache->pending[entry] += 1;
+    if (count_cache->pending[entry] == CountStagingCache::max_pending)
+    {
+        hash_table_array[kmer_slot].increase_count_by(count_cache->pending[entry]);
+        count_cache->pending[entry] = 0;
+    }
+}
+
+void PointerHashTableCanonicalAVBIG::flush_count_cache(CountStagingCache* count_cache)
+{
+    for (uint64_t entry = 0; entry < CountStagingCache::cache_entries; entry++)
+    {
+        if (count_cache->pending[entry] > 0)
+        {
+            hash_table_array[count_cache->slots[entry]].increase_count_by(count_cache->pending[entry]);
+            count_cache->pending[entry] = 0;
+        }
+    }
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::process_kmer_MT(KMerFactoryCanonical2BC* kmer_factory, RollingHasherDual* hasher, uint64_t predecessor_distance, uint64_t predecessor_slot, bool pred_canonical_during_insertion, CountStagingCache* count_cache)
+{
+    bool predecessor_exists = (predecessor_distance > 0);
+    bool self_canonical_during_insertion = kmer_factory->forward_kmer_is_canonical();
+    uint64_t self_left_chars = get_canonical_left_characters(kmer_factory);
+    uint64_t self_right_chars = get_canonical_right_characters(kmer_factory);
+
+    // Find the initial k-mer slot based on canonical orientation
+    uint64_t initial_position;
+    if (self_canonical_during_insertion){
+        initial_position = hasher->get_current_hash_forward();
+    } else {
+        initial_position = hasher->get_current_hash_backward();
+    }
+    uint64_t kmer_slot = initial_position;
+    uint64_t probe_iteration = 1;
+
+    while (true)
+    {
+        // +++ Empty slot, try to insert +++
+        if (!hash_table_array[kmer_slot].is_occupied())
+        {
+            // k-mers without predecessor are stored in full in the secondary array
+            uint64_t predecessor_for_insertion = predecessor_slot;
+            if (!predecessor_exists)
+                predecessor_for_insertion = reserve_secondary_slot(kmer_factory);
+
+            uint64_t expected_data = 0ULL;
+            if (hash_table_array[kmer_slot].data.compare_exchange_strong(
+                expected_data,
+                kmod::modify_for_insertion_big(expected_data, predecessor_exists, pred_canonical_during_insertion, predecessor_for_insertion, predecessor_distance, self_canonical_during_insertion, self_left_chars, self_right_chars),
+                std::memory_order_acq_rel,
+                std::memory_order_relaxed))
+            {
+                hash_table_array[kmer_slot].increase_count();
+                inserted_items.add();
+                return kmer_slot;
+            }
+            // Some other thread filled the slot first, check the same slot again
+            if (!predecessor_exists)
+                free_secondary_slot(predecessor_for_insertion);
+            continue;
+        }
+
+        // +++ Occupied slot, check if it has the same k-mer +++
+        int quick_result = 0;
+        if (predecessor_exists && hash_table_array[kmer_slot].predecessor_exists())
+            quick_result = quick_kmer_slot_check_sus(kmer_factory, kmer_slot, predecessor_distance, predecessor_slot, pred_canonical_during_insertion);
+        bool this_is_the_correct_slot = (quick_result == 1) || ((quick_result == 0) && full_kmer_slot_check(kmer_factory, kmer_slot));
+
+        if (this_is_the_correct_slot)
+        {
+            stage_count_increase(kmer_slot, count_cache);
+            // If the k-mer is in the secondary array and now has a predecessor, move it to the main array
+            if (predecessor_exists && !hash_table_array[kmer_slot].predecessor_exists())
+            {
+                while(secondary_lock.test_and_set(std::memory_order_acquire));
+                if (!check_for_cycle(predecessor_slot, kmer_slot))
+                {
+                    uint64_t slot_in_secondary = hash_table_array[kmer_slot].get_predecessor_slot();
+                    bool i_did_the_migration = true;
+                    uint64_t expected_data = hash_table_array[kmer_slot].get_data();
+                    while(!hash_table_array[kmer_slot].data.compare_exchange_strong(
+                        expected_data,
+                        kmod::modify_for_migration_big(expected_data, self_left_chars, self_right_chars, predecessor_slot, predecessor_distance, self_canonical_during_insertion, pred_canonical_during_insertion),
+                        std::memory_order_acq_rel,
+                        std::memory_order_relaxed))
+                    {
+                        // Some other thread did the migration already
+                        if (hash_table_array[kmer_slot].predecessor_exists())
+                        {
+                            i_did_the_migration = false;
+                            break;
+                        }
+                    }
+                    if (i_did_the_migration)
+                    {
+                        secondary_free_slots[slot_in_secondary] = 1;
+                        secondary_search_start = std::min(secondary_search_start, slot_in_secondary);
+                        secondary_slots_in_use.subtract();
+                        for (uint64_t o = 0; o < kmer_blocks; o++)
+                            secondary_array[slot_in_secondary*kmer_blocks+o] = 0;
+                    }
+                }
+                secondary_lock.clear(std::memory_order_release);
+            }
+            return kmer_slot;
+        }
+
+        // +++ Wrong k-mer, probe to next slot +++
+        kmer_slot = probe_hasher->probe_4(probe_iteration, kmer_slot, size);
+        probe_iteration += 1;
+        if (kmer_slot >= size)
+            kmer_slot = kmer_slot % size;
+        if (kmer_slot == initial_position){
+            std::cout << "Hash table was full and the k-mer was not found. Resizing is probably needed...\n";
+            std::cout << "At initial position: " << initial_position << " at probe iteration: " << probe_iteration << "\n";
+            exit(1);
+        }
+    }
+}
+
+int PointerHashTableCanonicalAVBIG::quick_kmer_slot_check_sus(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot, uint64_t predecessor_distance, uint64_t predecessor_slot, bool pred_canonical_during_insertion)
+{
+    AtomicVariableSlotSnapshotBIG slot_snapshot = hash_table_array[kmer_slot].snapshot();
+    // Different characters at either end -> different k-mer
+    if (get_canonical_left_characters(kmer_factory) != slot_snapshot.get_left_characters())
+        return -1;
+    if (get_canonical_right_characters(kmer_factory) != slot_snapshot.get_right_characters())
+        return -1;
+    // Same predecessor reached the same way -> same k-mer, otherwise we do not know yet
+    if (predecessor_slot != slot_snapshot.get_predecessor_slot())
+        return 0;
+    if (predecessor_distance != slot_snapshot.get_predecessor_distance())
+        return 0;
+    if (kmer_factory->forward_kmer_is_canonical() != slot_snapshot.canonical_during_insertion_self())
+        return 0;
+    if (pred_canonical_during_insertion != slot_snapshot.canonical_during_insertion_predecessor())
+        return 0;
+    return 1;
+}
+
+bool PointerHashTableCanonicalAVBIG::full_kmer_slot_check(KMerFactoryCanonical2BC* kmer_factory, uint64_t kmer_slot)
+{
+    uint64_t position = kmer_slot;
+    // Characters L...R of the query k-mer have not been checked yet
+    int L = 0;
+    int R = kmer_len - 1;
+    int Lc = 0;
+    bool pir = false;
+    uint64_t slot_char;
+
+    while(true)
+    {
+        AtomicVariableSlotSnapshotBIG position_snapshot = hash_table_array[position].snapshot();
+        // Chain ends in the secondary array
+        if (!position_snapshot.predecessor_exists())
+            break;
+
+        uint64_t left_chars = position_snapshot.get_left_characters();
+        uint64_t right_chars = position_snapshot.get_right_characters();
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, L, slot_char))
+        {
+            if (get_canonical_char(kmer_factory, L) != slot_char)
+                return false;
+            L = L + 1;
+        }
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, R, slot_char))
+        {
+            if (get_canonical_char(kmer_factory, R) != slot_char)
+                return false;
+            R = R - 1;
+        }
+        if (L > R)
+            return true;
+
+        move_frame_to_predecessor(position_snapshot, Lc, pir);
+        position = position_snapshot.get_predecessor_slot();
+    }
+
+    // Check the remaining characters from the secondary array
+    uint64_t secondary_array_position = hash_table_array[position].get_predecessor_slot();
+    while(secondary_lock.test_and_set(std::memory_order_acquire));
+    if (hash_table_array[position].predecessor_exists())
+    {
+        secondary_lock.clear(std::memory_order_release);
+        // Some thread moved the last k-mer in chain from secondary to main during the check, start from the beginning
+        return full_kmer_slot_check(kmer_factory, kmer_slot);
+    }
+    for (int a = L; a <= R; a++)
+    {
+        int b = pir ? (Lc + int(kmer_len) - 1 - a) : (a - Lc);
+        uint64_t array_char = get_secondary_array_char(secondary_array_position, b);
+        if (pir)
+            array_char = twobitstringfunctions::reverse_int(array_char);
+        if (get_canonical_char(kmer_factory, a) != array_char)
+        {
+            secondary_lock.clear(std::memory_order_release);
+            return false;
+        }
+    }
+    secondary_lock.clear(std::memory_order_release);
+    return true;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::get_secondary_array_char(uint64_t secondary_array_position, int char_position)
+{
+    if ((char_position < 0) || (char_position > int(kmer_len) - 1))
+    {
+        std::cout << "Error in checking k-mer in the secondary array\n";
+        exit(1);
+    }
+    uint64_t pos = kmer_len - char_position - 1;
+    uint64_t block = pos / 32;
+    uint64_t block_offset = kmer_blocks - block - 1;
+    uint64_t block_pos = pos % 32;
+    uint64_t return_char = secondary_array[secondary_array_position*kmer_blocks + block_offset];
+    return_char = return_char >> (2*block_pos);
+    return return_char & uint64_t(3);
+}
+
+bool PointerHashTableCanonicalAVBIG::check_for_cycle(uint64_t reconstruction_slot, uint64_t avoid_slot)
+{
+    if (!hash_table_array[reconstruction_slot].is_occupied())
+        return false;
+
+    uint64_t position = reconstruction_slot;
+    int L = 0;
+    int R = kmer_len - 1;
+    int Lc = 0;
+    bool pir = false;
+    uint64_t slot_char;
+
+    while(true)
+    {
+        AtomicVariableSlotSnapshotBIG position_snapshot = hash_table_array[position].snapshot();
+        if (position == avoid_slot)
+            return true;
+        if (!position_snapshot.predecessor_exists())
+            return false;
+
+        uint64_t left_chars = position_snapshot.get_left_characters();
+        uint64_t right_chars = position_snapshot.get_right_characters();
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, L, slot_char))
+            L = L + 1;
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, R, slot_char))
+            R = R - 1;
+        if (L > R)
+            return false;
+
+        move_frame_to_predecessor(position_snapshot, Lc, pir);
+        position = position_snapshot.get_predecessor_slot();
+    }
+}
+
+std::string PointerHashTableCanonicalAVBIG::reconstruct_kmer_in_slot(uint64_t slot)
+{
+    if (!hash_table_array[slot].is_occupied())
+        return "UNOCCUPIED";
+
+    std::string kmer(kmer_len, 'N');
+    uint64_t position = slot;
+    int L = 0;
+    int R = kmer_len - 1;
+    int Lc = 0;
+    bool pir = false;
+    uint64_t slot_char;
+    uint64_t looked_kmers = 0;
+    bool perform_secondary_array_check = true;
+
+    while(true)
+    {
+        AtomicVariableSlotSnapshotBIG position_snapshot = hash_table_array[position].snapshot();
+        if (!position_snapshot.predecessor_exists())
+            break;
+
+        uint64_t left_chars = position_snapshot.get_left_characters();
+        uint64_t right_chars = position_snapshot.get_right_characters();
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, L, slot_char))
+        {
+            kmer[L] = twobitstringfunctions::int2char(slot_char);
+            L = L + 1;
+        }
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, R, slot_char))
+        {
+            kmer[R] = twobitstringfunctions::int2char(slot_char);
+            R = R - 1;
+        }
+        if (L > R)
+        {
+            perform_secondary_array_check = false;
+            break;
+        }
+
+        move_frame_to_predecessor(position_snapshot, Lc, pir);
+        position = position_snapshot.get_predecessor_slot();
+        looked_kmers += 1;
+    }
+
+    if (perform_secondary_array_check)
+    {
+        uint64_t secondary_array_position = hash_table_array[position].get_predecessor_slot();
+        for (int a = L; a <= R; a++)
+        {
+            int b = pir ? (Lc + int(kmer_len) - 1 - a) : (a - Lc);
+            uint64_t array_char = get_secondary_array_char(secondary_array_position, b);
+            if (pir)
+                array_char = twobitstringfunctions::reverse_int(array_char);
+            kmer[a] = twobitstringfunctions::int2char(array_char);
+        }
+    }
+
+    max_kmer_reconstruction_chain = std::max(max_kmer_reconstruction_chain, looked_kmers);
+    total_reconstruction_chain += looked_kmers;
+    number_of_reconstructions += 1;
+    return kmer;
+}
+
+uint64_t PointerHashTableCanonicalAVBIG::count_reconstruction_chain_length_in_slot(uint64_t slot)
+{
+    uint64_t position = slot;
+    int L = 0;
+    int R = kmer_len - 1;
+    int Lc = 0;
+    bool pir = false;
+    uint64_t slot_char;
+    uint64_t chain_length = 0;
+
+    while(true)
+    {
+        AtomicVariableSlotSnapshotBIG position_snapshot = hash_table_array[position].snapshot();
+        if (!position_snapshot.predecessor_exists())
+            break;
+        uint64_t left_chars = position_snapshot.get_left_characters();
+        uint64_t right_chars = position_snapshot.get_right_characters();
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, L, slot_char))
+            L = L + 1;
+        while ((L <= R) && get_frame_char(left_chars, right_chars, Lc, pir, R, slot_char))
+            R = R - 1;
+        if (L > R)
+            break;
+        move_frame_to_predecessor(position_snapshot, Lc, pir);
+        position = position_snapshot.get_predecessor_slot();
+        chain_length += 1;
+    }
+    return chain_length;
+}
+
+void PointerHashTableCanonicalAVBIG::analyze_pointer_chain_lengths()
+{
+    uint64_t chain_lengths = 100000;
+    std::vector<uint64_t> counts(chain_lengths, 0);
+    for (uint64_t i = 0; i < size; i++)
+    {
+        if (hash_table_array[i].is_occupied()){
+            counts[std::min(count_reconstruction_chain_length_in_slot(i), chain_lengths-1)] += 1;
+        } else {
+            counts[0] += 1;
+        }
+    }
+    std::ofstream output_file("KAARME_RECONSTRUCTION_CHAIN_LENGTHS.txt");
+    for (uint64_t i = 0; i < chain_lengths; i++){
+        output_file << i << ":" << counts[i] << "\n";
+    }
+    output_file.close();
+    output_file.clear();
+}
+
+void PointerHashTableCanonicalAVBIG::write_kmers_on_disk(uint64_t min_abundance, std::string& output_path)
+{
+    std::ofstream output_file(output_path);
+    uint64_t kmers_written = 0;
+    uint64_t kmers_skipped = 0;
+    // Chains are short enough to reconstruct every k-mer on its own
+    for (uint64_t i = 0; i < size; i++)
+    {
+        if (!hash_table_array[i].is_occupied())
+            continue;
+        uint64_t count = hash_table_array[i].get_count();
+        if (count >= min_abundance)
+        {
+            output_file << reconstruct_kmer_in_slot(i) << " " << count << "\n";
+            kmers_written += 1;
+        }
+        else
+        {
+            kmers_skipped += 1;
+        }
+    }
+    output_file.close();
+    output_file.clear();
+    std::cout << "Written k-mers: " << kmers_written << "\n";
+    std::cout << "Skipped k-mers: " << kmers_skipped << "\n";
+}
+
+void PointerHashTableCanonicalAVBIG::report_memory_usage()
+{
+    uint64_t slot_bytes = sizeof(OneCharacterAndPointerKMerAtomicVariableBIG);
+    uint64_t secondary_bytes = max_secondary_slots * (kmer_blocks * sizeof(uint64_t) + sizeof(uint8_t));
+    std::cout << "Slot size: " << slot_bytes << " bytes (" << sizeof(OneCharacterAndPointerKMerAtomicVariable<SlotLayoutP38C14>) << " bytes with one character per side)\n";
+    std::cout << "Main array memory: " << slot_bytes * size << " bytes\n";
+    std::cout << "Secondary array memory: " << secondary_bytes << " bytes\n";
+    if (number_of_reconstructions > 0)
+    {
+        std::cout << "Average reconstruction chain length: " << double(total_reconstruction_chain) / double(number_of_reconstructions);
+        std::cout << " (max " << max_kmer_reconstruction_chain << ")\n";
+    }
+}
@@ -0,0 +1,49 @@
+#include "hash_functions.hpp"
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Routes k-mers that all contain the poly-A m-mer to shards by minimizer, like the sharded parser does.
+// Poly-A must not be the minimizer of all of them, otherwise every k-mer goes to one shard.
+int main()
+{
+    const uint64_t k = 31;
+    const uint64_t m = 11;
+    const uint64_t n_shards = 4;
+    const uint64_t n_kmers = 20000;
+    std::mt19937_64 random_generator(31);
+    std::uniform_int_distribution<uint64_t> random_char(0, 3);
+    std::uniform_int_distribution<uint64_t> random_position(0, k - m);
+    CanonicalMinimizerHasher minimizer_hasher(k, m);
+    std::vector<uint64_t> shard_kmers(n_shards, 0);
+
+    for (uint64_t i = 0; i < n_kmers; i++)
+    {
+        std::vector<uint64_t> kmer(k);
+        for (uint64_t j = 0; j < k; j++)
+            kmer[j] = random_char(random_generator);
+        uint64_t poly_a_start = random_position(random_generator);
+        for (uint64_t j = poly_a_start; j < poly_a_start + m; j++)
+            kmer[j] = 0;
+        minimizer_hasher.reset();
+        for (uint64_t c : kmer)
+            minimizer_hasher.push(c);
+        shard_kmers[minimizer_hasher.get_minimizer_hash() % n_shards] += 1;
+    }
+
+    bool failed = false;
+    for (uint64_t s = 0; s < n_shards; s++)
+    {
+        std::cout << "Shard " << s << ": " << shard_kmers[s] << " k-mers\n";
+        // Even routing gives 25% of the k-mers to each shard
+        if (shard_kmers[s] > n_kmers * 2 / 5)
+            failed = true;
+    }
+    if (failed)
+    {
+        std::cout << "K-mers containing poly-A are not spread over the shards\n";
+        return 1;
+    }
+    return 0;
+}